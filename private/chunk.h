@@ -2,6 +2,11 @@
 
 #include "value.h"
 
+typedef struct lox_object_class lox_object_class;
+typedef struct lox_object_closure lox_object_closure;
+typedef struct lox_object_shape lox_object_shape;
+typedef struct lox_hash_table lox_hash_table;
+
 // This enum contains all the opcodes for our virtual machine.
 typedef enum {
   // Dummy opcode for invalid instructions.
@@ -53,6 +58,20 @@ typedef enum {
   OP_MULTIPLY,
   OP_DIVIDE,
   OP_MODULO,
+  // Quickened versions of the arithmetic and comparison operators. The
+  // compiler never emits these: the generic instructions rewrite themselves
+  // into their quickened version after they have been executed with two
+  // numbers, and the quickened versions turn back into the generic ones the
+  // first time they see anything else. Parameters: none
+  OP_ADD_NUM,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_MODULO_NUM,
+  OP_GREATER_NUM,
+  OP_GREATEREQ_NUM,
+  OP_LESS_NUM,
+  OP_LESSEQ_NUM,
   // Prints the value at the top of the stack. Parameters: none
   OP_PRINT,
   // Pops the value off the top of the stack. This is mainly used by expression
@@ -90,6 +109,11 @@ typedef enum {
   // Sets the value of the upvalue with the given index in the current closure.
   // This doesn't modify the stack. Parameters: index (1 byte)
   OP_SET_UPVALUE,
+  // Pushes the value with the given index that the current closure captured
+  // when it was created. Variables that are never assigned after their
+  // declaration are captured by copying their value, since it can't change.
+  // Parameters: index (1 byte)
+  OP_GET_CAPTURE,
   // Closes the upvalue at the top of the stack, moving it to the heap. This
   // appears at the end of a closure's scopes, in order to make all the captured
   // variables persist as long as necessary.
@@ -107,6 +131,15 @@ typedef enum {
   // Jumps backwards unconditionally by a given offset. Parameters: offset (2
   // bytes)
   OP_JMP_BACK,
+  // Jumps to the case of a switch statement whose labels are all integers close
+  // to each other. The switch table with the given index in `chunk->switches`
+  // is indexed with the value on top of the stack, which stays there.
+  // Parameters: table (2 bytes)
+  OP_SWITCH_TABLE,
+  // Same as OP_SWITCH_TABLE, for a switch statement whose labels are all numbers
+  // or strings, which are looked up in the hash table of the switch table.
+  // Parameters: table (2 bytes)
+  OP_SWITCH_HASH,
   // Pushes the value that is on top of the stack to the stack. The values are
   // identical if they are objects. If they are primitive types, changes on one
   // value will not necessarily reflect changes on the other. Parameters: none
@@ -116,15 +149,24 @@ typedef enum {
   // count parameter, and finally the function variable, stored as a
   // lox_object_function. This opcode doesn't actually pop any values from the
   // stack. Instead, the called function acts on the values already present on
-  // the stack. Parameters: arg_count (1 byte)
+  // the stack. Parameters: arg_count (1 byte), call cache (2 bytes)
   OP_CALL,
+  // Same as OP_CALL, for a call whose result is immediately returned. When the
+  // callee is a closure or a bound method, the current frame is reused for the
+  // call instead of pushing a new one, and the callee returns straight to our
+  // caller. It is always followed by an OP_RETURN, which is used when the frame
+  // can't be reused. Parameters: arg_count (1 byte), call cache (2 bytes)
+  OP_TAIL_CALL,
   // Creates a closure for a function. The first parameter is the function that
   // should be wrapped by the closure. Then each captured value : first a byte
-  // to indicate whether it is a local or not, and then a short that holds the
-  // index of the variable. The created closure is pushed onto the stack.
-  // The (is_local, variable_index) part of the parameters is repeated
-  // function->upvalue_count times. Parameters: function (2 bytes), (is_local (1
-  // byte), variable_index (2 bytes)) (variable length)
+  // of flags that tell whether it is a local and whether it is captured by
+  // value, and then a short that holds the index of the variable. The created
+  // closure is pushed onto the stack. The (flags, variable_index) part of the parameters is repeated
+  // function->upvalue_count + function->capture_count times, where the flags
+  // are a combination of LOX_CAPTURE_LOCAL and LOX_CAPTURE_VALUE. Functions
+  // that don't capture anything share a single closure, which is loaded with
+  // OP_CONSTANT instead. Parameters: function (2 bytes), (flags (1 byte),
+  // variable_index (2 bytes)) (variable length)
   OP_CLOSURE,
   // Creates a new class with the name held in the constants table with the
   // given index. The class is pushed onto the stack. Parameters: index (1 byte)
@@ -135,24 +177,156 @@ typedef enum {
   // parameter. This pops the value and the instance off the stack, and pushes
   // the value on the stack, effectively shrinking the stack by one and
   // replacing the slot containing the instance with the value. Parameters:
-  // index (1 byte).
+  // selector (2 bytes), inline cache (2 bytes).
   OP_SET_PROPERTY,
   // Gets a property value from the instance on top of the stack. The name of
-  // the property is pointed to by a constant with a given index. This pops the
-  // instance off the stack, and pushes the value onto the stack. Parameters:
-  // index (1 byte)
+  // the property is given by its selector. This pops the instance off the
+  // stack, and pushes the value onto the stack. Parameters: selector (2
+  // bytes), inline cache (2 bytes)
   OP_GET_PROPERTY,
+  // Adds the closure on top of the stack as a method of the class right under
+  // it, and pops the closure. Parameters: selector (2 bytes)
   OP_METHOD,
+  // Invokes the method or field with the given selector on the instance below
+  // the arguments. Parameters: selector (2 bytes), arg_count (1 byte), inline
+  // cache (2 bytes)
   OP_INVOKE,
+  // Same as OP_INVOKE, for an invocation whose result is immediately returned.
+  // Like OP_TAIL_CALL, the frame pushed for the method replaces the current
+  // one, and it is always followed by an OP_RETURN, which is used when no frame
+  // was pushed. Parameters: selector (2 bytes), arg_count (1 byte), inline
+  // cache (2 bytes)
+  OP_TAIL_INVOKE,
+  // Copies the methods of the superclass (2nd element of the stack) into the
+  // class on top of the stack, and pops the class. Parameters: none
   OP_INHERIT,
+  // Pops the superclass on top of the stack, and replaces the instance under it
+  // with the superclass's method bound to it. Parameters: selector (2 bytes)
   OP_GET_SUPER,
+  // Pops the superclass on top of the stack, and invokes its method on the
+  // instance below the arguments. Parameters: selector (2 bytes), arg_count (1
+  // byte)
   OP_SUPER_INVOKE,
+  // Same as OP_SUPER_INVOKE, for an invocation whose result is immediately
+  // returned, like OP_TAIL_INVOKE. Parameters: selector (2 bytes), arg_count
+  // (1 byte)
+  OP_TAIL_SUPER_INVOKE,
   // Pops the value on top of the stack, pops the current frame, and pushes the
   // initial popped value (the return value) onto the stack. This pops the
   // current frame and goes to the previous frame. Parameters: none
   OP_RETURN,
+  // Superinstructions. The compiler never emits these directly: the optimizer
+  // fuses common sequences of instructions into them once a function has been
+  // compiled, which saves dispatching each instruction of the sequence. See
+  // optimizer.h for which ones are enabled.
+  //
+  // OP_GET_LOCAL followed by OP_GET_LOCAL. Parameters: index (1 byte), index (1
+  // byte)
+  OP_GET_LOCAL_GET_LOCAL,
+  // OP_GET_LOCAL followed by OP_CONSTANT. Parameters: index (1 byte), constant
+  // index (1 byte)
+  OP_GET_LOCAL_CONSTANT,
+  // OP_GET_LOCAL followed by OP_GET_PROPERTY. Parameters: index (1 byte),
+  // selector (2 bytes), inline cache (2 bytes)
+  OP_GET_LOCAL_GET_PROPERTY,
+  // A comparison, followed by OP_JMP_FALSE and the OP_POP of the condition.
+  // These pop both operands, and jump by the given offset if the comparison is
+  // false. The instruction at the destination of the original OP_JMP_FALSE was
+  // the OP_POP of the condition, which the fused instruction jumps over.
+  // Parameters: offset (2 bytes)
+  OP_EQ_JMP_FALSE,
+  OP_NEQ_JMP_FALSE,
+  OP_GREATER_JMP_FALSE,
+  OP_GREATEREQ_JMP_FALSE,
+  OP_LESS_JMP_FALSE,
+  OP_LESSEQ_JMP_FALSE,
 } lox_op_code;
 
+// The variable an OP_CLOSURE captures is a local of the enclosing function,
+// rather than one of the variables its closure captured.
+#define LOX_CAPTURE_LOCAL 1
+// The variable is copied into the closure, rather than referred to through an
+// upvalue.
+#define LOX_CAPTURE_VALUE 2
+
+// The number of receiver layouts an inline cache remembers. The first entry is
+// checked before the others, so a call site that only ever sees one layout
+// (monomorphic) costs a single comparison.
+#define LOX_INLINE_CACHE_SIZE 4
+
+// An inline cache entry remembers how a property was resolved on instances of
+// a given class and shape. Since a shape fully describes the layout of an
+// instance's fields and the methods of a class don't change once it has been
+// declared, any instance with the same class and shape resolves the property
+// the same way.
+typedef struct lox_inline_cache_entry {
+  lox_object_class *clazz;
+  lox_object_shape *shape;
+  // The slot of the field, or -1 if the property is a method.
+  int slot;
+  union {
+    // The method the property resolves to, when `slot` is -1.
+    lox_object_closure *method;
+    // For OP_SET_PROPERTY, the shape the instance moves to when the field is
+    // added, or NULL if the field already exists.
+    lox_object_shape *transition;
+  } as;
+} lox_inline_cache_entry;
+
+// The cache of a property access, property assignment or method invocation.
+// Entries are added as new receivers are seen, until the cache is full, after
+// which the instruction always takes the slow path.
+typedef struct lox_inline_cache {
+  lox_inline_cache_entry entries[LOX_INLINE_CACHE_SIZE];
+  int count;
+  int hits;
+  int misses;
+} lox_inline_cache;
+
+DECLARE_LOX_ARRAY(lox_inline_cache, inline_cache_array);
+
+// The cache of a call site, which remembers the last callee it called and what
+// calling it resolved to. A call site always passes the same number of
+// arguments, so once a call succeeded, the arity of the callee is known to
+// match, and calling the same object again skips the type dispatch, the arity
+// check and, for classes, the lookup of the initializer. Bound methods are
+// never cached, since a new one is created each time a method is accessed.
+typedef struct lox_call_cache {
+  // The closure, class or native function the cache was filled for, or NULL.
+  lox_object *callee;
+  union {
+    // For a closure, the closure itself. For a class, its initializer, or NULL
+    // if it doesn't have one.
+    lox_object_closure *closure;
+    // For a native function, the C function it wraps.
+    lox_value (*native)(int arg_count, lox_value *args);
+  } as;
+  int hits;
+  int misses;
+} lox_call_cache;
+
+DECLARE_LOX_ARRAY(lox_call_cache, call_cache_array);
+
+// Where a switch statement whose labels are all constants goes for each value,
+// which OP_SWITCH_TABLE and OP_SWITCH_HASH look up instead of comparing the
+// value with each label in turn.
+typedef struct lox_switch_table {
+  // The offsets of the instructions the switch can jump to. The first one is
+  // where values that no case matches go, that is the default case or the end
+  // of the switch.
+  lox_int_array targets;
+  // For OP_SWITCH_TABLE, the index in `targets` of the case of each integer
+  // from `first` onwards.
+  double first;
+  lox_int_array cases;
+  // For OP_SWITCH_HASH, maps the label of each case to the index of the case
+  // in `targets`, or NULL. The labels are also constants of the chunk, which
+  // keeps them alive.
+  lox_hash_table *labels;
+} lox_switch_table;
+
+DECLARE_LOX_ARRAY(lox_switch_table, switch_table_array);
+
 typedef struct lox_chunk {
   // The line number of the previous byte that was written to the chunk. This is
   // used to store the lines using run-length encoding in `lines`.
@@ -173,6 +347,14 @@ typedef struct lox_chunk {
   // `lines[n]` is equal to the number of instructions on the line n+1.
   lox_int_array lines;
   lox_value_array constants;
+  // The inline caches of the instructions that access properties, which refer
+  // to them by index.
+  lox_inline_cache_array caches;
+  // The caches of OP_CALL and OP_TAIL_CALL, which refer to them by index.
+  lox_call_cache_array calls;
+  // The tables of the switch statements, which OP_SWITCH_TABLE and
+  // OP_SWITCH_HASH refer to by index.
+  lox_switch_table_array switches;
 } lox_chunk;
 
 // Initializes all the fields of a chunk.
@@ -186,9 +368,45 @@ void lox_chunk_write(lox_chunk *chunk, uint8_t byte, int line);
 // `write_to_chunk`
 void lox_chunk_write_array(lox_chunk *chunk, uint8_t *bytes, int size,
                            int line);
+// Removes the bytes of the chunk from `size` onwards, along with their lines.
+void lox_chunk_truncate(lox_chunk *chunk, int size);
 // Adds a constant to the chunk. The constant's index is returned, which
 // corresponds to its index in `chunk->constants`
 int lox_chunk_add_constant(lox_chunk *chunk, lox_value value);
 
+// Adds an empty inline cache to the chunk, and returns its index.
+int lox_chunk_add_inline_cache(lox_chunk *chunk);
+
+// Adds an empty call cache to the chunk, and returns its index.
+int lox_chunk_add_call_cache(lox_chunk *chunk);
+
+// Adds an empty switch table to the chunk, and returns its index.
+int lox_chunk_add_switch_table(lox_chunk *chunk);
+// Returns the table of the switch instruction at the given offset, or NULL if
+// the instruction isn't OP_SWITCH_TABLE or OP_SWITCH_HASH.
+lox_switch_table *lox_chunk_switch_table(lox_chunk *chunk, int offset);
+// Returns the offset of the case the switch instruction at the given offset
+// jumps to for the given value.
+int lox_chunk_switch_target(lox_chunk *chunk, int offset, lox_value value);
+
+// Returns the length in bytes of the instruction at the given offset, including
+// its parameters.
+int lox_chunk_instruction_length(lox_chunk *chunk, int offset);
+
+// Returns the offset of the destination of the jump at the given offset, or -1
+// if the instruction isn't a jump.
+int lox_chunk_jump_target(lox_chunk *chunk, int offset);
+
+// Returns how many values the instruction at the given offset pushes onto the
+// stack, minus how many it pops. For calls, the values the callee pushes in its
+// own frame aren't counted.
+int lox_chunk_stack_effect(lox_chunk *chunk, int offset);
+
+// Returns the largest number of values the chunk can have on the stack at once,
+// given the number of values on the stack when it starts running. This follows
+// every path through the bytecode, adding up the stack effect of each
+// instruction.
+int lox_chunk_max_stack_size(lox_chunk *chunk, int initial_size);
+
 // Returns the 0-indexed line number of an instruction at the given offset.
 int lox_chunk_get_offset_line(lox_chunk *chunk, int instruction_offset);
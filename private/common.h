@@ -8,9 +8,29 @@ struct lox_settings {
   int array_minimum_capacity;
   int array_scale_factor;
   int gc_heap_grow_factor;
+  // How many bytes can be allocated between two collections of the young
+  // list. 0 disables them, and every collection is a full one.
+  int gc_young_size;
+  // How many objects a slice of an incremental full collection marks or
+  // sweeps. 0 makes full collections stop the world.
+  int gc_slice_budget;
+  // Whether every allocation collects the whole heap, set with -G. This finds
+  // the objects that are used while nothing refers to them.
+  int gc_stress;
   float hash_table_load_factor;
   int initial_stack_size;
+  // The stack and the call frames grow as needed, up to these limits.
+  int max_stack_size;
+  int initial_call_frames;
+  int max_call_frames;
   int max_local_count;
+  int jit_threshold;
+  int jit_loop_threshold;
+  // Which optimizations the compiler runs, set with -O<level>.
+  int optimization_level;
+  // Whether the bytecode of each function is printed once it is compiled,
+  // along with the number of bytes the peephole optimizer saved, set with -d.
+  int print_code;
 };
 
 extern struct lox_settings lox_settings;
@@ -18,10 +38,20 @@ extern struct lox_settings lox_settings;
 #define LOX_ARRAY_MIN_CAPACITY lox_settings.array_minimum_capacity
 #define LOX_ARRAY_SCALE_FACTOR lox_settings.array_scale_factor
 #define LOX_GC_HEAP_GROW_FACTOR lox_settings.gc_heap_grow_factor
+#define LOX_GC_YOUNG_SIZE lox_settings.gc_young_size
+#define LOX_GC_SLICE_BUDGET lox_settings.gc_slice_budget
+#define LOX_GC_STRESS lox_settings.gc_stress
 #define LOX_HASH_TABLE_LOAD_FACTOR lox_settings.hash_table_load_factor
 #define LOX_INITIAL_STACK_SIZE lox_settings.initial_stack_size
-#define LOX_MAX_CALL_FRAMES 64
+#define LOX_MAX_STACK_SIZE lox_settings.max_stack_size
+#define LOX_INITIAL_CALL_FRAMES lox_settings.initial_call_frames
+#define LOX_MAX_CALL_FRAMES lox_settings.max_call_frames
 #define LOX_MAX_LOCAL_COUNT lox_settings.max_local_count
+#define LOX_JIT_THRESHOLD lox_settings.jit_threshold
+#define LOX_JIT_LOOP_THRESHOLD lox_settings.jit_loop_threshold
+#define LOX_OPTIMIZATION_LEVEL lox_settings.optimization_level
+#define LOX_PRINT_CODE lox_settings.print_code
+#define LOX_MAX_SHAPE_SLOTS 64
 
 #define LOX_OBJECT_STRING_FLAG_COPY 1
 #define LOX_OBJECT_STRING_FLAG_CONSTANT 2
@@ -34,4 +64,5 @@ extern struct lox_settings lox_settings;
 #define DEBUG_PRINT_CODE
 #define DEBUG_PRINT_CODE_VERBOSE
 // #define DEBUG_PRINT_SETTINGS
+// #define DEBUG_PRINT_INLINE_CACHES
 #endif
@@ -14,12 +14,18 @@ typedef struct {
   // If true, it means that this variable was created using `const`, and thus
   // cannot be modified.
   bool is_constant;
+  // If true, a closure refers to this variable through an upvalue, which has
+  // to be closed when the variable goes out of scope.
   bool is_captured;
 } lox_local;
 
 typedef struct {
   uint16_t index;
   bool is_local;
+  // Whether the variable is copied into the closure, and the index of the
+  // variable among the upvalues or among the values of the closure.
+  bool by_value;
+  int slot;
 } lox_up_value;
 
 typedef enum {
@@ -30,6 +36,7 @@ typedef enum {
 } lox_function_type;
 
 DECLARE_LOX_ARRAY(lox_local, local_array);
+DECLARE_LOX_ARRAY(lox_token, token_array);
 
 typedef struct lox_compiler lox_compiler;
 typedef struct lox_class_compiler lox_class_compiler;
@@ -42,7 +49,9 @@ typedef struct lox_compiler {
   lox_local_array locals;
   // Hash table that associates a global variable index with a value. If an
   // entry for an index exists, it means that the global variable associated
-  // with the index has been created with `const`.
+  // with the index has been created with `const`. The value is the literal the
+  // variable was initialized with, which its uses load directly, or empty if
+  // the initializer wasn't a literal.
   lox_hash_table global_constants;
   // Arrays of break jumps that we have to patch.
   lox_int_array breaks;
@@ -50,6 +59,12 @@ typedef struct lox_compiler {
   int scope_depth;
   int continue_depth;
   int break_depth;
+  // The offset of the last OP_CALL, OP_INVOKE or OP_SUPER_INVOKE, which
+  // becomes its tail variant if its result is returned right away.
+  int last_call;
+  // The offset of the first instruction of the left operand of the infix
+  // operator being compiled.
+  int operand_start;
 } lox_compiler;
 
 typedef struct lox_class_compiler {
@@ -7,6 +7,14 @@
 void lox_disassemble_chunk(lox_chunk *chunk, const char *name);
 // Disassembles an instruction. This prints the instruction to standard output.
 int lox_disassemble_instruction(lox_chunk *chunk, int offset);
+// Prints the hit and miss counters of every inline cache and call cache in a
+// chunk.
+void lox_print_inline_caches(lox_chunk *chunk, const char *name);
+// Prints the caches of the functions in a list of objects, either all of them
+// or only the ones the garbage collector didn't mark. This is called before
+// they are swept, since sweeping can free their names first, and possibly on
+// another thread.
+void lox_print_function_caches(lox_object *objects, bool only_unmarked);
 
 lox_value lox_get_global_name(uint16_t global);
 lox_value lox_get_local_name(uint16_t local);
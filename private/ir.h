@@ -0,0 +1,20 @@
+#pragma once
+
+#include "chunk.h"
+
+// Optimizes the bytecode of a function once it has been compiled, at -O1 and
+// above. The bytecode is lifted into a control flow graph of basic blocks, in
+// which every stack slot, global and upvalue holds a numbered value in SSA
+// form. The optimizations below are decided on that graph, and the function is
+// then lowered back to bytecode, with its jumps and lines updated:
+// - Global value numbering: an expression or a load whose value is already in
+//   a stack slot reads that slot instead.
+// - Loop-invariant code motion: the globals an inner loop reads but can't
+//   write are loaded once before the loop, into new stack slots.
+// - Dead code elimination: unreachable blocks, branches on conditions whose
+//   truthiness is known, stores to locals that are never read again, and
+//   expressions whose value is discarded and that can't fail are removed.
+// Functions whose bytecode can't be analyzed are left as they are. This runs
+// before lox_optimize_chunk fuses instructions. `arity` is the number of
+// parameters of the function.
+void lox_ir_optimize(lox_chunk *chunk, int arity);
@@ -0,0 +1,68 @@
+#pragma once
+
+#ifdef LOX_JIT
+
+#include "object.h"
+#include "vm.h"
+#include <stdint.h>
+
+// The native code of a function, generated by stitching together a template of
+// machine code for each of its instructions. The templates keep the operand
+// stack in memory, exactly where the interpreter expects it, so that the
+// interpreter can take over at the start of any instruction.
+typedef struct lox_jit_code {
+  uint8_t *code;
+  size_t size;
+  // The address of the template of each instruction, indexed by the offset of
+  // the instruction in the bytecode. Offsets in the middle of an instruction
+  // are NULL.
+  uint8_t **entries;
+  int entry_count;
+} lox_jit_code;
+
+// A loop of a function, which is traced once it has run enough iterations. A
+// trace is the path that one iteration of the loop took through the bytecode,
+// compiled to native code that runs the loop over and over. Each value is
+// checked once by the trace, and branches that don't go the same way as when
+// the loop was recorded leave the trace.
+typedef struct lox_jit_loop {
+  // The offset of the first instruction of the loop, where its OP_JMP_BACK
+  // goes.
+  int header;
+  // Counts down the iterations until the loop is recorded. The native code of
+  // the function leaves to the interpreter at the back edge once this is
+  // negative, so that the loop can be recorded or its trace run.
+  int counter;
+  uint8_t *trace;
+  size_t trace_size;
+  uint8_t *trace_entry;
+} lox_jit_loop;
+
+// Whether a loop is being recorded, in which case lox_jit_record has to be
+// called before each instruction.
+extern bool lox_jit_recording;
+
+// Compiles a function to x86-64 machine code, and stores it in function->jit.
+// Returns false if the code couldn't be made executable, in which case the
+// function stays interpreted.
+bool lox_jit_compile(lox_object_function *function);
+// Frees the native code of a function and of its loops.
+void lox_jit_free(lox_object_function *function);
+
+// Runs the native code of the function of a frame, starting at the instruction
+// at `ip`. This returns the address of the first instruction the native code
+// can't run on its own, which the interpreter has to run. Instructions that
+// aren't supported by the templates, calls, returns, and instructions whose
+// operands have unexpected types all go back to the interpreter, which also
+// takes care of reporting runtime errors.
+uint8_t *lox_jit_run(lox_call_frame *frame, uint8_t *ip);
+
+// Called by the interpreter when it jumps back to the header of a loop, at
+// `ip`. This runs the trace of the loop if it has one, and starts recording it
+// once it is hot. Returns the address of the instruction to run next.
+uint8_t *lox_jit_jump_back(lox_call_frame *frame, uint8_t *ip);
+void lox_jit_record(lox_call_frame *frame, uint8_t *ip);
+// Stops recording, when the stack is reset after a runtime error.
+void lox_jit_reset();
+
+#endif
@@ -28,8 +28,49 @@ void *lox_reallocate(void *ptr, ssize_t old_size, ssize_t new_size);
 int lox_grow_capacity(int capacity);
 
 void collect_garbage();
+// Collects the objects on the young list, which are the ones allocated since
+// the last garbage collection, and moves the ones that are still reachable to
+// the old list.
+void collect_young();
+// Does one slice of the incremental full collection in progress, marking or
+// sweeping up to LOX_GC_SLICE_BUDGET objects.
+void lox_gc_step();
+// Finishes the incremental full collection in progress, if there is one.
+void lox_gc_finish();
+// Has to be called after an object is changed in a way that can make it refer
+// to objects it didn't refer to before. An old object is added to the
+// remembered set, so that the next collection of the young generation looks at
+// the objects it refers to, and a marked object is marked again by the
+// incremental collection in progress.
+void lox_gc_remember(lox_object *obj);
+// Marks `value` if the incremental marking in progress has marked `owner`.
+void lox_gc_mark_barrier(lox_object *owner, lox_object *value);
+
 void mark_roots();
 void mark_value(lox_value value);
 void mark_object(lox_object *obj);
 void mark_table(lox_hash_table *table);
 void mark_value_array(lox_value_array *array);
+
+// Has to be called after storing `value` in `owner`. A collection of the young
+// generation doesn't look at old objects, unless they are remembered, and the
+// incremental marking never looks at a marked object twice, so a marked object
+// can't be left referring to an unmarked one. Outside of the incremental
+// marking, every object that can be reached has the same mark.
+static inline void lox_gc_write_barrier_object(lox_object *owner,
+                                               lox_object *value) {
+  if (value == NULL)
+    return;
+  if (owner->is_old && !owner->is_remembered && !value->is_old) {
+    lox_gc_remember(owner);
+  }
+  if (owner->is_marked != value->is_marked) {
+    lox_gc_mark_barrier(owner, value);
+  }
+}
+
+static inline void lox_gc_write_barrier(lox_object *owner, lox_value value) {
+  if (lox_value_is_object(value)) {
+    lox_gc_write_barrier_object(owner, lox_value_as_object(value));
+  }
+}
@@ -16,6 +16,7 @@ typedef enum : uint8_t {
   OBJ_CLASS,
   OBJ_INSTANCE,
   OBJ_BOUND_METHOD,
+  OBJ_SHAPE,
 } lox_object_type;
 
 // Forward reference lox_object so we can have it contain a pointer to another
@@ -26,12 +27,18 @@ typedef struct lox_value lox_value;
 typedef struct lox_object_upvalue lox_object_upvalue;
 typedef struct lox_value lox_value;
 typedef struct lox_hash_table lox_hash_table;
+typedef struct lox_object_shape lox_object_shape;
 
 // Base object struct. Every object in lox, that is every value that isn't a
 // literal (number, boolean, nil), is represented by a child of lox_object.
 typedef struct lox_object {
   lox_object_type type;
   bool is_marked;
+  // Whether the object survived a garbage collection, after which it is only
+  // collected by full collections. See collect_young.
+  bool is_old;
+  // Whether the object is old and in vm.remembered.
+  bool is_remembered;
   lox_object *next;
 } lox_object;
 
@@ -53,15 +60,34 @@ typedef struct lox_object_function {
   lox_object object;
   lox_chunk chunk;
   lox_object_string *name;
+  // The number of variables the function captures through upvalues, and the
+  // number of variables it captures by value, see OP_GET_CAPTURE.
   int upvalue_count;
+  int capture_count;
   int arity;
+  // The largest number of values a call to the function has on the stack at
+  // once, starting from the function itself. It is computed by the compiler so
+  // that the stack only has to grow when a function is called.
+  int max_stack_size;
+#ifdef LOX_JIT
+  // How many times the function was called or jumped back in a loop. It is
+  // compiled to native code once this reaches LOX_JIT_THRESHOLD.
+  int hotness;
+  struct lox_jit_code *jit;
+  // The loops of the function, found once one of them is hot.
+  struct lox_jit_loop *loops;
+  int loop_count;
+#endif
 } lox_object_function;
 
 typedef struct lox_object_closure {
   lox_object object;
   lox_object_function *function;
-  lox_object_upvalue **upvalues;
   int upvalue_count;
+  int capture_count;
+  // The upvalues are allocated along with the closure, and are followed by the
+  // values it captured, see lox_object_closure_captures.
+  lox_object_upvalue *upvalues[];
 } lox_object_closure;
 
 typedef struct lox_object_upvalue {
@@ -83,12 +109,43 @@ typedef struct lox_object_native {
 typedef struct lox_object_class {
   lox_object object;
   lox_object_string *name;
-  lox_hash_table *methods;
+  // The methods of the class, indexed by selector. An entry is NULL if the
+  // class has no method for that selector, as are all the selectors past
+  // `method_capacity`.
+  lox_object_closure **methods;
+  int method_capacity;
 } lox_object_class;
 
+// A shape (also known as a hidden class) describes the layout of the fields of
+// an instance, that is which field lives in which slot. Shapes are shared by
+// every instance that had the same fields added in the same order, and form a
+// tree rooted at `vm.root_shape`: adding a field to an instance moves it from
+// its current shape to the child shape reached by the transition for the
+// field's name.
+typedef struct lox_object_shape {
+  lox_object object;
+  lox_object_shape *parent;
+  // The name of the field added by the transition from `parent` to this shape.
+  // This is empty for the root shape.
+  lox_value name;
+  // Maps the name of every field of this shape to the index of its slot.
+  lox_hash_table *slots;
+  // Maps the name of a field to the shape obtained by adding that field to
+  // this shape.
+  lox_hash_table *transitions;
+  int slot_count;
+} lox_object_shape;
+
 typedef struct lox_object_instance {
   lox_object object;
   lox_object_class *clazz;
+  // The shape that describes the layout of `slots`. This is NULL when the
+  // instance is in dictionary mode, in which case its fields are stored in
+  // `fields` instead. Instances switch to dictionary mode when their fields are
+  // removed, or when they have too many fields for shapes to be worth it.
+  lox_object_shape *shape;
+  lox_value *slots;
+  int slot_capacity;
   lox_hash_table *fields;
 } lox_object_instance;
 
@@ -160,12 +217,105 @@ void lox_object_upvalue_free(lox_object_upvalue *obj);
 lox_object_class *lox_object_class_new(lox_object_string *name);
 void lox_object_class_print(lox_object_class *obj);
 void lox_object_class_free(lox_object_class *obj);
+// Sets the method of a class for the given selector.
+void lox_object_class_set_method(lox_object_class *obj, uint16_t selector,
+                                 lox_object_closure *method);
+// Copies every method of `superclass` into `obj`.
+void lox_object_class_inherit(lox_object_class *obj,
+                              lox_object_class *superclass);
+
+lox_object_shape *lox_object_shape_new(lox_object_shape *parent,
+                                       lox_value name);
+// Returns the shape obtained by adding a field with the given name to `shape`,
+// creating it if this transition has never been taken before.
+lox_object_shape *lox_object_shape_transition(lox_object_shape *shape,
+                                              lox_value name);
+// Returns the index of the slot holding the field with the given name, or -1
+// if the shape has no such field.
+int lox_object_shape_get_slot(lox_object_shape *shape, lox_value name);
+void lox_object_shape_free(lox_object_shape *obj);
 
 lox_object_instance *lox_object_instance_new(lox_object_class *clazz);
 void lox_object_instance_print(lox_object_instance *obj);
 void lox_object_instance_free(lox_object_instance *obj);
+// Retrieves the value of a field. Returns false if the instance has no field
+// with the given name, in which case `value` is unmodified.
+bool lox_object_instance_get_field(lox_object_instance *obj, lox_value name,
+                                   lox_value *value);
+// Sets the value of a field, adding the field if it doesn't exist yet.
+void lox_object_instance_set_field(lox_object_instance *obj, lox_value name,
+                                   lox_value value);
+// Adds a field by moving the instance to `shape`, which must be the result of a
+// transition from the instance's current shape. `value` is stored in the slot
+// of the new field.
+void lox_object_instance_transition(lox_object_instance *obj,
+                                    lox_object_shape *shape, lox_value value);
+// Removes a field. Returns false if the instance has no field with the given
+// name.
+bool lox_object_instance_remove_field(lox_object_instance *obj,
+                                      lox_value name);
+bool lox_object_instance_has_field(lox_object_instance *obj, lox_value name);
+// Moves the fields of an instance from its slots to a hash table.
+void lox_object_instance_make_dictionary(lox_object_instance *obj);
 
 lox_object_bound_method *
 lox_object_bound_method_new(lox_value receiver, lox_object_closure *method);
 void lox_object_bound_method_print(lox_object_bound_method *obj);
 void lox_object_bound_method_free(lox_object_bound_method *obj);
+
+// Helper functions to check if a lox_value is a specific child of lox_object
+// Returns the method of a class for the given selector, or NULL if it has none.
+static inline lox_object_closure *
+lox_object_class_get_method(lox_object_class *obj, uint16_t selector) {
+  return selector < obj->method_capacity ? obj->methods[selector] : NULL;
+}
+
+// Returns the values a closure captured by value, which follow its upvalues.
+static inline lox_value *
+lox_object_closure_captures(lox_object_closure *obj) {
+  return (lox_value *)&obj->upvalues[obj->upvalue_count];
+}
+
+// Returns the entry of an inline cache that matches the class and shape of an
+// instance, or NULL on a miss.
+static inline lox_inline_cache_entry *
+lox_inline_cache_find(lox_inline_cache *cache, lox_object_instance *inst) {
+  for (int i = 0; i < cache->count; i++) {
+    lox_inline_cache_entry *entry = &cache->entries[i];
+    if (entry->shape == inst->shape && entry->clazz == inst->clazz) {
+      cache->hits++;
+      return entry;
+    }
+  }
+  cache->misses++;
+  return NULL;
+}
+
+static inline bool lox_value_is_object_type(lox_value value,
+                                            lox_object_type type) {
+  return lox_value_is_object(value) && lox_value_as_object(value)->type == type;
+}
+static inline bool lox_value_is_string(lox_value value) {
+  return lox_value_is_object_type(value, OBJ_STRING);
+}
+static inline bool lox_value_is_function(lox_value value) {
+  return lox_value_is_object_type(value, OBJ_FUNCTION);
+}
+static inline bool lox_value_is_native(lox_value value) {
+  return lox_value_is_object_type(value, OBJ_NATIVE);
+}
+static inline bool lox_value_is_closure(lox_value value) {
+  return lox_value_is_object_type(value, OBJ_CLOSURE);
+}
+static inline bool lox_value_is_upvalue(lox_value value) {
+  return lox_value_is_object_type(value, OBJ_UPVALUE);
+}
+static inline bool lox_value_is_class(lox_value value) {
+  return lox_value_is_object_type(value, OBJ_CLASS);
+}
+static inline bool lox_value_is_instance(lox_value value) {
+  return lox_value_is_object_type(value, OBJ_INSTANCE);
+}
+static inline bool lox_value_is_bound_method(lox_value value) {
+  return lox_value_is_object_type(value, OBJ_BOUND_METHOD);
+}
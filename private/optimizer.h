@@ -0,0 +1,15 @@
+#pragma once
+
+#include "chunk.h"
+
+// Simplifies the bytecode of a chunk once it has been compiled, and returns the
+// number of bytes it saved. Jumps that land on other jumps go straight to where
+// those end up, code that can't be reached is removed, and so are sequences of
+// instructions that have no effect, like a value that is pushed and then
+// popped, or a variable that is loaded right after being stored. Jump offsets
+// and line information are updated to match the new bytecode.
+int lox_optimize_peephole(lox_chunk *chunk);
+// Rewrites the bytecode of a chunk once it has been compiled. This fuses
+// common pairs of instructions into superinstructions, and then updates jump
+// offsets and line information to match the new bytecode.
+void lox_optimize_chunk(lox_chunk *chunk);
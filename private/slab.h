@@ -0,0 +1,39 @@
+#pragma once
+
+#include "common.h"
+#include <stddef.h>
+
+// The size and alignment of a slab, which is a page of blocks of the same
+// size.
+#define LOX_SLAB_SIZE 4096
+// Blocks are sized in multiples of this, which is also their alignment.
+#define LOX_SLAB_GRANULE 16
+// The largest block a slab holds. Anything bigger is allocated on its own with
+// malloc.
+#define LOX_SLAB_MAX_SIZE 256
+#define LOX_SLAB_CLASS_COUNT (LOX_SLAB_MAX_SIZE / LOX_SLAB_GRANULE)
+
+// Whether a block of the given size is allocated from a slab.
+static inline bool lox_slab_is_small(size_t size) {
+  return size > 0 && size <= LOX_SLAB_MAX_SIZE;
+}
+
+// Whether blocks of the two sizes come from the same size class, in which case
+// a block of one size can be used as is for the other.
+static inline bool lox_slab_same_class(size_t a, size_t b) {
+  return (a - 1) / LOX_SLAB_GRANULE == (b - 1) / LOX_SLAB_GRANULE;
+}
+
+// Returns a block of `size` bytes, which has to be small.
+void *lox_slab_alloc(size_t size);
+// Gives a block back to the slab it was allocated from. `size` has to be the
+// size it was allocated with.
+void lox_slab_free(void *ptr, size_t size);
+// Same as lox_slab_free, but can be called by the thread that sweeps while the
+// main thread allocates. The block is only given back by lox_slab_flush.
+void lox_slab_free_deferred(void *ptr, size_t size);
+// Gives back the blocks freed with lox_slab_free_deferred. Has to be called by
+// the main thread once the thread that sweeps is done.
+void lox_slab_flush();
+// Frees every slab.
+void lox_slab_free_all();
@@ -1,11 +1,42 @@
 #pragma once
 
 #include "array.h"
-#include <stddef.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 typedef struct lox_object lox_object;
 
+#ifdef LOX_NAN_BOXING
+
+// When LOX_NAN_BOXING is defined, every lox_value is packed into the 64 bits of
+// a double. Numbers are stored as-is, and every other value is hidden inside
+// the unused payload of a quiet NaN. Objects set the sign bit and store their
+// pointer in the low 48 bits, while the singleton values (nil, true, false,
+// empty) are identified by a small tag in the lowest bits. We keep the bits in
+// a struct rather than a bare integer so that lox_value stays a distinct type.
+typedef struct lox_value {
+  uint64_t bits;
+} lox_value;
+
+#define LOX_VALUE_SIGN_BIT ((uint64_t)0x8000000000000000)
+#define LOX_VALUE_QNAN ((uint64_t)0x7ffc000000000000)
+
+// The tags are chosen so that nil and false only differ by their lowest bit,
+// which makes lox_is_falsey a single comparison.
+#define LOX_VALUE_TAG_TRUE 1
+#define LOX_VALUE_TAG_NIL 2
+#define LOX_VALUE_TAG_FALSE 3
+#define LOX_VALUE_TAG_EMPTY 4
+
+#define LOX_VALUE_TRUE_BITS (LOX_VALUE_QNAN | LOX_VALUE_TAG_TRUE)
+#define LOX_VALUE_NIL_BITS (LOX_VALUE_QNAN | LOX_VALUE_TAG_NIL)
+#define LOX_VALUE_FALSE_BITS (LOX_VALUE_QNAN | LOX_VALUE_TAG_FALSE)
+#define LOX_VALUE_EMPTY_BITS (LOX_VALUE_QNAN | LOX_VALUE_TAG_EMPTY)
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
@@ -30,27 +61,163 @@ typedef struct lox_value {
   } as;
 } lox_value;
 
+#endif
+
 DECLARE_LOX_ARRAY(lox_value, value_array);
 
 // Helper function to print a `lox_value`
 void lox_print_value(lox_value value);
 
-// Helper functions to create a lox_value from a certain type.
-lox_value lox_value_from_bool(bool val);
-lox_value lox_value_from_nil();
-lox_value lox_value_from_number(double val);
-lox_value lox_value_from_object(lox_object *object);
-lox_value lox_value_from_empty();
-
 uint32_t lox_value_hash(lox_value value);
 uint32_t lox_value_hash_number(double number);
 
-// Helper functions to check if a lox_value is a specific child of lox_object
-bool lox_value_is_object(lox_value value);
-bool lox_value_is_string(lox_value value);
-bool lox_value_is_function(lox_value value);
-bool lox_value_is_native(lox_value value);
-bool lox_value_is_closure(lox_value value);
-bool lox_value_is_upvalue(lox_value value);
-bool lox_value_is_class(lox_value value);
-bool lox_value_is_instance(lox_value value);
+// The helpers below are defined in the header so that they can be inlined
+// everywhere, since they are used by pretty much every instruction.
+#ifdef LOX_NAN_BOXING
+
+static inline uint64_t lox_value_double_to_bits(double val) {
+  uint64_t bits;
+  memcpy(&bits, &val, sizeof(double));
+  return bits;
+}
+
+static inline double lox_value_bits_to_double(uint64_t bits) {
+  double val;
+  memcpy(&val, &bits, sizeof(double));
+  return val;
+}
+
+// Helper functions to create a lox_value from a certain type.
+static inline lox_value lox_value_from_bool(bool val) {
+  return (lox_value){val ? LOX_VALUE_TRUE_BITS : LOX_VALUE_FALSE_BITS};
+}
+static inline lox_value lox_value_from_nil() {
+  return (lox_value){LOX_VALUE_NIL_BITS};
+}
+static inline lox_value lox_value_from_number(double val) {
+  return (lox_value){lox_value_double_to_bits(val)};
+}
+static inline lox_value lox_value_from_object(lox_object *object) {
+  return (lox_value){LOX_VALUE_SIGN_BIT | LOX_VALUE_QNAN |
+                     (uint64_t)(uintptr_t)object};
+}
+static inline lox_value lox_value_from_empty() {
+  return (lox_value){LOX_VALUE_EMPTY_BITS};
+}
+
+// Helper functions to check the type of a lox_value.
+static inline bool lox_value_is_bool(lox_value value) {
+  return value.bits == LOX_VALUE_TRUE_BITS ||
+         value.bits == LOX_VALUE_FALSE_BITS;
+}
+static inline bool lox_value_is_nil(lox_value value) {
+  return value.bits == LOX_VALUE_NIL_BITS;
+}
+static inline bool lox_value_is_number(lox_value value) {
+  return (value.bits & LOX_VALUE_QNAN) != LOX_VALUE_QNAN;
+}
+static inline bool lox_value_is_object(lox_value value) {
+  return (value.bits & (LOX_VALUE_QNAN | LOX_VALUE_SIGN_BIT)) ==
+         (LOX_VALUE_QNAN | LOX_VALUE_SIGN_BIT);
+}
+static inline bool lox_value_is_empty(lox_value value) {
+  return value.bits == LOX_VALUE_EMPTY_BITS;
+}
+
+// Helper functions to retrieve the contents of a lox_value. These assume that
+// the value has the right type.
+static inline bool lox_value_as_bool(lox_value value) {
+  return value.bits == LOX_VALUE_TRUE_BITS;
+}
+static inline double lox_value_as_number(lox_value value) {
+  return lox_value_bits_to_double(value.bits);
+}
+static inline lox_object *lox_value_as_object(lox_value value) {
+  return (lox_object *)(uintptr_t)(value.bits &
+                                   ~(LOX_VALUE_SIGN_BIT | LOX_VALUE_QNAN));
+}
+
+// Returns true if the value is nil or false.
+static inline bool lox_is_falsey(lox_value value) {
+  return (value.bits | 1) == LOX_VALUE_FALSE_BITS;
+}
+
+static inline bool lox_values_equal(lox_value lhs, lox_value rhs) {
+  // NaN is never equal to itself, so numbers have to be compared as doubles.
+  if (lox_value_is_number(lhs) && lox_value_is_number(rhs))
+    return lox_value_as_number(lhs) == lox_value_as_number(rhs);
+  return lhs.bits == rhs.bits;
+}
+
+#else
+
+// Helper functions to create a lox_value from a certain type.
+static inline lox_value lox_value_from_bool(bool val) {
+  return (lox_value){VAL_BOOL, {.boolean = val}};
+}
+static inline lox_value lox_value_from_nil() {
+  return (lox_value){VAL_NIL, {.number = 0}};
+}
+static inline lox_value lox_value_from_number(double val) {
+  return (lox_value){VAL_NUMBER, {.number = val}};
+}
+static inline lox_value lox_value_from_object(lox_object *object) {
+  return (lox_value){VAL_OBJECT, {.object = object}};
+}
+static inline lox_value lox_value_from_empty() {
+  return (lox_value){VAL_EMPTY, {.number = 0}};
+}
+
+// Helper functions to check the type of a lox_value.
+static inline bool lox_value_is_bool(lox_value value) {
+  return value.type == VAL_BOOL;
+}
+static inline bool lox_value_is_nil(lox_value value) {
+  return value.type == VAL_NIL;
+}
+static inline bool lox_value_is_number(lox_value value) {
+  return value.type == VAL_NUMBER;
+}
+static inline bool lox_value_is_object(lox_value value) {
+  return value.type == VAL_OBJECT;
+}
+static inline bool lox_value_is_empty(lox_value value) {
+  return value.type == VAL_EMPTY;
+}
+
+// Helper functions to retrieve the contents of a lox_value. These assume that
+// the value has the right type.
+static inline bool lox_value_as_bool(lox_value value) {
+  return value.as.boolean;
+}
+static inline double lox_value_as_number(lox_value value) {
+  return value.as.number;
+}
+static inline lox_object *lox_value_as_object(lox_value value) {
+  return value.as.object;
+}
+
+// Returns true if the value is nil or false.
+static inline bool lox_is_falsey(lox_value value) {
+  return value.type == VAL_NIL ||
+         (value.type == VAL_BOOL && value.as.boolean == false);
+}
+
+static inline bool lox_values_equal(lox_value lhs, lox_value rhs) {
+  if (lhs.type != rhs.type)
+    return false;
+  switch (lhs.type) {
+  case VAL_BOOL:
+    return lhs.as.boolean == rhs.as.boolean;
+  case VAL_NIL:
+    return true;
+  case VAL_NUMBER:
+    return lhs.as.number == rhs.as.number;
+  case VAL_OBJECT:
+    return lhs.as.object == rhs.as.object;
+  default:
+    return false;
+  }
+}
+
+#endif
@@ -3,35 +3,94 @@
 #include "common.h"
 #include "table.h"
 #include <stdio.h>
+#ifdef LOX_GC_THREAD
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
 
 typedef struct {
   lox_object_closure *closure;
   uint8_t *ip;
   int slots_offset;
+#ifdef LOX_JIT
+  // The instruction at which the interpreter hands the frame back to the native
+  // code of its function, or NULL.
+  uint8_t *jit_entry;
+#endif
 } lox_call_frame;
 
+// Where an incremental full collection is. See lox_gc_step.
+typedef enum {
+  LOX_GC_IDLE,
+  LOX_GC_MARKING,
+  LOX_GC_SWEEPING
+} lox_gc_phase;
+
 typedef struct {
-  lox_call_frame frames[LOX_MAX_CALL_FRAMES];
+  // The call frames grow up to LOX_MAX_CALL_FRAMES. Since they can be
+  // reallocated, a pointer to a frame is only valid until the next call.
+  lox_call_frame *frames;
+  int frame_capacity;
+  // The stack grows up to LOX_MAX_STACK_SIZE values. Open upvalues are moved
+  // when it is reallocated, and frames refer to their slots by offset.
   lox_value_array stack;
-  lox_value init_string;
+  // The selector of initializers.
+  uint16_t init_selector;
+  // The empty shape every instance starts with. See lox_object_shape.
+  lox_object_shape *root_shape;
   // Every string created in lox is interned into this hash table. If the
   // strings table contains a key, it means that the given key is a string that
   // is currently interned.
   lox_hash_table strings;
   lox_hash_table global_indices;
   lox_value_array globals;
+  // Maps the name of every property and method used in the program to its
+  // selector, a small integer that identifies the name in instructions and
+  // indexes the method tables of classes.
+  lox_hash_table selector_indices;
+  // Reverse lookup table for getting the name of a selector.
+  lox_value_array selectors;
 #ifndef NDEBUG
   // Reverse lookup table for getting global names from their index.
   lox_hash_table global_names;
   lox_hash_table local_names;
 #endif
+  // The objects that survived a garbage collection, and the ones allocated
+  // since the last one. Young objects are allocated like the others, and only
+  // differ by the list they are on: there is no separate nursery to bump
+  // allocate from, or to evacuate.
   lox_object *objects;
+  lox_object *young_objects;
   lox_object_upvalue *open_upvalues;
   lox_object **gray_stack;
   int gray_capacity;
   int gray_size;
+  // The old objects that may refer to young objects, which collections of the
+  // young generation treat as roots. See lox_gc_write_barrier.
+  lox_object **remembered;
+  int remembered_capacity;
+  int remembered_size;
   ssize_t bytes_allocated;
+  // The number of bytes allocated at which the next full collection, and the
+  // next collection of the young generation, happen.
   ssize_t next_gc;
+  ssize_t next_young_gc;
+  // Whether the collection in progress only collects young objects.
+  bool collecting_young;
+  lox_gc_phase gc_phase;
+  // The objects an incremental full collection hasn't swept yet. The ones it
+  // has swept are back in vm.objects.
+  lox_object *sweeping;
+#ifdef LOX_GC_THREAD
+  // The thread sweeping the objects of an incremental full collection. Until
+  // it is done, vm.sweeping belongs to it, and then holds the survivors, the
+  // last of which is vm.swept_last.
+  pthread_t sweeper;
+  bool sweeper_running;
+  atomic_bool sweeper_done;
+  lox_object *swept_last;
+  ssize_t swept_bytes;
+#endif
   int frame_count;
   bool mark_value;
 } lox_vm;
@@ -50,11 +109,12 @@ interpret_result run();
 
 void runtime_error(const char *format, ...);
 
-bool lox_is_falsey(lox_value value);
-bool lox_values_equal(lox_value lhs, lox_value rhs);
-
 void define_native(lox_vm *vm, const char *name, lox_native_function function,
                    int arity);
 
+// Returns the selector of a property or method name, assigning it a new one if
+// it doesn't have one yet. Returns -1 if there are too many selectors.
+int lox_intern_selector(lox_value name);
+
 void push(lox_value value);
 lox_value pop();
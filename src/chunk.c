@@ -1,20 +1,41 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
+#include "table.h"
 #include "vm.h"
 #include <stdio.h>
 #include <string.h>
 
+DEFINE_LOX_ARRAY(lox_inline_cache, inline_cache_array);
+DEFINE_LOX_ARRAY(lox_call_cache, call_cache_array);
+DEFINE_LOX_ARRAY(lox_switch_table, switch_table_array);
+
 void lox_chunk_initialize(lox_chunk *chunk) {
   chunk->last_line = -1;
   lox_byte_array_initialize(&chunk->code);
   lox_int_array_initialize(&chunk->lines);
   lox_value_array_initialize(&chunk->constants);
+  lox_inline_cache_array_initialize(&chunk->caches);
+  lox_call_cache_array_initialize(&chunk->calls);
+  lox_switch_table_array_initialize(&chunk->switches);
 }
 
 void lox_chunk_free(lox_chunk *chunk) {
   lox_byte_array_free(&chunk->code);
   lox_int_array_free(&chunk->lines);
   lox_value_array_free(&chunk->constants);
+  lox_inline_cache_array_free(&chunk->caches);
+  lox_call_cache_array_free(&chunk->calls);
+  for (int i = 0; i < chunk->switches.size; i++) {
+    lox_switch_table *table = &chunk->switches.values[i];
+    lox_int_array_free(&table->targets);
+    lox_int_array_free(&table->cases);
+    if (table->labels != NULL) {
+      lox_hash_table_free(table->labels);
+      FREE(lox_hash_table, table->labels);
+    }
+  }
+  lox_switch_table_array_free(&chunk->switches);
   lox_chunk_initialize(chunk);
 }
 
@@ -50,6 +71,19 @@ void lox_chunk_write_array(lox_chunk *chunk, uint8_t *bytes, int size,
   chunk->last_line = line;
 }
 
+void lox_chunk_truncate(lox_chunk *chunk, int size) {
+  // The bytes were written in order, so the last ones are counted by the last
+  // lines that have any.
+  int removed = chunk->code.size - size;
+  for (int line = chunk->lines.size - 1; line >= 0 && removed > 0; line--) {
+    int count = chunk->lines.values[line] < removed ? chunk->lines.values[line]
+                                                    : removed;
+    chunk->lines.values[line] -= count;
+    removed -= count;
+  }
+  chunk->code.size = size;
+}
+
 int lox_chunk_add_constant(lox_chunk *chunk, lox_value value) {
   push(value);
   lox_value_array_push(&chunk->constants, value);
@@ -57,6 +91,256 @@ int lox_chunk_add_constant(lox_chunk *chunk, lox_value value) {
   return chunk->constants.size - 1;
 }
 
+int lox_chunk_add_inline_cache(lox_chunk *chunk) {
+  lox_inline_cache cache;
+  memset(&cache, 0, sizeof(cache));
+  lox_inline_cache_array_push(&chunk->caches, cache);
+  return chunk->caches.size - 1;
+}
+
+int lox_chunk_add_call_cache(lox_chunk *chunk) {
+  lox_call_cache cache;
+  memset(&cache, 0, sizeof(cache));
+  lox_call_cache_array_push(&chunk->calls, cache);
+  return chunk->calls.size - 1;
+}
+
+int lox_chunk_add_switch_table(lox_chunk *chunk) {
+  lox_switch_table table;
+  lox_int_array_initialize(&table.targets);
+  table.first = 0;
+  lox_int_array_initialize(&table.cases);
+  table.labels = NULL;
+  lox_switch_table_array_push(&chunk->switches, table);
+  return chunk->switches.size - 1;
+}
+
+lox_switch_table *lox_chunk_switch_table(lox_chunk *chunk, int offset) {
+  uint8_t *code = &chunk->code.values[offset];
+  if (code[0] != OP_SWITCH_TABLE && code[0] != OP_SWITCH_HASH)
+    return NULL;
+  return &chunk->switches.values[code[1] << 8 | code[2]];
+}
+
+int lox_chunk_switch_target(lox_chunk *chunk, int offset, lox_value value) {
+  lox_switch_table *table = lox_chunk_switch_table(chunk, offset);
+  int index = 0;
+  if (chunk->code.values[offset] == OP_SWITCH_TABLE) {
+    if (lox_value_is_number(value)) {
+      double key = lox_value_as_number(value) - table->first;
+      // NaN fails both comparisons.
+      if (key >= 0 && key < table->cases.size && key == (int)key)
+        index = table->cases.values[(int)key];
+    }
+  } else {
+    lox_value case_index;
+    if (lox_hash_table_get(table->labels, value, &case_index))
+      index = lox_value_as_number(case_index);
+  }
+  return table->targets.values[index];
+}
+
+int lox_chunk_instruction_length(lox_chunk *chunk, int offset) {
+  switch ((lox_op_code)chunk->code.values[offset]) {
+  case OP_CONSTANT:
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_CAPTURE:
+  case OP_CLASS:
+    return 2;
+  case OP_CONSTANT_LONG:
+  case OP_POPN:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+  case OP_JMP_TRUE:
+  case OP_JMP_FALSE:
+  case OP_JMP:
+  case OP_JMP_BACK:
+  case OP_SWITCH_TABLE:
+  case OP_SWITCH_HASH:
+  case OP_METHOD:
+  case OP_GET_SUPER:
+  case OP_GET_LOCAL_GET_LOCAL:
+  case OP_GET_LOCAL_CONSTANT:
+  case OP_EQ_JMP_FALSE:
+  case OP_NEQ_JMP_FALSE:
+  case OP_GREATER_JMP_FALSE:
+  case OP_GREATEREQ_JMP_FALSE:
+  case OP_LESS_JMP_FALSE:
+  case OP_LESSEQ_JMP_FALSE:
+    return 3;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    return 4;
+  case OP_SET_PROPERTY:
+  case OP_GET_PROPERTY:
+    return 5;
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+  case OP_GET_LOCAL_GET_PROPERTY:
+    return 6;
+  case OP_CLOSURE: {
+    // The function is followed by 3 bytes for each variable it captures.
+    uint16_t constant =
+        chunk->code.values[offset + 1] << 8 | chunk->code.values[offset + 2];
+    lox_object_function *fun = (lox_object_function *)lox_value_as_object(
+        chunk->constants.values[constant]);
+    return 3 + 3 * (fun->upvalue_count + fun->capture_count);
+  }
+  default:
+    return 1;
+  }
+}
+
+int lox_chunk_jump_target(lox_chunk *chunk, int offset) {
+  lox_op_code op = chunk->code.values[offset];
+  bool is_compare_jump = op >= OP_EQ_JMP_FALSE && op <= OP_LESSEQ_JMP_FALSE;
+  if (op != OP_JMP && op != OP_JMP_TRUE && op != OP_JMP_FALSE &&
+      op != OP_JMP_BACK && !is_compare_jump)
+    return -1;
+
+  uint16_t distance =
+      chunk->code.values[offset + 1] << 8 | chunk->code.values[offset + 2];
+  if (op == OP_JMP_BACK)
+    return offset + 3 - distance;
+  return offset + 3 + distance;
+}
+
+int lox_chunk_stack_effect(lox_chunk *chunk, int offset) {
+  uint8_t *code = &chunk->code.values[offset];
+  switch ((lox_op_code)code[0]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_GET_CAPTURE:
+  case OP_DUP:
+  case OP_CLOSURE:
+  case OP_CLASS:
+  case OP_GET_LOCAL_GET_PROPERTY:
+    return 1;
+  case OP_GET_LOCAL_GET_LOCAL:
+  case OP_GET_LOCAL_CONSTANT:
+    return 2;
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_GREATER:
+  case OP_GREATEREQ:
+  case OP_LESS:
+  case OP_LESSEQ:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_MODULO:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_MODULO_NUM:
+  case OP_GREATER_NUM:
+  case OP_GREATEREQ_NUM:
+  case OP_LESS_NUM:
+  case OP_LESSEQ_NUM:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_CLOSE_UPVALUE:
+  case OP_SET_PROPERTY:
+  case OP_METHOD:
+  case OP_INHERIT:
+  case OP_GET_SUPER:
+  case OP_RETURN:
+    return -1;
+  case OP_EQ_JMP_FALSE:
+  case OP_NEQ_JMP_FALSE:
+  case OP_GREATER_JMP_FALSE:
+  case OP_GREATEREQ_JMP_FALSE:
+  case OP_LESS_JMP_FALSE:
+  case OP_LESSEQ_JMP_FALSE:
+    return -2;
+  case OP_POPN:
+    return -(code[1] << 8 | code[2]);
+  // The callee and its arguments are replaced by the return value.
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -code[1];
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+    return -code[3];
+  // The superclass is popped as well.
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    return -code[3] - 1;
+  default:
+    return 0;
+  }
+}
+
+int lox_chunk_max_stack_size(lox_chunk *chunk, int initial_size) {
+  int size = chunk->code.size;
+  // The stack size before each instruction, or -1 if it wasn't reached yet.
+  int *sizes = ALLOC_ARRAY(int, size);
+  for (int i = 0; i < size; i++) {
+    sizes[i] = -1;
+  }
+
+  // Pairs of an offset to follow the bytecode from, and the stack size there.
+  lox_int_array pending;
+  lox_int_array_initialize(&pending);
+  lox_int_array_push(&pending, 0);
+  lox_int_array_push(&pending, initial_size);
+
+  int max_size = initial_size;
+  while (pending.size > 0) {
+    int stack_size = lox_int_array_pop(&pending);
+    int offset = lox_int_array_pop(&pending);
+
+    while (offset < size && sizes[offset] == -1) {
+      sizes[offset] = stack_size;
+      stack_size += lox_chunk_stack_effect(chunk, offset);
+      if (stack_size > max_size)
+        max_size = stack_size;
+
+      // Every path through a jump leaves the stack at the same size.
+      int target = lox_chunk_jump_target(chunk, offset);
+      if (target != -1 && target < size && sizes[target] == -1) {
+        lox_int_array_push(&pending, target);
+        lox_int_array_push(&pending, stack_size);
+      }
+      lox_switch_table *table = lox_chunk_switch_table(chunk, offset);
+      for (int i = 0; table != NULL && i < table->targets.size; i++) {
+        lox_int_array_push(&pending, table->targets.values[i]);
+        lox_int_array_push(&pending, stack_size);
+      }
+
+      lox_op_code op = chunk->code.values[offset];
+      if (op == OP_JMP || op == OP_JMP_BACK || op == OP_RETURN ||
+          table != NULL)
+        break;
+      offset += lox_chunk_instruction_length(chunk, offset);
+    }
+  }
+
+  lox_int_array_free(&pending);
+  FREE_ARRAY(int, sizes, size);
+  return max_size;
+}
+
 int lox_chunk_get_offset_line(lox_chunk *chunk, int instruction_offset) {
   if (instruction_offset < 0)
     return -1;
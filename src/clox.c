@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sysexits.h>
+#include <unistd.h>
 
 struct lox_settings lox_settings;
 
@@ -69,15 +70,51 @@ static void run_file(const char *path) {
     exit(EX_SOFTWARE);
 }
 
-static void parse_opts(int argc, char *const *argv) {}
+static void parse_opts(int argc, char *const *argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "GO:d")) != -1) {
+    switch (opt) {
+    case 'G':
+      lox_settings.gc_stress = 1;
+      break;
+    case 'O':
+      lox_settings.optimization_level = atoi(optarg);
+      break;
+    case 'd':
+      lox_settings.print_code = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-G] [-O<level>] [-d] [path]\n", argv[0]);
+      exit(EX_USAGE);
+    }
+  }
+}
 
 static void apply_default_settings() {
   lox_settings.array_minimum_capacity = 8;
   lox_settings.array_scale_factor = 2;
   lox_settings.gc_heap_grow_factor = 2;
+  lox_settings.gc_young_size = 256 * 1024;
+  lox_settings.gc_slice_budget = 1000;
+#ifdef DEBUG_STRESS_GC
+  lox_settings.gc_stress = 1;
+#else
+  lox_settings.gc_stress = 0;
+#endif
   lox_settings.hash_table_load_factor = 0.75;
   lox_settings.initial_stack_size = 256;
+  lox_settings.max_stack_size = 1 << 22;
+  lox_settings.initial_call_frames = 64;
+  lox_settings.max_call_frames = 1 << 16;
   lox_settings.max_local_count = 256;
+  lox_settings.jit_threshold = 1000;
+  lox_settings.jit_loop_threshold = 100;
+  lox_settings.optimization_level = 0;
+#ifdef DEBUG_PRINT_CODE
+  lox_settings.print_code = 1;
+#else
+  lox_settings.print_code = 0;
+#endif
 }
 
 int main(int argc, char *const *argv) {
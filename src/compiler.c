@@ -2,16 +2,24 @@
 #include "memory.h"
 #include "chunk.h"
 #include "debug.h"
+#include "ir.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// The number of cases from which a switch statement whose labels are all
+// constants looks up its cases in a table, instead of comparing the value with
+// each label.
+#define LOX_MIN_SWITCH_TABLE_CASES 4
+
 typedef enum {
   PREC_NONE,
   PREC_ASSIGNMENT, // =
@@ -42,6 +50,7 @@ typedef struct {
 } lox_parser;
 
 DEFINE_LOX_ARRAY(lox_local, local_array);
+DEFINE_LOX_ARRAY(lox_token, token_array);
 
 void init_compiler(lox_compiler *curr, lox_function_type function_type);
 
@@ -64,19 +73,31 @@ static void emit_byte(uint8_t byte);
 static void emit_bytes2(uint8_t byte1, uint8_t byte2);
 static void emit_short(uint16_t sh);
 static uint16_t emit_constant(lox_value value);
+static void emit_value(lox_value value);
+static bool constant_at(int start, int end, lox_value *value);
+static void remove_constants(int start);
+static bool fold_unary(lox_token_type operator_type, int operand);
+static bool fold_binary(lox_token_type operator_type, int left, int right);
+static void emit_inline_cache();
+static void emit_call_cache();
 static void emit_return();
 static lox_object_function *end_compiler();
 
 static void mark_initialized();
 static uint16_t parse_variable(const char *error_message);
 static uint16_t identifier_constant(lox_token *name, bool *is_cached);
+static uint16_t selector_constant(lox_token *name);
 static void define_variable(uint16_t index);
 static void declare_variable(bool constant);
 static void add_local(lox_token name, bool constant);
-static int add_upvalue(lox_compiler *compiler, uint16_t index, bool is_local);
+static int add_upvalue(lox_compiler *compiler, uint16_t index, bool is_local,
+                       bool by_value);
 static bool are_identifiers_equal(lox_token *a, lox_token *b);
 static int resolve_local(lox_compiler *compiler, lox_token *name);
-static int resolve_upvalue(lox_compiler *compiler, lox_token *name);
+static int resolve_upvalue(lox_compiler *compiler, lox_token *name,
+                           bool *by_value);
+static void find_assigned_names(const char *source);
+static bool is_assigned(lox_token *name);
 static lox_token synthetic_token(const char *text);
 
 static void begin_scope();
@@ -99,7 +120,9 @@ static void statement();
 static void break_statement();
 static void continue_statement();
 static void switch_statement();
-static void switch_case();
+static void switch_case(lox_value_array *labels, lox_int_array *offsets);
+static void emit_switch_table(int dispatch, lox_value_array *labels,
+                              lox_int_array *offsets, int no_match);
 static void default_case();
 static void for_statement();
 static void while_statement();
@@ -132,6 +155,9 @@ lox_compiler *compiler;
 lox_class_compiler *class_compiler;
 lox_chunk *compiling_chunk;
 const char *compiling_source;
+// The names that appear on the left of an assignment anywhere in the source
+// being compiled.
+lox_token_array assigned_names;
 
 lox_parse_rule rules[] = {
     [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
@@ -187,6 +213,7 @@ lox_parse_rule rules[] = {
 lox_object_function *lox_compiler_compile(const char *source) {
   lox_compiler curr;
   init_compiler(&curr, TYPE_SCRIPT);
+  find_assigned_names(source);
   init_scanner(source);
   compiling_source = source;
 
@@ -203,6 +230,7 @@ lox_object_function *lox_compiler_compile(const char *source) {
   consume_expected(TOKEN_EOF, "Expected end of expression.");
 
   lox_object_function *fun = end_compiler();
+  lox_token_array_free(&assigned_names);
 
   return parser.had_error ? NULL : fun;
 }
@@ -219,6 +247,8 @@ void init_compiler(lox_compiler *curr, lox_function_type function_type) {
   compiler->scope_depth = 0;
   compiler->continue_depth = 0;
   compiler->break_depth = 0;
+  compiler->last_call = -1;
+  compiler->operand_start = 0;
   compiler->function = lox_object_function_new();
 
   lox_token local_token;
@@ -388,6 +418,181 @@ static uint16_t emit_constant(lox_value value) {
   return constant;
 }
 
+// Emits the instruction that loads a literal.
+static void emit_value(lox_value value) {
+  if (lox_value_is_nil(value)) {
+    emit_byte(OP_NIL);
+  } else if (lox_value_is_bool(value)) {
+    emit_byte(lox_value_as_bool(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emit_constant(value);
+  }
+}
+
+// Returns whether the code from `start` to `end` is a single instruction that
+// loads a literal, and stores the literal in `value` if so.
+static bool constant_at(int start, int end, lox_value *value) {
+  lox_chunk *chunk = current_chunk();
+  if (start >= end || start + lox_chunk_instruction_length(chunk, start) != end)
+    return false;
+
+  uint8_t *code = &chunk->code.values[start];
+  switch (code[0]) {
+  case OP_CONSTANT:
+    *value = chunk->constants.values[code[1]];
+    return true;
+  case OP_CONSTANT_LONG:
+    *value = chunk->constants.values[code[1] << 8 | code[2]];
+    return true;
+  case OP_NIL:
+    *value = lox_value_from_nil();
+    return true;
+  case OP_TRUE:
+  case OP_FALSE:
+    *value = lox_value_from_bool(code[0] == OP_TRUE);
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Removes the literals loaded from `start` onwards, which are about to be
+// replaced by the result of folding them. Their constants are dropped too when
+// nothing was added after them.
+static void remove_constants(int start) {
+  lox_chunk *chunk = current_chunk();
+  for (int offset = chunk->code.size; offset > start;) {
+    int previous = start;
+    while (previous + lox_chunk_instruction_length(chunk, previous) < offset)
+      previous += lox_chunk_instruction_length(chunk, previous);
+
+    uint8_t *code = &chunk->code.values[previous];
+    int index = -1;
+    if (code[0] == OP_CONSTANT)
+      index = code[1];
+    else if (code[0] == OP_CONSTANT_LONG)
+      index = code[1] << 8 | code[2];
+    if (index != -1 && index == chunk->constants.size - 1)
+      chunk->constants.size--;
+    offset = previous;
+  }
+  lox_chunk_truncate(chunk, start);
+}
+
+// Evaluates an unary operator at compile time, if its operand is a literal.
+// Only what can't fail at runtime is folded, so that errors are still reported
+// when the code runs.
+static bool fold_unary(lox_token_type operator_type, int operand) {
+  lox_value value;
+  if (!constant_at(operand, current_chunk()->code.size, &value))
+    return false;
+
+  lox_value result;
+  switch (operator_type) {
+  case TOKEN_MINUS:
+    if (!lox_value_is_number(value))
+      return false;
+    result = lox_value_from_number(-lox_value_as_number(value));
+    break;
+  case TOKEN_BANG:
+    result = lox_value_from_bool(lox_is_falsey(value));
+    break;
+  default:
+    return false;
+  }
+
+  remove_constants(operand);
+  emit_value(result);
+  return true;
+}
+
+// Evaluates a binary operator at compile time, if both its operands are
+// literals. See fold_unary.
+static bool fold_binary(lox_token_type operator_type, int left, int right) {
+  lox_value lhs, rhs;
+  if (!constant_at(left, right, &lhs) ||
+      !constant_at(right, current_chunk()->code.size, &rhs))
+    return false;
+
+  lox_value result;
+  if (operator_type == TOKEN_EQUAL_EQUAL || operator_type == TOKEN_BANG_EQUAL) {
+    bool equal = lox_values_equal(rhs, lhs);
+    result = lox_value_from_bool(operator_type == TOKEN_EQUAL_EQUAL ? equal
+                                                                     : !equal);
+  } else if (operator_type == TOKEN_PLUS && lox_value_is_string(lhs) &&
+             lox_value_is_string(rhs)) {
+    lox_object_string *lstr = (lox_object_string *)lox_value_as_object(lhs);
+    lox_object_string *rstr = (lox_object_string *)lox_value_as_object(rhs);
+    int length = lstr->length + rstr->length;
+    char *chars = ALLOC_ARRAY(char, length + 1);
+    memcpy(chars, lstr->chars, lstr->length);
+    memcpy(chars + lstr->length, rstr->chars, rstr->length);
+    chars[length] = '\0';
+    result = lox_value_from_object(
+        (lox_object *)lox_object_string_new_consume(chars, length, false));
+  } else if (lox_value_is_number(lhs) && lox_value_is_number(rhs)) {
+    double a = lox_value_as_number(lhs);
+    double b = lox_value_as_number(rhs);
+    switch (operator_type) {
+    case TOKEN_PLUS:
+      result = lox_value_from_number(a + b);
+      break;
+    case TOKEN_MINUS:
+      result = lox_value_from_number(a - b);
+      break;
+    case TOKEN_STAR:
+      result = lox_value_from_number(a * b);
+      break;
+    case TOKEN_SLASH:
+      if (b == 0)
+        return false;
+      result = lox_value_from_number(a / b);
+      break;
+    case TOKEN_PERCENTAGE:
+      result = lox_value_from_number(fmod(a, b));
+      break;
+    case TOKEN_GREATER:
+      result = lox_value_from_bool(a > b);
+      break;
+    case TOKEN_GREATER_EQUAL:
+      result = lox_value_from_bool(a >= b);
+      break;
+    case TOKEN_LESS:
+      result = lox_value_from_bool(a < b);
+      break;
+    case TOKEN_LESS_EQUAL:
+      result = lox_value_from_bool(a <= b);
+      break;
+    default:
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  // The operands stay in the constants until the result is made, so that
+  // concatenating strings can't collect them.
+  remove_constants(left);
+  emit_value(result);
+  return true;
+}
+
+static void emit_inline_cache() {
+  int cache = lox_chunk_add_inline_cache(current_chunk());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+  }
+  emit_short(cache);
+}
+
+static void emit_call_cache() {
+  int cache = lox_chunk_add_call_cache(current_chunk());
+  if (cache > UINT16_MAX) {
+    error("Too many calls in one function.");
+  }
+  emit_short(cache);
+}
+
 static void emit_return() {
   if (compiler->function_type == TYPE_INITIALIZER) {
     emit_bytes2(OP_GET_LOCAL, 0);
@@ -404,13 +609,28 @@ static lox_object_function *end_compiler() {
   lox_int_array_free(&compiler->continues);
   emit_return();
   lox_object_function *function = compiler->function;
-#ifdef DEBUG_PRINT_CODE
   if (!parser.had_error) {
-    lox_disassemble_chunk(&function->chunk, function->name == NULL
-                                                ? "<script>"
-                                                : function->name->chars);
-  }
+    if (LOX_OPTIMIZATION_LEVEL >= 1)
+      lox_ir_optimize(&function->chunk, function->arity);
+    int saved_bytes = lox_optimize_peephole(&function->chunk);
+#ifndef LOX_PROFILE_OPCODE_PAIRS
+    // The opcode pairs are profiled on bytecode without superinstructions,
+    // since they are used to choose which instructions should be fused.
+    lox_optimize_chunk(&function->chunk);
 #endif
+    // The function and its arguments are on the stack when it starts.
+    function->max_stack_size =
+        lox_chunk_max_stack_size(&function->chunk, function->arity + 1);
+    if (LOX_PRINT_CODE) {
+      lox_disassemble_chunk(&function->chunk, function->name == NULL
+                                                  ? "<script>"
+                                                  : function->name->chars);
+      printf("Peephole optimizer saved %d bytes\n", saved_bytes);
+    }
+  }
+  // Same as in lox_compiler_mark_roots, the constants added since the last
+  // garbage collection may be young.
+  lox_gc_remember((lox_object *)function);
   compiler = compiler->enclosing;
   return function;
 }
@@ -442,13 +662,24 @@ static uint16_t parse_variable(const char *error_message) {
     error("Cannot redeclare variable as const.");
   }
 
+  // The literal is only known once the initializer has been compiled.
   if (constant)
     lox_hash_table_put(&compiler->global_constants, value,
-                       lox_value_from_bool(constant));
+                       lox_value_from_empty());
 
   return index;
 }
 
+static uint16_t selector_constant(lox_token *name) {
+  int selector = lox_intern_selector(lox_value_from_object(
+      (lox_object *)lox_object_string_new_copy(name->start, name->length)));
+  if (selector == -1) {
+    error("Too many property and method names.");
+    return 0;
+  }
+  return selector;
+}
+
 static uint16_t identifier_constant(lox_token *name, bool *is_cached) {
   lox_value key = lox_value_from_object(
       (lox_object *)lox_object_string_new_copy(name->start, name->length));
@@ -461,14 +692,16 @@ static uint16_t identifier_constant(lox_token *name, bool *is_cached) {
     // intern strings. If the key string already exists, freeing could
     // potentially free identical strings that are still in use. The garbage
     // collector should be able to deal with this instead.
-    assert(global.type == VAL_NUMBER);
-    return global.as.number;
+    assert(lox_value_is_number(global));
+    return lox_value_as_number(global);
   }
 
   if (is_cached)
     *is_cached = false;
 
   uint16_t index = vm.globals.size;
+  // Nothing refers to the key until it is in the table.
+  push(key);
   lox_value_array_push(&vm.globals, lox_value_from_empty());
 
   lox_value num = lox_value_from_number(index);
@@ -476,6 +709,7 @@ static uint16_t identifier_constant(lox_token *name, bool *is_cached) {
 #ifndef NDEBUG
   lox_hash_table_put(&vm.global_names, num, key);
 #endif
+  pop();
   return index;
 }
 
@@ -571,13 +805,16 @@ static void add_local(lox_token name, bool constant) {
   lox_local_array_push(&compiler->locals, local);
 }
 
-static int add_upvalue(lox_compiler *compiler, uint16_t index, bool is_local) {
-  int count = compiler->function->upvalue_count;
+static int add_upvalue(lox_compiler *compiler, uint16_t index, bool is_local,
+                       bool by_value) {
+  lox_object_function *fun = compiler->function;
+  int count = fun->upvalue_count + fun->capture_count;
 
   for (int i = 0; i < count; i++) {
     lox_up_value up_value = compiler->upvalues[i];
-    if (up_value.index == index && up_value.is_local == is_local) {
-      return i;
+    if (up_value.index == index && up_value.is_local == is_local &&
+        up_value.by_value == by_value) {
+      return up_value.slot;
     }
   }
 
@@ -588,7 +825,10 @@ static int add_upvalue(lox_compiler *compiler, uint16_t index, bool is_local) {
 
   compiler->upvalues[count].is_local = is_local;
   compiler->upvalues[count].index = index;
-  return compiler->function->upvalue_count++;
+  compiler->upvalues[count].by_value = by_value;
+  compiler->upvalues[count].slot =
+      by_value ? fun->capture_count++ : fun->upvalue_count++;
+  return compiler->upvalues[count].slot;
 }
 
 static bool are_identifiers_equal(lox_token *a, lox_token *b) {
@@ -608,23 +848,61 @@ static int resolve_local(lox_compiler *compiler, lox_token *name) {
   return -1;
 }
 
-static int resolve_upvalue(lox_compiler *compiler, lox_token *name) {
+// Resolves a variable of an enclosing function, and returns the index of the
+// upvalue or captured value that refers to it. A variable that is never
+// assigned after its declaration can't change once a closure has been created,
+// so it is copied into the closure instead of being shared through an upvalue,
+// in which case `by_value` is set.
+static int resolve_upvalue(lox_compiler *compiler, lox_token *name,
+                           bool *by_value) {
   if (compiler->enclosing == NULL)
     return -1;
 
   int local = resolve_local(compiler->enclosing, name);
   if (local != -1) {
-    compiler->enclosing->locals.values[local].is_captured = true;
-    return add_upvalue(compiler, local, true);
+    lox_local *variable = &compiler->enclosing->locals.values[local];
+    *by_value = !is_assigned(&variable->name);
+    if (!*by_value)
+      variable->is_captured = true;
+    return add_upvalue(compiler, local, true, *by_value);
   }
 
-  int upvalue = resolve_upvalue(compiler->enclosing, name);
+  int upvalue = resolve_upvalue(compiler->enclosing, name, by_value);
   if (upvalue != -1)
-    return add_upvalue(compiler, upvalue, false);
+    return add_upvalue(compiler, upvalue, false, *by_value);
 
   return -1;
 }
 
+// Scans the whole source ahead of compiling it, to find the names that are
+// assigned. A name is only looked up by its text, so a variable counts as
+// assigned if any variable or global with the same name is.
+static void find_assigned_names(const char *source) {
+  lox_token_array_initialize(&assigned_names);
+  init_scanner(source);
+  lox_token previous = {TOKEN_EOF, NULL, 0, 0};
+  lox_token current = scan_token();
+  while (current.type != TOKEN_EOF) {
+    lox_token next = scan_token();
+    // Declarations and properties aren't assignments to a variable.
+    if (current.type == TOKEN_IDENTIFIER && next.type == TOKEN_EQUAL &&
+        previous.type != TOKEN_VAR && previous.type != TOKEN_CONST &&
+        previous.type != TOKEN_DOT && !is_assigned(&current)) {
+      lox_token_array_push(&assigned_names, current);
+    }
+    previous = current;
+    current = next;
+  }
+}
+
+static bool is_assigned(lox_token *name) {
+  for (int i = 0; i < assigned_names.size; i++) {
+    if (are_identifiers_equal(&assigned_names.values[i], name))
+      return true;
+  }
+  return false;
+}
+
 static lox_token synthetic_token(const char *text) {
   lox_token token;
   token.start = text;
@@ -711,11 +989,13 @@ static void parse_precedence(lox_precedence precedence) {
   }
 
   bool can_assign = precedence <= PREC_ASSIGNMENT;
+  int start = current_chunk()->code.size;
   prefix_rule(can_assign);
 
   while (precedence <= get_parse_rule(parser.current.type)->precedence) {
     consume();
     lox_parse_function infix_rule = get_parse_rule(parser.previous.type)->infix;
+    compiler->operand_start = start;
     infix_rule(can_assign);
   }
 
@@ -742,6 +1022,7 @@ static void declaration() {
 
 static void variable_declaration() {
   uint16_t global = parse_variable("Expected variable name.");
+  int start = current_chunk()->code.size;
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -751,6 +1032,13 @@ static void variable_declaration() {
 
   consume_expected(TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
 
+  lox_value key = lox_value_from_number(global);
+  lox_value literal;
+  if (compiler->scope_depth == 0 &&
+      lox_hash_table_has(&compiler->global_constants, key) &&
+      constant_at(start, current_chunk()->code.size, &literal))
+    lox_hash_table_put(&compiler->global_constants, key, literal);
+
   define_variable(global);
 }
 
@@ -842,31 +1130,38 @@ static void function(lox_function_type type) {
   end_scope();
 
   lox_object_function *fun = end_compiler();
-  emit_byte(OP_CLOSURE);
-  emit_short(lox_chunk_add_constant(current_chunk(),
-                                    lox_value_from_object((lox_object *)fun)));
-  for (int i = 0; i < fun->upvalue_count; i++) {
-    emit_byte(new_compiler.upvalues[i].is_local ? 1 : 0);
-    emit_short(new_compiler.upvalues[i].index);
+  // Nothing refers to the function until it is in the chunk, so it is kept on
+  // the stack while the code that loads it allocates.
+  push(lox_value_from_object((lox_object *)fun));
+  if (fun->upvalue_count == 0 && fun->capture_count == 0) {
+    // A function that captures nothing gets the same closure every time, so
+    // it is made once and loaded as a constant.
+    lox_object_closure *closure = lox_object_closure_new(fun);
+    emit_constant(lox_value_from_object((lox_object *)closure));
+  } else {
+    emit_byte(OP_CLOSURE);
+    emit_short(lox_chunk_add_constant(
+        current_chunk(), lox_value_from_object((lox_object *)fun)));
+    for (int i = 0; i < fun->upvalue_count + fun->capture_count; i++) {
+      lox_up_value *upvalue = &new_compiler.upvalues[i];
+      emit_byte((upvalue->is_local ? LOX_CAPTURE_LOCAL : 0) |
+                (upvalue->by_value ? LOX_CAPTURE_VALUE : 0));
+      emit_short(upvalue->index);
+    }
   }
+  pop();
 }
 
 static void method() {
   consume_expected(TOKEN_IDENTIFIER, "Expected method name.");
-  uint16_t constant = identifier_constant(&parser.previous, NULL);
-  lox_object_string *name =
-      lox_object_string_new_copy(parser.previous.start, parser.previous.length);
+  uint16_t selector = selector_constant(&parser.previous);
   lox_function_type type = TYPE_METHOD;
-  // Since we do string interning, two equal strings should point to the same
-  // memory
-  if (name == (lox_object_string *)vm.init_string.as.object) {
+  if (selector == vm.init_selector) {
     type = TYPE_INITIALIZER;
   }
-  // TODO: Add support for more than 256 methods
   function(type);
   emit_byte(OP_METHOD);
-  emit_byte(lox_chunk_add_constant(current_chunk(),
-                                   lox_value_from_object((lox_object *)name)));
+  emit_short(selector);
 }
 
 static void statement() {
@@ -913,6 +1208,16 @@ static void switch_statement() {
   consume_expected(TOKEN_RIGHT_PAREN, "Expected ')' after switch expression.");
   consume_expected(TOKEN_LEFT_BRACE, "Expected '{' after switch expression.");
 
+  // A jump to the next instruction for now, which becomes OP_SWITCH_TABLE or
+  // OP_SWITCH_HASH once we know whether every label is a constant.
+  int dispatch = emit_jump(OP_JMP);
+  // The label of each case before the default case, and where its statements
+  // start. The cases after the default case can't be reached.
+  lox_value_array labels;
+  lox_value_array_initialize(&labels);
+  lox_int_array offsets;
+  lox_int_array_initialize(&offsets);
+
   int default_start = -1;
   bool is_default_last = false;
   while (!check(TOKEN_RIGHT_BRACE)) {
@@ -924,7 +1229,10 @@ static void switch_statement() {
       default_case();
       is_default_last = true;
     } else if (match(TOKEN_CASE)) {
-      switch_case();
+      if (default_start == -1)
+        switch_case(&labels, &offsets);
+      else
+        switch_case(NULL, NULL);
       is_default_last = false;
     } else {
       // This is supposed to be unreachable, as default_case and switch_case
@@ -933,6 +1241,11 @@ static void switch_statement() {
       error("Expected 'default' or 'case' in switch statement.");
     }
   }
+  emit_switch_table(dispatch, &labels, &offsets,
+                    default_start != -1 ? default_start
+                                        : current_chunk()->code.size);
+  lox_value_array_free(&labels);
+  lox_int_array_free(&offsets);
   if (default_start != -1 && !is_default_last) {
     emit_jump_back(default_start);
   }
@@ -958,13 +1271,25 @@ static void switch_statement() {
   compiler->break_depth--;
 }
 
-static void switch_case() {
+// Compiles a case, and adds its label and the offset of its statements to
+// `labels` and `offsets` unless they are NULL. The label is empty if it isn't a
+// constant number or string.
+static void switch_case(lox_value_array *labels, lox_int_array *offsets) {
   emit_byte(OP_DUP);
+  int start = current_chunk()->code.size;
   expression();
+  lox_value label;
+  if (!constant_at(start, current_chunk()->code.size, &label) ||
+      (!lox_value_is_number(label) && !lox_value_is_string(label)))
+    label = lox_value_from_empty();
   consume_expected(TOKEN_COLON, "Expected ':' after case label.");
   emit_byte(OP_EQ);
   int jump = emit_jump(OP_JMP_FALSE);
   emit_byte(OP_POP);
+  if (labels != NULL) {
+    lox_value_array_push(labels, label);
+    lox_int_array_push(offsets, current_chunk()->code.size);
+  }
   while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) &&
          !check(TOKEN_RIGHT_BRACE)) {
     statement();
@@ -974,6 +1299,74 @@ static void switch_case() {
   emit_byte(OP_POP);
 }
 
+// Turns the jump at `dispatch` into a lookup of the value of the switch in a
+// switch table, when every label is a constant and there are enough of them.
+// The lookup jumps straight to the statements of the matching case, or to
+// `no_match`, which leaves the comparisons of the labels unreachable. Integers
+// that are close to each other index an array, and other labels are hashed.
+static void emit_switch_table(int dispatch, lox_value_array *labels,
+                              lox_int_array *offsets, int no_match) {
+  if (labels->size < LOX_MIN_SWITCH_TABLE_CASES)
+    return;
+
+  bool is_dense = true;
+  double min = INFINITY;
+  double max = -INFINITY;
+  for (int i = 0; i < labels->size; i++) {
+    lox_value label = labels->values[i];
+    if (lox_value_is_empty(label))
+      return;
+    if (!lox_value_is_number(label) ||
+        floor(lox_value_as_number(label)) != lox_value_as_number(label)) {
+      is_dense = false;
+      continue;
+    }
+    min = fmin(min, lox_value_as_number(label));
+    max = fmax(max, lox_value_as_number(label));
+  }
+  if (is_dense && max - min + 1 > 2 * labels->size)
+    is_dense = false;
+
+  // The table is referred to by a short, and is only added once it is known
+  // to fit, so that the comparisons are left as they are otherwise.
+  lox_chunk *chunk = current_chunk();
+  if (chunk->switches.size > UINT16_MAX)
+    return;
+  int index = lox_chunk_add_switch_table(chunk);
+  lox_switch_table *table = &chunk->switches.values[index];
+  lox_int_array_push(&table->targets, no_match);
+  for (int i = 0; i < offsets->size; i++) {
+    lox_int_array_push(&table->targets, offsets->values[i]);
+  }
+
+  // When labels are repeated, the first case with the label is the one that
+  // runs.
+  if (is_dense) {
+    table->first = min;
+    for (int i = 0; i < max - min + 1; i++) {
+      lox_int_array_push(&table->cases, 0);
+    }
+    for (int i = 0; i < labels->size; i++) {
+      int key = lox_value_as_number(labels->values[i]) - min;
+      if (table->cases.values[key] == 0)
+        table->cases.values[key] = i + 1;
+    }
+  } else {
+    table->labels = ALLOC_TYPE(lox_hash_table);
+    lox_hash_table_init(table->labels);
+    for (int i = 0; i < labels->size; i++) {
+      if (!lox_hash_table_has(table->labels, labels->values[i]))
+        lox_hash_table_put(table->labels, labels->values[i],
+                           lox_value_from_number(i + 1));
+    }
+  }
+
+  uint8_t *code = chunk->code.values;
+  code[dispatch - 1] = is_dense ? OP_SWITCH_TABLE : OP_SWITCH_HASH;
+  code[dispatch] = (index >> 8) & 0xff;
+  code[dispatch + 1] = index & 0xff;
+}
+
 static void default_case() {
   emit_byte(OP_DUP);
   consume_expected(TOKEN_COLON, "Expected ':' after case label.");
@@ -1135,6 +1528,18 @@ static void return_statement() {
   } else {
     expression();
     consume_expected(TOKEN_SEMICOLON, "Expected ';' after expression");
+    lox_chunk *chunk = current_chunk();
+    int call = compiler->last_call;
+    if (call != -1 &&
+        call + lox_chunk_instruction_length(chunk, call) == chunk->code.size) {
+      uint8_t *op = &chunk->code.values[call];
+      if (*op == OP_CALL)
+        *op = OP_TAIL_CALL;
+      else if (*op == OP_INVOKE)
+        *op = OP_TAIL_INVOKE;
+      else if (*op == OP_SUPER_INVOKE)
+        *op = OP_TAIL_SUPER_INVOKE;
+    }
     emit_byte(OP_RETURN);
   }
 }
@@ -1154,12 +1559,14 @@ static void variable(bool can_assign) {
 static void named_variable(lox_token name, bool can_assign) {
   uint8_t get, set;
   bool is_local = false;
+  bool by_value = false;
   int arg = resolve_local(compiler, &name);
   if (arg != -1) {
     get = OP_GET_LOCAL;
     set = OP_SET_LOCAL;
-  } else if ((arg = resolve_upvalue(compiler, &name)) != -1) {
-    get = OP_GET_UPVALUE;
+  } else if ((arg = resolve_upvalue(compiler, &name, &by_value)) != -1) {
+    // Variables captured by value are never assigned.
+    get = by_value ? OP_GET_CAPTURE : OP_GET_UPVALUE;
     set = OP_SET_UPVALUE;
   } else {
     arg = identifier_constant(&name, NULL);
@@ -1173,11 +1580,17 @@ static void named_variable(lox_token name, bool can_assign) {
   }
 
   bool is_const = false;
-  if (is_local)
+  lox_value literal = lox_value_from_empty();
+  if (is_local) {
     is_const = compiler->locals.values[arg].is_constant;
-  else
-    is_const = lox_hash_table_has(&compiler->global_constants,
-                                  lox_value_from_number(arg));
+  } else if (get == OP_GET_GLOBAL || get == OP_GET_GLOBAL_LONG) {
+    // Globals are only declared by the compiler of the script.
+    lox_compiler *script = compiler;
+    while (script->enclosing != NULL)
+      script = script->enclosing;
+    is_const = lox_hash_table_get(&script->global_constants,
+                                  lox_value_from_number(arg), &literal);
+  }
 
   if (can_assign && match(TOKEN_EQUAL)) {
     if (is_const) {
@@ -1186,6 +1599,11 @@ static void named_variable(lox_token name, bool can_assign) {
 
     expression();
     emit_byte(set);
+  } else if (!lox_value_is_empty(literal)) {
+    // A const global always holds its literal once its declaration has run,
+    // which is before any code that can refer to it.
+    emit_value(literal);
+    return;
   } else {
     emit_byte(get);
   }
@@ -1211,8 +1629,11 @@ static void grouping(bool can_assign) {
 
 static void unary(bool can_assign) {
   lox_token_type operator_type = parser.previous.type;
+  int operand = current_chunk()->code.size;
 
   parse_precedence(PREC_UNARY);
+  if (fold_unary(operator_type, operand))
+    return;
 
   switch (operator_type) {
   case TOKEN_MINUS:
@@ -1229,7 +1650,11 @@ static void unary(bool can_assign) {
 static void binary(bool can_assign) {
   lox_token_type operator_type = parser.previous.type;
   lox_parse_rule *rule = get_parse_rule(operator_type);
+  int left = compiler->operand_start;
+  int right = current_chunk()->code.size;
   parse_precedence(rule->precedence + 1);
+  if (fold_binary(operator_type, left, right))
+    return;
 
   switch (operator_type) {
   case TOKEN_PLUS:
@@ -1320,30 +1745,31 @@ static void compile_or(bool can_assign) {
 
 static void call(bool can_assign) {
   uint8_t arg_count = argument_list();
+  compiler->last_call = current_chunk()->code.size;
   emit_bytes2(OP_CALL, arg_count);
+  emit_call_cache();
 }
 
 static void dot(bool can_assign) {
   consume_expected(TOKEN_IDENTIFIER, "Expected property name after '.'.");
-  // TODO: Add support for more than 256 properties
-  lox_token *name_token = &parser.previous;
-  uint8_t index = (uint8_t)identifier_constant(&parser.previous, NULL);
-  lox_object_string *name =
-      lox_object_string_new_copy(name_token->start, name_token->length);
-  int constant = lox_chunk_add_constant(
-      current_chunk(), lox_value_from_object((lox_object *)name));
+  uint16_t selector = selector_constant(&parser.previous);
 
   if (can_assign && match(TOKEN_EQUAL)) {
     expression();
     emit_byte(OP_SET_PROPERTY);
-    emit_byte(constant);
+    emit_short(selector);
+    emit_inline_cache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argc = argument_list();
-    emit_bytes2(OP_INVOKE, constant);
+    compiler->last_call = current_chunk()->code.size;
+    emit_byte(OP_INVOKE);
+    emit_short(selector);
     emit_byte(argc);
+    emit_inline_cache();
   } else {
     emit_byte(OP_GET_PROPERTY);
-    emit_byte(constant);
+    emit_short(selector);
+    emit_inline_cache();
   }
 }
 
@@ -1366,24 +1792,20 @@ static void compile_super(bool can_assign) {
   }
   consume_expected(TOKEN_DOT, "Expected '.' after 'super'.");
   consume_expected(TOKEN_IDENTIFIER, "Expected superclass method name.");
-  lox_token *name_token = &parser.previous;
-  int index = identifier_constant(&parser.previous, NULL);
-  lox_object_string *name =
-      lox_object_string_new_copy(name_token->start, name_token->length);
-  int constant = lox_chunk_add_constant(
-      current_chunk(), lox_value_from_object((lox_object *)name));
+  uint16_t selector = selector_constant(&parser.previous);
 
   named_variable(synthetic_token("this"), false);
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argc = argument_list();
     named_variable(synthetic_token("super"), false);
+    compiler->last_call = current_chunk()->code.size;
     emit_byte(OP_SUPER_INVOKE);
-    emit_byte(constant);
+    emit_short(selector);
     emit_byte(argc);
   } else {
     named_variable(synthetic_token("super"), false);
     emit_byte(OP_GET_SUPER);
-    emit_byte(constant);
+    emit_short(selector);
   }
 }
 
@@ -1409,6 +1831,9 @@ void lox_compiler_mark_roots() {
     // NOTE: This is probably not needed.
     mark_table(&current->global_constants);
     mark_object((lox_object *)current->function);
+    // The constants of a function are added without write barriers.
+    if (current->function != NULL)
+      lox_gc_remember((lox_object *)current->function);
     current = current->enclosing;
   }
 }
@@ -18,6 +18,14 @@ static int jump_instruction(const char *name, lox_chunk *chunk, int sign,
 static int byte_instruction(const char *name, lox_chunk *chunk, int offset);
 static int short_instruction(const char *name, lox_chunk *chunk, int offset);
 static int invoke_instruction(const char *name, lox_chunk *chunk, int offset);
+static int selector_instruction(const char *name, lox_chunk *chunk,
+                                int offset);
+static int property_instruction(const char *name, lox_chunk *chunk,
+                                int offset);
+static int call_instruction(const char *name, lox_chunk *chunk, int offset);
+static int cached_invoke_instruction(const char *name, lox_chunk *chunk,
+                                     int offset);
+static int switch_instruction(const char *name, lox_chunk *chunk, int offset);
 
 extern lox_vm vm;
 extern lox_compiler *compiler;
@@ -30,6 +38,32 @@ void lox_disassemble_chunk(lox_chunk *chunk, const char *name) {
   }
 }
 
+void lox_print_inline_caches(lox_chunk *chunk, const char *name) {
+  printf("== Inline caches of '%s' ==\n", name);
+
+  for (int i = 0; i < chunk->caches.size; i++) {
+    lox_inline_cache *cache = &chunk->caches.values[i];
+    printf("%5d hits %10d misses %10d entries %d\n", i, cache->hits,
+           cache->misses, cache->count);
+  }
+  for (int i = 0; i < chunk->calls.size; i++) {
+    lox_call_cache *cache = &chunk->calls.values[i];
+    printf("%5d hits %10d misses %10d call\n", i, cache->hits, cache->misses);
+  }
+}
+
+void lox_print_function_caches(lox_object *objects, bool only_unmarked) {
+  for (lox_object *object = objects; object != NULL; object = object->next) {
+    if (object->type != OBJ_FUNCTION ||
+        (only_unmarked && object->is_marked == vm.mark_value))
+      continue;
+    lox_object_function *function = (lox_object_function *)object;
+    lox_print_inline_caches(&function->chunk, function->name == NULL
+                                                  ? "script"
+                                                  : function->name->chars);
+  }
+}
+
 int lox_disassemble_instruction(lox_chunk *chunk, int offset) {
   printf("LINE %-4d ", lox_chunk_get_offset_line(chunk, offset) + 1);
   printf("%04d ", offset);
@@ -67,6 +101,24 @@ int lox_disassemble_instruction(lox_chunk *chunk, int offset) {
     return simple_instruction("OP_DIVIDE", offset);
   case OP_MODULO:
     return simple_instruction("OP_MODULO", offset);
+  case OP_ADD_NUM:
+    return simple_instruction("OP_ADD_NUM", offset);
+  case OP_SUBTRACT_NUM:
+    return simple_instruction("OP_SUBTRACT_NUM", offset);
+  case OP_MULTIPLY_NUM:
+    return simple_instruction("OP_MULTIPLY_NUM", offset);
+  case OP_DIVIDE_NUM:
+    return simple_instruction("OP_DIVIDE_NUM", offset);
+  case OP_MODULO_NUM:
+    return simple_instruction("OP_MODULO_NUM", offset);
+  case OP_GREATER_NUM:
+    return simple_instruction("OP_GREATER_NUM", offset);
+  case OP_GREATEREQ_NUM:
+    return simple_instruction("OP_GREATEREQ_NUM", offset);
+  case OP_LESS_NUM:
+    return simple_instruction("OP_LESS_NUM", offset);
+  case OP_LESSEQ_NUM:
+    return simple_instruction("OP_LESSEQ_NUM", offset);
   case OP_NEGATE:
     return simple_instruction("OP_NEGATE", offset);
   case OP_NOT:
@@ -103,14 +155,22 @@ int lox_disassemble_instruction(lox_chunk *chunk, int offset) {
     return jump_instruction("OP_JMP", chunk, 1, offset);
   case OP_JMP_BACK:
     return jump_instruction("OP_JMP_BACK", chunk, -1, offset);
+  case OP_SWITCH_TABLE:
+    return switch_instruction("OP_SWITCH_TABLE", chunk, offset);
+  case OP_SWITCH_HASH:
+    return switch_instruction("OP_SWITCH_HASH", chunk, offset);
   case OP_DUP:
     return simple_instruction("OP_DUP", offset);
   case OP_CALL:
-    return byte_instruction("OP_CALL", chunk, offset);
+    return call_instruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return call_instruction("OP_TAIL_CALL", chunk, offset);
   case OP_GET_UPVALUE:
     return byte_instruction("OP_GET_UPVALUE", chunk, offset);
   case OP_SET_UPVALUE:
     return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+  case OP_GET_CAPTURE:
+    return byte_instruction("OP_GET_CAPTURE", chunk, offset);
   case OP_CLOSE_UPVALUE:
     return simple_instruction("OP_CLOSE_UPVALUE", offset);
   case OP_CLOSURE: {
@@ -119,34 +179,64 @@ int lox_disassemble_instruction(lox_chunk *chunk, int offset) {
                                           chunk->code.values[offset - 1]);
     printf("%-16s index  %5d value '", "OP_CLOSURE", constant);
     lox_value value = chunk->constants.values[constant];
-    lox_object_function *fun = (lox_object_function *)value.as.object;
+    lox_object_function *fun =
+        (lox_object_function *)lox_value_as_object(value);
     lox_print_value(value);
     printf("'\n");
-    for (int i = 0; i < fun->upvalue_count; i++) {
-      int is_local = chunk->code.values[offset++];
+    for (int i = 0; i < fun->upvalue_count + fun->capture_count; i++) {
+      int flags = chunk->code.values[offset++];
       int index = (offset += 2, chunk->code.values[offset - 2] << 8 |
                                     chunk->code.values[offset - 1]);
-      printf("          %04d      |           %s %d\n", offset - 2,
-             is_local ? "local" : "upvalue", index);
+      printf("          %04d      |           %s %d%s\n", offset - 2,
+             (flags & LOX_CAPTURE_LOCAL) ? "local" : "upvalue", index,
+             (flags & LOX_CAPTURE_VALUE) ? " by value" : "");
     }
     return offset;
   }
   case OP_CLASS:
     return constant_instruction("OP_CLASS", chunk, offset);
   case OP_SET_PROPERTY:
-    return byte_instruction("OP_SET_PROPERTY", chunk, offset);
+    return property_instruction("OP_SET_PROPERTY", chunk, offset);
   case OP_GET_PROPERTY:
-    return byte_instruction("OP_GET_PROPERTY", chunk, offset);
+    return property_instruction("OP_GET_PROPERTY", chunk, offset);
   case OP_METHOD:
-    return constant_instruction("OP_METHOD", chunk, offset);
+    return selector_instruction("OP_METHOD", chunk, offset);
   case OP_INVOKE:
-    return invoke_instruction("OP_INVOKE", chunk, offset);
+    return cached_invoke_instruction("OP_INVOKE", chunk, offset);
+  case OP_TAIL_INVOKE:
+    return cached_invoke_instruction("OP_TAIL_INVOKE", chunk, offset);
   case OP_INHERIT:
     return simple_instruction("OP_INHERIT", offset);
   case OP_GET_SUPER:
-    return constant_instruction("OP_GET_SUPER", chunk, offset);
+    return selector_instruction("OP_GET_SUPER", chunk, offset);
   case OP_SUPER_INVOKE:
     return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+  case OP_TAIL_SUPER_INVOKE:
+    return invoke_instruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
+  case OP_GET_LOCAL_GET_LOCAL:
+    local_instruction("OP_GET_LOCAL_GET_LOCAL", chunk, offset);
+    printf("          ");
+    return local_instruction("", chunk, offset + 1);
+  case OP_GET_LOCAL_CONSTANT:
+    local_instruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+    printf("          ");
+    return constant_instruction("", chunk, offset + 1);
+  case OP_GET_LOCAL_GET_PROPERTY:
+    local_instruction("OP_GET_LOCAL_GET_PROPERTY", chunk, offset);
+    printf("          ");
+    return property_instruction("", chunk, offset + 1);
+  case OP_EQ_JMP_FALSE:
+    return jump_instruction("OP_EQ_JMP_FALSE", chunk, 1, offset);
+  case OP_NEQ_JMP_FALSE:
+    return jump_instruction("OP_NEQ_JMP_FALSE", chunk, 1, offset);
+  case OP_GREATER_JMP_FALSE:
+    return jump_instruction("OP_GREATER_JMP_FALSE", chunk, 1, offset);
+  case OP_GREATEREQ_JMP_FALSE:
+    return jump_instruction("OP_GREATEREQ_JMP_FALSE", chunk, 1, offset);
+  case OP_LESS_JMP_FALSE:
+    return jump_instruction("OP_LESS_JMP_FALSE", chunk, 1, offset);
+  case OP_LESSEQ_JMP_FALSE:
+    return jump_instruction("OP_LESSEQ_JMP_FALSE", chunk, 1, offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
@@ -226,11 +316,81 @@ static int short_instruction(const char *name, lox_chunk *chunk, int offset) {
 }
 
 static int invoke_instruction(const char *name, lox_chunk *chunk, int offset) {
-  uint8_t constant = chunk->code.values[offset + 1];
-  uint8_t argc = chunk->code.values[offset + 2];
-  printf("%-16s argc   %5d index  %d  value '", name, argc, constant);
-  lox_print_value(chunk->constants.values[constant]);
+  uint16_t selector =
+      chunk->code.values[offset + 1] << 8 | chunk->code.values[offset + 2];
+  uint8_t argc = chunk->code.values[offset + 3];
+  printf("%-16s argc   %5d selector %d name '", name, argc, selector);
+  lox_print_value(vm.selectors.values[selector]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int selector_instruction(const char *name, lox_chunk *chunk,
+                                int offset) {
+  uint16_t selector =
+      chunk->code.values[offset + 1] << 8 | chunk->code.values[offset + 2];
+  printf("%-16s selector %3d name  '", name, selector);
+  lox_print_value(vm.selectors.values[selector]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int property_instruction(const char *name, lox_chunk *chunk,
+                                int offset) {
+  uint16_t selector =
+      chunk->code.values[offset + 1] << 8 | chunk->code.values[offset + 2];
+  uint16_t cache =
+      chunk->code.values[offset + 3] << 8 | chunk->code.values[offset + 4];
+  printf("%-16s cache  %5d selector %d name '", name, cache, selector);
+  lox_print_value(vm.selectors.values[selector]);
+  printf("'\n");
+  return offset + 5;
+}
+
+static int call_instruction(const char *name, lox_chunk *chunk, int offset) {
+  uint8_t argc = chunk->code.values[offset + 1];
+  uint16_t cache =
+      chunk->code.values[offset + 2] << 8 | chunk->code.values[offset + 3];
+  printf("%-16s argc   %5d cache  %d\n", name, argc, cache);
+  return offset + 4;
+}
+
+static int cached_invoke_instruction(const char *name, lox_chunk *chunk,
+                                     int offset) {
+  uint16_t selector =
+      chunk->code.values[offset + 1] << 8 | chunk->code.values[offset + 2];
+  uint8_t argc = chunk->code.values[offset + 3];
+  uint16_t cache =
+      chunk->code.values[offset + 4] << 8 | chunk->code.values[offset + 5];
+  printf("%-16s argc   %5d cache  %d  selector %d name '", name, argc, cache,
+         selector);
+  lox_print_value(vm.selectors.values[selector]);
   printf("'\n");
+  return offset + 6;
+}
+
+// Prints the table of the switch instruction below it, one case per line.
+static int switch_instruction(const char *name, lox_chunk *chunk, int offset) {
+  lox_switch_table *table = lox_chunk_switch_table(chunk, offset);
+  printf("%-16s table  %5d default to %d\n", name,
+         chunk->code.values[offset + 1] << 8 | chunk->code.values[offset + 2],
+         table->targets.values[0]);
+  if (table->labels == NULL) {
+    for (int i = 0; i < table->cases.size; i++) {
+      if (table->cases.values[i] != 0)
+        printf("%28s%-6g to %d\n", "case ", table->first + i,
+               table->targets.values[table->cases.values[i]]);
+    }
+  }
+  for (int i = 0; table->labels != NULL && i < table->labels->capacity; i++) {
+    lox_hash_table_entry *entry = &table->labels->entries[i];
+    if (lox_value_is_empty(entry->key))
+      continue;
+    printf("%28s", "case ");
+    lox_print_value(entry->key);
+    printf(" to %d\n",
+           table->targets.values[(int)lox_value_as_number(entry->value)]);
+  }
   return offset + 3;
 }
 
@@ -248,19 +408,23 @@ lox_value lox_get_global_name(uint16_t global) {
   // called when an error occurs, therefore performance is not important here.
   for (int i = 0; i < vm.global_indices.capacity; i++) {
     lox_hash_table_entry entry = vm.global_indices.entries[i];
-    if (entry.value.type == VAL_NUMBER && entry.value.as.number == global) {
+    if (lox_value_is_number(entry.value) &&
+        lox_value_as_number(entry.value) == global) {
       return entry.key;
     }
   }
+  return lox_value_from_nil();
 #endif
 }
 
 lox_value lox_get_local_name(uint16_t local) {
 #ifndef NDEBUG
+  // The slots the optimizer loads hoisted globals into have no name, so they
+  // are printed as nil like in release builds.
   lox_value value;
   if (!lox_hash_table_get(&vm.local_names, lox_value_from_number(local),
                           &value)) {
-    fprintf(stderr, "Could not find variable name for index %i\n", local);
+    return lox_value_from_nil();
   }
   return value;
 #else
@@ -0,0 +1,1778 @@
+#include "ir.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+// How many times the values of the blocks are recomputed before giving up on
+// a function whose analysis doesn't settle.
+#define LOX_IR_MAX_ITERATIONS 32
+// How many stores to other globals and upvalues a load looks through to find
+// the value that was stored to its own.
+#define LOX_IR_MAX_STORE_WALK 64
+
+// The kinds of values that aren't computed by an instruction. The values
+// computed by an instruction have its opcode as their kind.
+typedef enum {
+  // The function itself in slot 0, or one of its parameters.
+  VALUE_PARAMETER = 256,
+  // The value of a stack slot at the start of a block, which depends on the
+  // block control came from.
+  VALUE_PHI,
+  // A value nothing is known about, like the result of a call. Its immediate
+  // is the instruction that produced it.
+  VALUE_OPAQUE,
+  // The states of the globals and upvalues. Loads are numbered by the state
+  // they read from, so that two loads of the same global are only equal if
+  // nothing could have changed it between them.
+  MEMORY_ENTRY,
+  MEMORY_PHI,
+  // The state after a call, which could have changed anything.
+  MEMORY_CLOBBER,
+  // The state after storing value `a` into a global or upvalue, when the
+  // state was `b` before.
+  MEMORY_STORE_GLOBAL,
+  MEMORY_STORE_UPVALUE,
+} lox_ir_value_kind;
+
+typedef struct {
+  int kind;
+  int a;
+  int b;
+  int immediate;
+  // Whether the value is known to be a number.
+  bool is_number;
+} lox_ir_value;
+
+DECLARE_LOX_ARRAY(lox_ir_value, ir_value_array);
+DEFINE_LOX_ARRAY(lox_ir_value, ir_value_array);
+
+typedef enum {
+  EMIT_ORIGINAL,
+  EMIT_NONE,
+  EMIT_REPLACED,
+} lox_ir_emit;
+
+typedef struct {
+  int offset;
+  int block;
+  // The size of the stack before the instruction runs.
+  int depth;
+  lox_ir_emit emit;
+  // What is emitted instead of the instruction, for EMIT_REPLACED. Jumps keep
+  // their original destination.
+  uint8_t replacement[3];
+  int replacement_length;
+  // For the first instruction of a loop whose globals are hoisted, the index
+  // of the loop. The loads are emitted right before the instruction, where
+  // only the code before the loop runs them.
+  int hoisted_loop;
+  // For the first instruction of a block that is only reached by leaving such
+  // a loop, the number of hoisted values to pop.
+  int exit_pops;
+  // Same, for the OP_POP of the condition a loop exits with, but the values
+  // are popped after it. The OP_POP stays where its OP_JMP_FALSE lands, so
+  // that the comparison and the branch can still be fused.
+  int pops_after;
+  // For a load of a hoisted global, the slot the value was loaded into.
+  int hoisted_slot;
+} lox_ir_instruction;
+
+// What is known about the stack slots, globals and upvalues at some point.
+typedef struct {
+  int *slots;
+  int memory;
+  // Whether each global is known to be defined, so that loading it can't fail.
+  bool *defined;
+} lox_ir_state;
+
+typedef struct {
+  // The instructions of the block, from `first` up to `end` excluded.
+  int first;
+  int end;
+  // The size of the stack when the block starts, and when it ends.
+  int depth;
+  int exit_depth;
+  // The block control falls through to, and the block the last instruction
+  // jumps to. -1 if there is none.
+  int successors[2];
+  // Whether control can go to each successor.
+  bool taken[2];
+  lox_int_array predecessors;
+  bool reachable;
+  bool visited;
+  lox_ir_state entry;
+  lox_ir_state exit;
+  // Which slots hold phis at the start of the block. Once a slot needs a phi,
+  // it keeps it, so that the analysis settles.
+  bool *phis;
+  bool memory_phi;
+  // The stack slots whose value is read before being overwritten, once the
+  // block ends.
+  bool *live_out;
+  int idom;
+  // The position of the block in reverse postorder, or -1 if it can't be
+  // reached.
+  int order;
+  // The loop whose globals are hoisted that contains this block, or -1.
+  int loop;
+} lox_ir_block;
+
+typedef struct {
+  int header;
+  // The size of the stack when the loop starts, which is the slot of the first
+  // hoisted global.
+  int depth;
+  lox_int_array globals;
+  // The line of the first load of each hoisted global.
+  lox_int_array lines;
+} lox_ir_loop;
+
+typedef struct {
+  lox_chunk *chunk;
+  int arity;
+  // The size of the bytecode before it is lowered.
+  int code_size;
+  lox_ir_instruction *instructions;
+  int instruction_count;
+  // The index of the instruction at each offset, or -1 in the middle of one.
+  int *instruction_at;
+  lox_ir_block *blocks;
+  int block_count;
+  // The reachable blocks, in reverse postorder.
+  int *order;
+  int order_count;
+  int max_depth;
+  int global_count;
+  // The first constant equal to each constant, since the compiler adds a new
+  // one for each literal.
+  int *constants;
+  // The stack slots that are captured by a closure. Calls can change them
+  // behind our back, so nothing is known about their values.
+  bool *captured;
+  lox_ir_value_array values;
+  // A hash table of the values, so that equal values get the same number.
+  // Each entry is the index of a value plus one, or 0 if it is empty.
+  int *table;
+  int table_capacity;
+  lox_ir_loop *loops;
+  int loop_count;
+  // The line of each byte of the bytecode.
+  int *lines;
+} lox_ir;
+
+// The state of the simulation of a block.
+typedef struct {
+  lox_ir *ir;
+  lox_ir_state *state;
+  int depth;
+  // Whether the instructions are rewritten as they are simulated, which is
+  // only done once the analysis has settled. For each stack slot, the
+  // instructions that computed its value without side effects, as the range
+  // from `starts` to `ends`, or -1 if they didn't. `safe` tells whether those
+  // instructions can't fail either.
+  bool rewrite;
+  int *starts;
+  int *ends;
+  bool *safe;
+  // Only while rewriting, the slots live once the current instruction ran.
+  bool *live;
+} lox_ir_simulation;
+
+static int read_short(uint8_t *code) { return code[0] << 8 | code[1]; }
+
+static bool is_long(lox_op_code op) {
+  return op == OP_CONSTANT_LONG || op == OP_GET_GLOBAL_LONG ||
+         op == OP_SET_GLOBAL_LONG || op == OP_DEFINE_GLOBAL_LONG;
+}
+
+// The index of the constant or global an instruction refers to.
+static int read_index(uint8_t *code) {
+  return is_long(code[0]) ? read_short(&code[1]) : code[1];
+}
+
+static bool is_conditional_jump(lox_op_code op) {
+  return op == OP_JMP_FALSE || op == OP_JMP_TRUE;
+}
+
+static bool ends_block(lox_op_code op) {
+  return op == OP_JMP || op == OP_JMP_BACK || op == OP_RETURN ||
+         is_conditional_jump(op);
+}
+
+static bool is_get_global(lox_op_code op) {
+  return op == OP_GET_GLOBAL || op == OP_GET_GLOBAL_LONG;
+}
+
+// Returns how many values an instruction pops before pushing its results.
+static int pop_count(uint8_t *code) {
+  switch ((lox_op_code)code[0]) {
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_GREATER:
+  case OP_GREATEREQ:
+  case OP_LESS:
+  case OP_LESSEQ:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_MODULO:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+    return 2;
+  case OP_NEGATE:
+  case OP_NOT:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_CLOSE_UPVALUE:
+  case OP_GET_PROPERTY:
+  case OP_METHOD:
+  case OP_INHERIT:
+  case OP_RETURN:
+    return 1;
+  case OP_POPN:
+    return read_short(&code[1]);
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return code[1] + 1;
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+    return code[3] + 1;
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    return code[3] + 2;
+  default:
+    return 0;
+  }
+}
+
+// Whether the instruction can be analyzed. Quickened instructions and
+// superinstructions only appear once the bytecode has been optimized or run,
+// and switch tables would need a block to have more than two successors.
+static bool is_supported(lox_op_code op) {
+  return op > OP_INVALID && op <= OP_RETURN &&
+         (op < OP_ADD_NUM || op > OP_LESSEQ_NUM) && op != OP_SWITCH_TABLE &&
+         op != OP_SWITCH_HASH;
+}
+
+static int value_hash(int kind, int a, int b, int immediate) {
+  uint32_t hash = 2166136261u;
+  int parts[] = {kind, a, b, immediate};
+  for (int i = 0; i < 4; i++) {
+    hash ^= (uint32_t)parts[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void grow_table(lox_ir *ir) {
+  int capacity = ir->table_capacity < 64 ? 64 : ir->table_capacity * 2;
+  FREE_ARRAY(int, ir->table, ir->table_capacity);
+  ir->table = ALLOC_ARRAY(int, capacity);
+  ir->table_capacity = capacity;
+  memset(ir->table, 0, sizeof(int) * capacity);
+
+  for (int id = 0; id < ir->values.size; id++) {
+    lox_ir_value *value = &ir->values.values[id];
+    uint32_t i =
+        value_hash(value->kind, value->a, value->b, value->immediate) &
+        (capacity - 1);
+    while (ir->table[i] != 0) {
+      i = (i + 1) & (capacity - 1);
+    }
+    ir->table[i] = id + 1;
+  }
+}
+
+// Returns the number of the value computed by `kind` from the values `a` and
+// `b`, and an immediate operand. Equal computations get the same number.
+static int make_value(lox_ir *ir, int kind, int a, int b, int immediate) {
+  if ((ir->values.size + 1) * 2 > ir->table_capacity)
+    grow_table(ir);
+
+  uint32_t mask = ir->table_capacity - 1;
+  for (uint32_t i = value_hash(kind, a, b, immediate) & mask;;
+       i = (i + 1) & mask) {
+    if (ir->table[i] != 0) {
+      lox_ir_value *value = &ir->values.values[ir->table[i] - 1];
+      if (value->kind == kind && value->a == a && value->b == b &&
+          value->immediate == immediate)
+        return ir->table[i] - 1;
+      continue;
+    }
+
+    lox_ir_value value = {kind, a, b, immediate, false};
+    switch (kind) {
+    case OP_CONSTANT:
+      value.is_number =
+          lox_value_is_number(ir->chunk->constants.values[immediate]);
+      break;
+    case OP_ADD:
+      value.is_number = ir->values.values[a].is_number &&
+                        ir->values.values[b].is_number;
+      break;
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_NEGATE:
+      value.is_number = true;
+      break;
+    default:
+      break;
+    }
+    lox_ir_value_array_push(&ir->values, value);
+    ir->table[i] = ir->values.size;
+    return ir->values.size - 1;
+  }
+}
+
+static int opaque(lox_ir *ir, int instruction) {
+  return make_value(ir, VALUE_OPAQUE, -1, -1, instruction);
+}
+
+// Returns the value of a global or upvalue, given the state of the memory.
+static int load(lox_ir *ir, lox_op_code op, int index, int memory) {
+  int kind = op == OP_GET_UPVALUE ? MEMORY_STORE_UPVALUE : MEMORY_STORE_GLOBAL;
+  for (int i = 0; i < LOX_IR_MAX_STORE_WALK; i++) {
+    lox_ir_value *state = &ir->values.values[memory];
+    if (state->kind == kind && state->immediate == index)
+      return state->a;
+    if (state->kind != MEMORY_STORE_GLOBAL &&
+        state->kind != MEMORY_STORE_UPVALUE)
+      break;
+    memory = state->b;
+  }
+  return make_value(ir, op == OP_GET_UPVALUE ? OP_GET_UPVALUE : OP_GET_GLOBAL,
+                    memory, -1, index);
+}
+
+// Returns whether a value is known to be truthy (1) or falsey (0), or -1.
+static int truthiness(lox_ir *ir, int id) {
+  lox_ir_value *value = &ir->values.values[id];
+  switch (value->kind) {
+  case OP_TRUE:
+    return 1;
+  case OP_FALSE:
+  case OP_NIL:
+    return 0;
+  case OP_CONSTANT:
+    return !lox_is_falsey(ir->chunk->constants.values[value->immediate]);
+  case OP_NOT: {
+    int operand = truthiness(ir, value->a);
+    return operand == -1 ? -1 : !operand;
+  }
+  default:
+    return value->is_number ? 1 : -1;
+  }
+}
+
+static lox_ir_instruction *instruction(lox_ir *ir, int index) {
+  return &ir->instructions[index];
+}
+
+static uint8_t *code_of(lox_ir *ir, int index) {
+  return &ir->chunk->code.values[ir->instructions[index].offset];
+}
+
+// Splits the bytecode into instructions and basic blocks. Returns false if it
+// contains instructions the analysis doesn't support.
+static bool build_blocks(lox_ir *ir) {
+  lox_chunk *chunk = ir->chunk;
+  int size = chunk->code.size;
+  ir->instruction_at = ALLOC_ARRAY(int, size + 1);
+  for (int i = 0; i <= size; i++) {
+    ir->instruction_at[i] = -1;
+  }
+
+  int count = 0;
+  for (int offset = 0; offset < size;
+       offset += lox_chunk_instruction_length(chunk, offset)) {
+    if (!is_supported(chunk->code.values[offset]))
+      return false;
+    ir->instruction_at[offset] = count++;
+  }
+  ir->instructions = ALLOC_ARRAY(lox_ir_instruction, count);
+  ir->instruction_count = count;
+  for (int offset = 0; offset < size;
+       offset += lox_chunk_instruction_length(chunk, offset)) {
+    lox_ir_instruction *instr =
+        instruction(ir, ir->instruction_at[offset]);
+    instr->offset = offset;
+    instr->depth = -1;
+    instr->emit = EMIT_ORIGINAL;
+    instr->replacement_length = 0;
+    instr->hoisted_loop = -1;
+    instr->exit_pops = 0;
+    instr->pops_after = 0;
+    instr->hoisted_slot = -1;
+
+    uint8_t *code = &chunk->code.values[offset];
+    switch (code[0]) {
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+      if (read_index(code) >= ir->global_count)
+        ir->global_count = read_index(code) + 1;
+      break;
+    default:
+      break;
+    }
+  }
+
+  // A block starts at the first instruction, at the destination of a jump, and
+  // after a jump or a return.
+  bool *leaders = ALLOC_ARRAY(bool, count + 1);
+  memset(leaders, 0, sizeof(bool) * (count + 1));
+  leaders[0] = true;
+  bool valid = true;
+  for (int i = 0; i < count; i++) {
+    int target = lox_chunk_jump_target(chunk, instruction(ir, i)->offset);
+    if (target != -1) {
+      if (target < 0 || target >= size || ir->instruction_at[target] == -1) {
+        valid = false;
+        break;
+      }
+      leaders[ir->instruction_at[target]] = true;
+    }
+    if (ends_block(*code_of(ir, i)))
+      leaders[i + 1] = true;
+  }
+
+  ir->block_count = 0;
+  for (int i = 0; i < count; i++) {
+    ir->block_count += leaders[i];
+  }
+  ir->blocks = ALLOC_ARRAY(lox_ir_block, ir->block_count);
+  for (int i = 0, block = -1; i < count; i++) {
+    if (leaders[i]) {
+      block++;
+      ir->blocks[block].first = i;
+      if (block > 0)
+        ir->blocks[block - 1].end = i;
+    }
+    instruction(ir, i)->block = block;
+  }
+  if (ir->block_count > 0)
+    ir->blocks[ir->block_count - 1].end = count;
+  FREE_ARRAY(bool, leaders, count + 1);
+
+  for (int b = 0; b < ir->block_count; b++) {
+    lox_ir_block *block = &ir->blocks[b];
+    block->depth = -1;
+    block->successors[0] = block->successors[1] = -1;
+    block->taken[0] = block->taken[1] = false;
+    lox_int_array_initialize(&block->predecessors);
+    block->reachable = false;
+    block->visited = false;
+    block->entry.slots = block->exit.slots = NULL;
+    block->entry.defined = block->exit.defined = NULL;
+    block->phis = NULL;
+    block->memory_phi = false;
+    block->live_out = NULL;
+    block->idom = -1;
+    block->order = -1;
+    block->loop = -1;
+  }
+  if (!valid)
+    return false;
+
+  for (int b = 0; b < ir->block_count; b++) {
+    lox_ir_block *block = &ir->blocks[b];
+    int last = block->end - 1;
+    lox_op_code op = *code_of(ir, last);
+    int target = lox_chunk_jump_target(chunk, instruction(ir, last)->offset);
+    if (op != OP_JMP && op != OP_JMP_BACK && op != OP_RETURN) {
+      // Falling off the end of the bytecode can't be analyzed.
+      if (b + 1 == ir->block_count)
+        return false;
+      block->successors[0] = b + 1;
+    }
+    if (target != -1)
+      block->successors[1] = instruction(ir, ir->instruction_at[target])->block;
+    for (int i = 0; i < 2; i++) {
+      if (block->successors[i] != -1 &&
+          (i == 0 || block->successors[1] != block->successors[0]))
+        lox_int_array_push(&ir->blocks[block->successors[i]].predecessors, b);
+    }
+  }
+  return true;
+}
+
+// Computes the size of the stack before each instruction, following every
+// path through the bytecode. Returns false if two paths reach an instruction
+// with different sizes.
+static bool compute_depths(lox_ir *ir) {
+  lox_int_array pending;
+  lox_int_array_initialize(&pending);
+  ir->blocks[0].depth = ir->arity + 1;
+  ir->max_depth = ir->arity + 1;
+  lox_int_array_push(&pending, 0);
+
+  bool valid = true;
+  while (valid && pending.size > 0) {
+    lox_ir_block *block = &ir->blocks[lox_int_array_pop(&pending)];
+    int depth = block->depth;
+    for (int i = block->first; i < block->end; i++) {
+      instruction(ir, i)->depth = depth;
+      if (depth < pop_count(code_of(ir, i))) {
+        valid = false;
+        break;
+      }
+      depth += lox_chunk_stack_effect(ir->chunk, instruction(ir, i)->offset);
+      if (depth > ir->max_depth)
+        ir->max_depth = depth;
+    }
+    block->exit_depth = depth;
+
+    for (int i = 0; valid && i < 2; i++) {
+      if (block->successors[i] == -1)
+        continue;
+      lox_ir_block *successor = &ir->blocks[block->successors[i]];
+      if (successor->depth == -1) {
+        successor->depth = depth;
+        lox_int_array_push(&pending, block->successors[i]);
+      } else if (successor->depth != depth) {
+        valid = false;
+      }
+    }
+  }
+
+  lox_int_array_free(&pending);
+  return valid;
+}
+
+// Orders the blocks that can be reached from the first one in reverse
+// postorder, so that a block comes before its successors except along the
+// edges that go back to the start of a loop.
+static void order_blocks(lox_ir *ir) {
+  int count = ir->block_count;
+  bool *seen = ALLOC_ARRAY(bool, count);
+  memset(seen, 0, sizeof(bool) * count);
+  int *postorder = ALLOC_ARRAY(int, count);
+  int postorder_count = 0;
+  // Pairs of a block and the next successor to visit.
+  lox_int_array stack;
+  lox_int_array_initialize(&stack);
+  lox_int_array_push(&stack, 0);
+  lox_int_array_push(&stack, 0);
+  seen[0] = true;
+
+  while (stack.size > 0) {
+    int next = stack.values[stack.size - 1];
+    int b = stack.values[stack.size - 2];
+    if (next == 2) {
+      stack.size -= 2;
+      postorder[postorder_count++] = b;
+      continue;
+    }
+    stack.values[stack.size - 1]++;
+    int successor = ir->blocks[b].successors[next];
+    if (successor != -1 && !seen[successor]) {
+      seen[successor] = true;
+      lox_int_array_push(&stack, successor);
+      lox_int_array_push(&stack, 0);
+    }
+  }
+
+  ir->order = ALLOC_ARRAY(int, postorder_count);
+  ir->order_count = postorder_count;
+  for (int i = 0; i < postorder_count; i++) {
+    int b = postorder[postorder_count - 1 - i];
+    ir->order[i] = b;
+    ir->blocks[b].order = i;
+  }
+
+  lox_int_array_free(&stack);
+  FREE_ARRAY(int, postorder, count);
+  FREE_ARRAY(bool, seen, count);
+}
+
+static bool is_edge(lox_ir *ir, int from, int to, bool taken_only) {
+  lox_ir_block *block = &ir->blocks[from];
+  for (int i = 0; i < 2; i++) {
+    if (block->successors[i] == to && (!taken_only || block->taken[i]))
+      return true;
+  }
+  return false;
+}
+
+static bool is_included(lox_ir *ir, int b, bool taken_only) {
+  return ir->blocks[b].order != -1 && (!taken_only || ir->blocks[b].reachable);
+}
+
+// Computes the immediate dominator of each block, with the algorithm of
+// Cooper, Harvey and Kennedy. With `taken_only`, only the edges control can
+// take count.
+static void compute_dominators(lox_ir *ir, bool taken_only) {
+  for (int b = 0; b < ir->block_count; b++) {
+    ir->blocks[b].idom = -1;
+  }
+  ir->blocks[0].idom = 0;
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 1; i < ir->order_count; i++) {
+      int b = ir->order[i];
+      if (!is_included(ir, b, taken_only))
+        continue;
+      int idom = -1;
+      lox_int_array *predecessors = &ir->blocks[b].predecessors;
+      for (int j = 0; j < predecessors->size; j++) {
+        int p = predecessors->values[j];
+        if (!is_included(ir, p, taken_only) || ir->blocks[p].idom == -1 ||
+            !is_edge(ir, p, b, taken_only))
+          continue;
+        if (idom == -1) {
+          idom = p;
+          continue;
+        }
+        int x = p;
+        int y = idom;
+        while (x != y) {
+          while (ir->blocks[x].order > ir->blocks[y].order)
+            x = ir->blocks[x].idom;
+          while (ir->blocks[y].order > ir->blocks[x].order)
+            y = ir->blocks[y].idom;
+        }
+        idom = x;
+      }
+      if (idom != ir->blocks[b].idom) {
+        ir->blocks[b].idom = idom;
+        changed = true;
+      }
+    }
+  }
+}
+
+static bool dominates(lox_ir *ir, int a, int b) {
+  while (b != a && b != 0 && ir->blocks[b].idom != -1) {
+    b = ir->blocks[b].idom;
+  }
+  return b == a;
+}
+
+// Whether every edge that goes back to an earlier block goes to the start of a
+// loop. The numbering of the values relies on every cycle going through a
+// block that dominates it.
+static bool is_reducible(lox_ir *ir) {
+  compute_dominators(ir, false);
+  for (int i = 0; i < ir->order_count; i++) {
+    int b = ir->order[i];
+    for (int j = 0; j < 2; j++) {
+      int successor = ir->blocks[b].successors[j];
+      if (successor != -1 && ir->blocks[successor].order <= i &&
+          !dominates(ir, successor, b))
+        return false;
+    }
+  }
+  return true;
+}
+
+static void state_init(lox_ir *ir, lox_ir_state *state) {
+  state->slots = ALLOC_ARRAY(int, ir->max_depth);
+  state->defined = ALLOC_ARRAY(bool, ir->global_count);
+  state->memory = -1;
+  memset(state->defined, 0, sizeof(bool) * ir->global_count);
+}
+
+static void state_free(lox_ir *ir, lox_ir_state *state) {
+  FREE_ARRAY(int, state->slots, ir->max_depth);
+  FREE_ARRAY(bool, state->defined, ir->global_count);
+}
+
+static void state_copy(lox_ir *ir, lox_ir_state *dst, lox_ir_state *src,
+                       int depth) {
+  memcpy(dst->slots, src->slots, sizeof(int) * depth);
+  memcpy(dst->defined, src->defined, sizeof(bool) * ir->global_count);
+  dst->memory = src->memory;
+}
+
+static bool adjacent(lox_ir *ir, int first, int second);
+static void reuse(lox_ir_simulation *sim, int index);
+
+static void pop(lox_ir_simulation *sim, int count) { sim->depth -= count; }
+
+// Pushes a value computed by the instruction at `index` alone.
+static void push_leaf(lox_ir_simulation *sim, int index, int value,
+                      bool safe) {
+  int slot = sim->depth++;
+  sim->state->slots[slot] = value;
+  if (sim->rewrite) {
+    sim->starts[slot] = index;
+    sim->ends[slot] = index;
+    sim->safe[slot] = safe;
+    reuse(sim, index);
+  }
+}
+
+// Pushes a value that comes from instructions with side effects.
+static void push_other(lox_ir_simulation *sim, int value) {
+  int slot = sim->depth++;
+  sim->state->slots[slot] = value;
+  if (sim->rewrite)
+    sim->starts[slot] = -1;
+}
+
+// Replaces the `operands` values on top of the stack by the value that the
+// instruction at `index` computes from them, without side effects.
+static void push_computed(lox_ir_simulation *sim, int index, int operands,
+                          int value, bool can_fail) {
+  int base = sim->depth - operands;
+  int start = -1;
+  bool safe = !can_fail;
+  if (sim->rewrite) {
+    // The operands have to be computed by instructions that follow each other
+    // right before this one.
+    start = sim->starts[base];
+    for (int i = base; i < sim->depth && start != -1; i++) {
+      int next = i + 1 < sim->depth ? sim->starts[i + 1] : index;
+      if (sim->starts[i] == -1 || !adjacent(sim->ir, sim->ends[i], next))
+        start = -1;
+      safe &= sim->safe[i];
+    }
+  }
+
+  sim->depth = base + 1;
+  sim->state->slots[base] = value;
+  if (sim->rewrite) {
+    sim->starts[base] = start;
+    sim->ends[base] = index;
+    sim->safe[base] = safe && start != -1;
+    if (start != -1)
+      reuse(sim, index);
+  }
+}
+
+static void store(lox_ir_simulation *sim, int kind, int index) {
+  lox_ir_state *state = sim->state;
+  state->memory = make_value(sim->ir, kind, state->slots[sim->depth - 1],
+                             state->memory, index);
+}
+
+// Simulates the instruction at `index`, updating the values on the stack and
+// in memory.
+static void transfer(lox_ir_simulation *sim, int index) {
+  lox_ir *ir = sim->ir;
+  lox_ir_state *state = sim->state;
+  int *slots = state->slots;
+  uint8_t *code = code_of(ir, index);
+  lox_op_code op = code[0];
+
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+    push_leaf(sim, index,
+              make_value(ir, OP_CONSTANT, -1, -1,
+                         ir->constants[read_index(code)]),
+              true);
+    break;
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+    push_leaf(sim, index, make_value(ir, op, -1, -1, 0), true);
+    break;
+  case OP_GET_LOCAL:
+    push_leaf(sim, index,
+              ir->captured[code[1]] ? opaque(ir, index) : slots[code[1]],
+              true);
+    break;
+  case OP_SET_LOCAL:
+    slots[code[1]] =
+        ir->captured[code[1]] ? opaque(ir, index) : slots[sim->depth - 1];
+    if (sim->rewrite)
+      sim->starts[code[1]] = -1;
+    break;
+  case OP_GET_UPVALUE:
+    push_leaf(sim, index, load(ir, op, code[1], state->memory), true);
+    break;
+  case OP_SET_UPVALUE:
+    store(sim, MEMORY_STORE_UPVALUE, code[1]);
+    break;
+  case OP_GET_CAPTURE:
+    // The values a closure captured never change.
+    push_leaf(sim, index, make_value(ir, OP_GET_CAPTURE, -1, -1, code[1]),
+              true);
+    break;
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG: {
+    int global = read_index(code);
+    bool defined = state->defined[global];
+    state->defined[global] = true;
+    push_leaf(sim, index, load(ir, OP_GET_GLOBAL, global, state->memory),
+              defined);
+    break;
+  }
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG:
+    store(sim, MEMORY_STORE_GLOBAL, read_index(code));
+    state->defined[read_index(code)] = true;
+    break;
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+    store(sim, MEMORY_STORE_GLOBAL, read_index(code));
+    state->defined[read_index(code)] = true;
+    pop(sim, 1);
+    break;
+  case OP_DUP:
+    push_leaf(sim, index, slots[sim->depth - 1], true);
+    break;
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_GREATER:
+  case OP_GREATEREQ:
+  case OP_LESS:
+  case OP_LESSEQ:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_MODULO: {
+    int a = slots[sim->depth - 2];
+    int b = slots[sim->depth - 1];
+    bool numbers =
+        ir->values.values[a].is_number && ir->values.values[b].is_number;
+    // Dividing by zero fails even with numbers.
+    push_computed(sim, index, 2, make_value(ir, op, a, b, 0),
+                  op == OP_DIVIDE || (op != OP_EQ && op != OP_NEQ && !numbers));
+    break;
+  }
+  case OP_NOT:
+  case OP_NEGATE: {
+    int a = slots[sim->depth - 1];
+    push_computed(sim, index, 1, make_value(ir, op, a, -1, 0),
+                  op == OP_NEGATE && !ir->values.values[a].is_number);
+    break;
+  }
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    pop(sim, pop_count(code));
+    state->memory = make_value(ir, MEMORY_CLOBBER, -1, -1, index);
+    push_other(sim, opaque(ir, index));
+    break;
+  case OP_CLOSURE:
+  case OP_CLASS:
+  case OP_GET_PROPERTY:
+  case OP_GET_SUPER:
+    pop(sim, pop_count(code));
+    push_other(sim, opaque(ir, index));
+    break;
+  case OP_SET_PROPERTY: {
+    int value = slots[sim->depth - 1];
+    pop(sim, 2);
+    push_other(sim, value);
+    break;
+  }
+  default:
+    pop(sim, pop_count(code));
+    break;
+  }
+}
+
+// Whether the instructions between the ones at `first` and `second` are all
+// removed, so that the second one runs right after the first one.
+static bool adjacent(lox_ir *ir, int first, int second) {
+  if (second <= first)
+    return false;
+  for (int i = first + 1; i < second; i++) {
+    if (instruction(ir, i)->emit != EMIT_NONE)
+      return false;
+  }
+  return true;
+}
+
+static void remove_range(lox_ir *ir, int first, int last) {
+  for (int i = first; i <= last; i++) {
+    instruction(ir, i)->emit = EMIT_NONE;
+  }
+}
+
+static void replace(lox_ir *ir, int index, lox_op_code op, int operand,
+                    int operand_length) {
+  lox_ir_instruction *instr = instruction(ir, index);
+  instr->emit = EMIT_REPLACED;
+  instr->replacement[0] = op;
+  if (operand_length == 1) {
+    instr->replacement[1] = operand;
+  } else if (operand_length == 2) {
+    instr->replacement[1] = (operand >> 8) & 0xff;
+    instr->replacement[2] = operand & 0xff;
+  }
+  instr->replacement_length = 1 + operand_length;
+}
+
+// Global value numbering: once the instruction at `index` has pushed a value
+// that is already in another stack slot, the instructions that computed it
+// read that slot instead.
+static void reuse(lox_ir_simulation *sim, int index) {
+  lox_ir *ir = sim->ir;
+  int top = sim->depth - 1;
+  int start = sim->starts[top];
+  int value = sim->state->slots[top];
+
+  int emitted = 0;
+  for (int i = start; i <= index; i++) {
+    emitted += instruction(ir, i)->emit != EMIT_NONE;
+  }
+  lox_op_code op = *code_of(ir, start);
+  if (emitted < 2 && !(emitted == 1 && (is_get_global(op) ||
+                                        op == OP_GET_UPVALUE)))
+    return;
+
+  // The slot has to be live, or a store to it could have been removed.
+  for (int slot = top - 1; slot >= 0; slot--) {
+    if (sim->state->slots[slot] != value || ir->captured[slot] ||
+        !sim->live[slot])
+      continue;
+    if (slot != top - 1 && slot > UINT8_MAX)
+      return;
+
+    remove_range(ir, start, index);
+    if (slot == top - 1) {
+      replace(ir, start, OP_DUP, 0, 0);
+    } else {
+      replace(ir, start, OP_GET_LOCAL, slot, 1);
+    }
+    // Reading a slot can't fail.
+    sim->safe[top] = true;
+    return;
+  }
+}
+
+// Decides how the instruction at `index` is rewritten, before it is simulated.
+static void rewrite(lox_ir_simulation *sim, int index) {
+  lox_ir *ir = sim->ir;
+  lox_ir_instruction *instr = instruction(ir, index);
+  lox_ir_block *block = &ir->blocks[instr->block];
+  uint8_t *code = code_of(ir, index);
+  int top = sim->depth - 1;
+
+  switch (code[0]) {
+  case OP_POP:
+    // An expression whose value is discarded is removed along with its POP,
+    // unless it has side effects or can fail.
+    if (sim->starts[top] != -1 && sim->safe[top] &&
+        adjacent(ir, sim->ends[top], index)) {
+      remove_range(ir, sim->starts[top], sim->ends[top]);
+      instr->emit = EMIT_NONE;
+    }
+    break;
+  case OP_SET_LOCAL:
+    if (!ir->captured[code[1]] && !sim->live[code[1]])
+      instr->emit = EMIT_NONE;
+    break;
+  case OP_JMP_FALSE:
+  case OP_JMP_TRUE:
+    // The analysis knows which way the branch goes.
+    if (!block->taken[1]) {
+      instr->emit = EMIT_NONE;
+    } else if (!block->taken[0]) {
+      replace(ir, index, OP_JMP, 0, 2);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// Updates the slots live before the instruction at `index`, given those live
+// after it.
+static void live_before(lox_ir *ir, int index, bool *live) {
+  lox_ir_instruction *instr = instruction(ir, index);
+  uint8_t *code = code_of(ir, index);
+  int depth = instr->depth;
+  int pops = pop_count(code);
+
+  for (int slot = depth - pops; slot < ir->max_depth; slot++) {
+    live[slot] = false;
+  }
+  if (code[0] != OP_POP && code[0] != OP_POPN) {
+    for (int slot = depth - pops; slot < depth; slot++) {
+      live[slot] = true;
+    }
+  }
+
+  switch (code[0]) {
+  case OP_GET_LOCAL:
+    live[code[1]] = true;
+    break;
+  case OP_SET_LOCAL:
+    live[code[1]] = false;
+    live[depth - 1] = true;
+    break;
+  case OP_DUP:
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG:
+  case OP_SET_UPVALUE:
+  case OP_JMP_FALSE:
+  case OP_JMP_TRUE:
+    live[depth - 1] = true;
+    break;
+  case OP_METHOD:
+  case OP_INHERIT:
+    live[depth - 2] = true;
+    break;
+  case OP_CLOSURE: {
+    int length = lox_chunk_instruction_length(ir->chunk, instr->offset);
+    for (int i = 3; i < length; i += 3) {
+      if (code[i] & LOX_CAPTURE_LOCAL)
+        live[read_short(&code[i + 1])] = true;
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// Computes which slots are live at the end of each reachable block.
+static void compute_liveness(lox_ir *ir) {
+  bool *live = ALLOC_ARRAY(bool, ir->max_depth);
+  for (int i = 0; i < ir->order_count; i++) {
+    lox_ir_block *block = &ir->blocks[ir->order[i]];
+    block->live_out = ALLOC_ARRAY(bool, ir->max_depth);
+    memset(block->live_out, 0, sizeof(bool) * ir->max_depth);
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = ir->order_count - 1; i >= 0; i--) {
+      lox_ir_block *block = &ir->blocks[ir->order[i]];
+      if (!block->reachable)
+        continue;
+      for (int j = 0; j < 2; j++) {
+        if (!block->taken[j])
+          continue;
+        lox_ir_block *successor = &ir->blocks[block->successors[j]];
+        memcpy(live, successor->live_out, sizeof(bool) * ir->max_depth);
+        for (int k = successor->end - 1; k >= successor->first; k--) {
+          live_before(ir, k, live);
+        }
+        for (int slot = 0; slot < block->exit_depth; slot++) {
+          if (live[slot] && !block->live_out[slot]) {
+            block->live_out[slot] = true;
+            changed = true;
+          }
+        }
+      }
+    }
+  }
+  FREE_ARRAY(bool, live, ir->max_depth);
+}
+
+// Computes the values at the start of a block from those at the end of its
+// predecessors. Returns whether they changed.
+static bool join(lox_ir *ir, int b, lox_ir_state *initial) {
+  lox_ir_block *block = &ir->blocks[b];
+  int depth = block->depth;
+  bool first = true;
+  bool changed = false;
+  bool *differs = ALLOC_ARRAY(bool, depth + 1);
+  memset(differs, 0, sizeof(bool) * (depth + 1));
+  int *slots = ALLOC_ARRAY(int, depth);
+  bool *defined = ALLOC_ARRAY(bool, ir->global_count);
+  int memory = -1;
+
+  for (int i = -1; i < block->predecessors.size; i++) {
+    lox_ir_state *source;
+    if (i == -1) {
+      if (b != 0)
+        continue;
+      source = initial;
+    } else {
+      int p = block->predecessors.values[i];
+      if (!ir->blocks[p].visited || !is_edge(ir, p, b, true))
+        continue;
+      source = &ir->blocks[p].exit;
+    }
+
+    if (first) {
+      memcpy(slots, source->slots, sizeof(int) * depth);
+      memcpy(defined, source->defined, sizeof(bool) * ir->global_count);
+      memory = source->memory;
+      first = false;
+      continue;
+    }
+    for (int slot = 0; slot < depth; slot++) {
+      differs[slot] |= slots[slot] != source->slots[slot];
+    }
+    differs[depth] |= memory != source->memory;
+    for (int global = 0; global < ir->global_count; global++) {
+      defined[global] &= source->defined[global];
+    }
+  }
+
+  lox_ir_state *entry = &block->entry;
+  if (entry->slots == NULL) {
+    state_init(ir, entry);
+    state_init(ir, &block->exit);
+    block->phis = ALLOC_ARRAY(bool, ir->max_depth);
+    memset(block->phis, 0, sizeof(bool) * ir->max_depth);
+    memcpy(entry->defined, defined, sizeof(bool) * ir->global_count);
+    for (int slot = 0; slot < depth; slot++) {
+      entry->slots[slot] = -1;
+    }
+    changed = true;
+  }
+
+  for (int slot = 0; slot < depth; slot++) {
+    block->phis[slot] |= differs[slot];
+    int value = block->phis[slot] ? make_value(ir, VALUE_PHI, b, slot, 0)
+                                  : slots[slot];
+    changed |= entry->slots[slot] != value;
+    entry->slots[slot] = value;
+  }
+  block->memory_phi |= differs[depth];
+  int value = block->memory_phi ? make_value(ir, MEMORY_PHI, b, -1, 0) : memory;
+  changed |= entry->memory != value;
+  entry->memory = value;
+  for (int global = 0; global < ir->global_count; global++) {
+    if (entry->defined[global] && !defined[global]) {
+      entry->defined[global] = false;
+      changed = true;
+    }
+  }
+
+  FREE_ARRAY(bool, differs, depth + 1);
+  FREE_ARRAY(int, slots, depth);
+  FREE_ARRAY(bool, defined, ir->global_count);
+  return changed;
+}
+
+static void simulate(lox_ir *ir, int b, lox_ir_simulation *sim) {
+  lox_ir_block *block = &ir->blocks[b];
+  state_copy(ir, &block->exit, &block->entry, block->depth);
+  sim->ir = ir;
+  sim->state = &block->exit;
+  sim->depth = block->depth;
+  if (!sim->rewrite) {
+    for (int i = block->first; i < block->end; i++) {
+      transfer(sim, i);
+    }
+    return;
+  }
+
+  // The slots live after each instruction of the block.
+  int count = block->end - block->first;
+  int size = ir->max_depth;
+  bool *live = ALLOC_ARRAY(bool, count * size);
+  memcpy(&live[(count - 1) * size], block->live_out, sizeof(bool) * size);
+  for (int i = count - 1; i > 0; i--) {
+    memcpy(&live[(i - 1) * size], &live[i * size], sizeof(bool) * size);
+    live_before(ir, block->first + i, &live[(i - 1) * size]);
+  }
+  for (int i = 0; i < count; i++) {
+    sim->live = &live[i * size];
+    rewrite(sim, block->first + i);
+    transfer(sim, block->first + i);
+  }
+  FREE_ARRAY(bool, live, count * size);
+}
+
+// Decides which successors control can go to once the block has been
+// simulated. Returns whether new ones were found.
+static bool branch(lox_ir *ir, int b) {
+  lox_ir_block *block = &ir->blocks[b];
+  lox_op_code op = *code_of(ir, block->end - 1);
+  bool taken[2] = {block->successors[0] != -1, block->successors[1] != -1};
+  if (is_conditional_jump(op)) {
+    int truthy =
+        truthiness(ir, block->exit.slots[block->exit_depth - 1]);
+    if (truthy != -1) {
+      bool jumps = op == OP_JMP_TRUE ? truthy : !truthy;
+      taken[0] = !jumps;
+      taken[1] = jumps;
+    }
+  }
+
+  bool changed = false;
+  for (int i = 0; i < 2; i++) {
+    if (taken[i] && !block->taken[i]) {
+      block->taken[i] = true;
+      changed = true;
+      ir->blocks[block->successors[i]].reachable = true;
+    }
+  }
+  return changed;
+}
+
+// Numbers the values of every block until they settle. Blocks and branches are
+// assumed unreachable until control is found to reach them. Returns false if
+// the values didn't settle.
+static bool analyze(lox_ir *ir) {
+  lox_ir_state initial;
+  state_init(ir, &initial);
+  for (int slot = 0; slot <= ir->arity; slot++) {
+    initial.slots[slot] = make_value(ir, VALUE_PARAMETER, -1, -1, slot);
+  }
+  initial.memory = make_value(ir, MEMORY_ENTRY, -1, -1, 0);
+
+  lox_ir_simulation sim;
+  sim.rewrite = false;
+  ir->blocks[0].reachable = true;
+  bool changed = true;
+  int iterations = 0;
+  while (changed && iterations++ < LOX_IR_MAX_ITERATIONS) {
+    changed = false;
+    for (int i = 0; i < ir->order_count; i++) {
+      int b = ir->order[i];
+      if (!ir->blocks[b].reachable)
+        continue;
+      changed |= join(ir, b, &initial);
+      simulate(ir, b, &sim);
+      ir->blocks[b].visited = true;
+      changed |= branch(ir, b);
+    }
+  }
+
+  state_free(ir, &initial);
+  return !changed;
+}
+
+// Simulates every block once more, deciding how each instruction is
+// rewritten. The blocks are visited in the order of the bytecode, so that what
+// is known about the values on the stack carries over to a block that only
+// the previous one falls through to.
+static void rewrite_blocks(lox_ir *ir) {
+  lox_ir_simulation sim;
+  sim.rewrite = true;
+  sim.starts = ALLOC_ARRAY(int, ir->max_depth);
+  sim.ends = ALLOC_ARRAY(int, ir->max_depth);
+  sim.safe = ALLOC_ARRAY(bool, ir->max_depth);
+
+  for (int b = 0; b < ir->block_count; b++) {
+    lox_ir_block *block = &ir->blocks[b];
+    if (!block->reachable)
+      continue;
+
+    bool carries = b > 0 && ir->blocks[b - 1].reachable &&
+                   ir->blocks[b - 1].taken[0] &&
+                   ir->blocks[b - 1].successors[0] == b;
+    for (int i = 0; i < block->predecessors.size && carries; i++) {
+      int p = block->predecessors.values[i];
+      carries = p == b - 1 || !is_edge(ir, p, b, true);
+    }
+    if (!carries || b == 0) {
+      for (int slot = 0; slot < ir->max_depth; slot++) {
+        sim.starts[slot] = -1;
+      }
+    }
+    simulate(ir, b, &sim);
+  }
+
+  FREE_ARRAY(int, sim.starts, ir->max_depth);
+  FREE_ARRAY(int, sim.ends, ir->max_depth);
+  FREE_ARRAY(bool, sim.safe, ir->max_depth);
+}
+
+// The largest slot an instruction reads or writes, or -1.
+static int max_slot(lox_ir *ir, int index) {
+  lox_ir_instruction *instr = instruction(ir, index);
+  uint8_t *code = instr->emit == EMIT_REPLACED ? instr->replacement
+                                               : code_of(ir, index);
+  if (instr->emit == EMIT_NONE)
+    return -1;
+  if (code[0] == OP_GET_LOCAL || code[0] == OP_SET_LOCAL)
+    return code[1];
+  return -1;
+}
+
+// Tries to hoist the globals that the loop starting at block `header` reads
+// out of it. `body` tells which blocks are in the loop.
+static void hoist_loop(lox_ir *ir, int header, bool *body) {
+  lox_ir_block *head = &ir->blocks[header];
+  int depth = head->depth;
+
+  // The loop has to be entered by falling through from the block before it,
+  // where the loads are emitted.
+  if (header == 0)
+    return;
+  lox_ir_block *preheader = &ir->blocks[header - 1];
+  if (body[header - 1] || instruction(ir, head->first)->exit_pops > 0 ||
+      !preheader->reachable || !preheader->taken[0] ||
+      preheader->successors[0] != header ||
+      (preheader->taken[1] && preheader->successors[1] == header))
+    return;
+  for (int i = 0; i < head->predecessors.size; i++) {
+    int p = head->predecessors.values[i];
+    if (!body[p] && p != header - 1 && is_edge(ir, p, header, true))
+      return;
+  }
+
+  // Calls could change any global, and the loop can't write the ones it
+  // hoists.
+  bool *written = ALLOC_ARRAY(bool, ir->global_count);
+  memset(written, 0, sizeof(bool) * ir->global_count);
+  bool clobbers = false;
+  for (int b = 0; b < ir->block_count; b++) {
+    if (!body[b])
+      continue;
+    for (int i = ir->blocks[b].first; i < ir->blocks[b].end; i++) {
+      uint8_t *code = code_of(ir, i);
+      switch (code[0]) {
+      case OP_CALL:
+      case OP_TAIL_CALL:
+      case OP_INVOKE:
+      case OP_TAIL_INVOKE:
+      case OP_SUPER_INVOKE:
+      case OP_TAIL_SUPER_INVOKE:
+        clobbers = true;
+        break;
+      case OP_SET_GLOBAL:
+      case OP_SET_GLOBAL_LONG:
+      case OP_DEFINE_GLOBAL:
+      case OP_DEFINE_GLOBAL_LONG:
+        written[read_index(code)] = true;
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+  lox_ir_loop loop;
+  loop.header = header;
+  loop.depth = depth;
+  lox_int_array_initialize(&loop.globals);
+  lox_int_array_initialize(&loop.lines);
+  if (clobbers)
+    goto done;
+
+  // A global that isn't known to be defined before the loop can still be
+  // hoisted if it is loaded before anything else the loop does, since the
+  // load would fail in the same way.
+  for (int i = head->first; i < head->end; i++) {
+    lox_ir_instruction *instr = instruction(ir, i);
+    uint8_t *code = code_of(ir, i);
+    if (instr->emit == EMIT_NONE)
+      continue;
+    if (instr->emit == EMIT_ORIGINAL && is_get_global(code[0]) &&
+        !written[read_index(code)]) {
+      bool seen = false;
+      for (int j = 0; j < loop.globals.size; j++) {
+        seen |= loop.globals.values[j] == read_index(code);
+      }
+      if (!seen) {
+        lox_int_array_push(&loop.globals, read_index(code));
+        lox_int_array_push(&loop.lines, ir->lines[instr->offset]);
+      }
+      continue;
+    }
+    uint8_t op = instr->emit == EMIT_REPLACED ? instr->replacement[0] : code[0];
+    if (op != OP_CONSTANT && op != OP_CONSTANT_LONG && op != OP_NIL &&
+        op != OP_TRUE && op != OP_FALSE && op != OP_GET_LOCAL &&
+        op != OP_GET_UPVALUE && op != OP_GET_CAPTURE && op != OP_DUP)
+      break;
+  }
+  for (int b = 0; b < ir->block_count; b++) {
+    if (!body[b])
+      continue;
+    for (int i = ir->blocks[b].first; i < ir->blocks[b].end; i++) {
+      uint8_t *code = code_of(ir, i);
+      if (instruction(ir, i)->emit != EMIT_ORIGINAL || !is_get_global(code[0]))
+        continue;
+      int global = read_index(code);
+      bool seen = false;
+      for (int j = 0; j < loop.globals.size; j++) {
+        seen |= loop.globals.values[j] == global;
+      }
+      if (!seen && !written[global] && preheader->exit.defined[global]) {
+        lox_int_array_push(&loop.globals, global);
+        lox_int_array_push(&loop.lines, ir->lines[instruction(ir, i)->offset]);
+      }
+    }
+  }
+
+  int count = loop.globals.size;
+  if (count == 0 || depth + count - 1 > UINT8_MAX)
+    goto done;
+  for (int b = 0; b < ir->block_count; b++) {
+    if (!body[b])
+      continue;
+    for (int i = ir->blocks[b].first; i < ir->blocks[b].end; i++) {
+      if (max_slot(ir, i) >= depth && max_slot(ir, i) + count > UINT8_MAX)
+        goto done;
+    }
+  }
+
+  // Every way out of the loop pops the hoisted values. The blocks the loop
+  // exits to can only be reached from the loop, and either start with the
+  // same stack as the loop, or with the condition of the loop on top of it,
+  // which they pop.
+  for (int b = 0; b < ir->block_count; b++) {
+    if (!body[b])
+      continue;
+    for (int j = 0; j < 2; j++) {
+      int x = ir->blocks[b].successors[j];
+      if (!ir->blocks[b].taken[j] || body[x])
+        continue;
+      lox_ir_block *exit = &ir->blocks[x];
+      for (int k = 0; k < exit->predecessors.size; k++) {
+        int p = exit->predecessors.values[k];
+        if (!body[p] && is_edge(ir, p, x, true))
+          goto done;
+      }
+      lox_ir_instruction *first = instruction(ir, exit->first);
+      if (first->hoisted_loop != -1)
+        goto done;
+      if (exit->depth == depth)
+        continue;
+      if (exit->depth != depth + 1 || *code_of(ir, exit->first) != OP_POP ||
+          first->emit != EMIT_ORIGINAL)
+        goto done;
+    }
+  }
+
+  int index = ir->loop_count++;
+  ir->loops = GROW_ARRAY(lox_ir_loop, ir->loops, index, ir->loop_count);
+  ir->loops[index] = loop;
+  instruction(ir, head->first)->hoisted_loop = index;
+  for (int b = 0; b < ir->block_count; b++) {
+    if (!body[b])
+      continue;
+    ir->blocks[b].loop = index;
+    for (int i = ir->blocks[b].first; i < ir->blocks[b].end; i++) {
+      uint8_t *code = code_of(ir, i);
+      if (instruction(ir, i)->emit != EMIT_ORIGINAL || !is_get_global(code[0]))
+        continue;
+      for (int j = 0; j < count; j++) {
+        if (loop.globals.values[j] == read_index(code))
+          instruction(ir, i)->hoisted_slot = depth + j;
+      }
+    }
+    for (int j = 0; j < 2; j++) {
+      int x = ir->blocks[b].successors[j];
+      if (!ir->blocks[b].taken[j] || body[x])
+        continue;
+      lox_ir_instruction *first = instruction(ir, ir->blocks[x].first);
+      if (ir->blocks[x].depth == depth) {
+        first->exit_pops = count;
+      } else if (first->emit == EMIT_ORIGINAL) {
+        first->pops_after = count;
+      }
+    }
+  }
+  FREE_ARRAY(bool, written, ir->global_count);
+  return;
+
+done:
+  lox_int_array_free(&loop.globals);
+  lox_int_array_free(&loop.lines);
+  FREE_ARRAY(bool, written, ir->global_count);
+}
+
+// Loop-invariant code motion. The loops are found from the edges that go back
+// to a block dominating them, and only the innermost ones are considered, so
+// that the slots of their hoisted globals don't have to account for each
+// other.
+static void hoist(lox_ir *ir) {
+  compute_dominators(ir, true);
+  int count = ir->block_count;
+  bool *headers = ALLOC_ARRAY(bool, count);
+  memset(headers, 0, sizeof(bool) * count);
+  for (int b = 0; b < count; b++) {
+    for (int j = 0; j < 2; j++) {
+      int successor = ir->blocks[b].successors[j];
+      if (ir->blocks[b].reachable && ir->blocks[b].taken[j] &&
+          dominates(ir, successor, b))
+        headers[successor] = true;
+    }
+  }
+
+  bool *body = ALLOC_ARRAY(bool, count);
+  lox_int_array pending;
+  lox_int_array_initialize(&pending);
+  for (int header = 0; header < count; header++) {
+    if (!headers[header])
+      continue;
+
+    memset(body, 0, sizeof(bool) * count);
+    body[header] = true;
+    for (int b = 0; b < count; b++) {
+      if (is_edge(ir, b, header, true) && ir->blocks[b].reachable &&
+          dominates(ir, header, b) && !body[b]) {
+        body[b] = true;
+        lox_int_array_push(&pending, b);
+      }
+    }
+    while (pending.size > 0) {
+      lox_ir_block *block = &ir->blocks[lox_int_array_pop(&pending)];
+      for (int i = 0; i < block->predecessors.size; i++) {
+        int p = block->predecessors.values[i];
+        if (!body[p] && ir->blocks[p].reachable &&
+            is_edge(ir, p, block - ir->blocks, true)) {
+          body[p] = true;
+          lox_int_array_push(&pending, p);
+        }
+      }
+    }
+
+    bool innermost = true;
+    for (int b = 0; b < count; b++) {
+      innermost &= !body[b] || !headers[b] || b == header;
+    }
+    if (innermost)
+      hoist_loop(ir, header, body);
+  }
+
+  lox_int_array_free(&pending);
+  FREE_ARRAY(bool, body, count);
+  FREE_ARRAY(bool, headers, count);
+}
+
+// Appends the bytes of the instruction at `index` to `bytes`, moving the
+// slots of a loop whose globals are hoisted past them.
+static int instruction_bytes(lox_ir *ir, int index, uint8_t *bytes) {
+  lox_ir_instruction *instr = instruction(ir, index);
+  if (instr->hoisted_slot != -1) {
+    bytes[0] = OP_GET_LOCAL;
+    bytes[1] = instr->hoisted_slot;
+    return 2;
+  }
+
+  int length;
+  if (instr->emit == EMIT_REPLACED) {
+    length = instr->replacement_length;
+    memcpy(bytes, instr->replacement, length);
+    // Jumps keep their operand until their offsets are patched.
+  } else {
+    length = lox_chunk_instruction_length(ir->chunk, instr->offset);
+    memcpy(bytes, code_of(ir, index), length);
+  }
+
+  int loop = ir->blocks[instr->block].loop;
+  if (loop == -1)
+    return length;
+  int depth = ir->loops[loop].depth;
+  int count = ir->loops[loop].globals.size;
+  if (bytes[0] == OP_GET_LOCAL || bytes[0] == OP_SET_LOCAL) {
+    if (bytes[1] >= depth)
+      bytes[1] += count;
+  } else if (bytes[0] == OP_CLOSURE) {
+    for (int i = 3; i < length; i += 3) {
+      int slot = read_short(&bytes[i + 1]);
+      if ((bytes[i] & LOX_CAPTURE_LOCAL) && slot >= depth) {
+        bytes[i + 1] = ((slot + count) >> 8) & 0xff;
+        bytes[i + 2] = (slot + count) & 0xff;
+      }
+    }
+  }
+  return length;
+}
+
+static void emit_pops(lox_chunk *chunk, int count, int line) {
+  if (count == 1) {
+    lox_chunk_write(chunk, OP_POP, line);
+  } else {
+    uint8_t bytes[] = {OP_POPN, (count >> 8) & 0xff, count & 0xff};
+    lox_chunk_write_array(chunk, bytes, 3, line);
+  }
+}
+
+// Lowers the rewritten instructions back to bytecode. Returns false if a jump
+// got too long, in which case the chunk is left unchanged.
+static bool lower(lox_ir *ir) {
+  lox_chunk *chunk = ir->chunk;
+  int size = chunk->code.size;
+  int *new_offsets = ALLOC_ARRAY(int, size + 1);
+  lox_chunk lowered;
+  lox_chunk_initialize(&lowered);
+  // Pairs of the offset of a jump in the lowered chunk, and the offset of its
+  // destination in the original one.
+  lox_int_array jumps;
+  lox_int_array_initialize(&jumps);
+
+  for (int i = 0; i < ir->instruction_count; i++) {
+    lox_ir_instruction *instr = instruction(ir, i);
+    int line = ir->lines[instr->offset];
+    if (instr->hoisted_loop != -1) {
+      lox_ir_loop *loop = &ir->loops[instr->hoisted_loop];
+      for (int j = 0; j < loop->globals.size; j++) {
+        int global = loop->globals.values[j];
+        if (global <= UINT8_MAX) {
+          uint8_t bytes[] = {OP_GET_GLOBAL, global};
+          lox_chunk_write_array(&lowered, bytes, 2, loop->lines.values[j]);
+        } else {
+          uint8_t bytes[] = {OP_GET_GLOBAL_LONG, (global >> 8) & 0xff,
+                             global & 0xff};
+          lox_chunk_write_array(&lowered, bytes, 3, loop->lines.values[j]);
+        }
+      }
+    }
+    new_offsets[instr->offset] = lowered.code.size;
+    if (instr->exit_pops > 0)
+      emit_pops(&lowered, instr->exit_pops, line);
+    if (!ir->blocks[instr->block].reachable || instr->emit == EMIT_NONE)
+      continue;
+
+    uint8_t bytes[3 + 3 * UINT8_MAX];
+    int length = instruction_bytes(ir, i, bytes);
+    int target = lox_chunk_jump_target(chunk, instr->offset);
+    if (target != -1 && (bytes[0] == OP_JMP || bytes[0] == OP_JMP_BACK ||
+                         is_conditional_jump(bytes[0]))) {
+      lox_int_array_push(&jumps, lowered.code.size);
+      lox_int_array_push(&jumps, target);
+    }
+    lox_chunk_write_array(&lowered, bytes, length, line);
+    if (instr->pops_after > 0)
+      emit_pops(&lowered, instr->pops_after, line);
+  }
+  new_offsets[size] = lowered.code.size;
+
+  bool valid = true;
+  for (int i = 0; i < jumps.size; i += 2) {
+    int jump = jumps.values[i];
+    int target = new_offsets[jumps.values[i + 1]];
+    int distance = lowered.code.values[jump] == OP_JMP_BACK
+                       ? jump + 3 - target
+                       : target - (jump + 3);
+    if (distance < 0 || distance > UINT16_MAX) {
+      valid = false;
+      break;
+    }
+    lowered.code.values[jump + 1] = (distance >> 8) & 0xff;
+    lowered.code.values[jump + 2] = distance & 0xff;
+  }
+
+  if (valid) {
+    lox_byte_array_free(&chunk->code);
+    lox_int_array_free(&chunk->lines);
+    chunk->code = lowered.code;
+    chunk->lines = lowered.lines;
+    chunk->last_line = lowered.last_line;
+  } else {
+    lox_byte_array_free(&lowered.code);
+    lox_int_array_free(&lowered.lines);
+  }
+
+  lox_int_array_free(&jumps);
+  FREE_ARRAY(int, new_offsets, size + 1);
+  return valid;
+}
+
+static void find_captured(lox_ir *ir) {
+  ir->captured = ALLOC_ARRAY(bool, ir->max_depth);
+  memset(ir->captured, 0, sizeof(bool) * ir->max_depth);
+  for (int i = 0; i < ir->instruction_count; i++) {
+    uint8_t *code = code_of(ir, i);
+    if (code[0] != OP_CLOSURE)
+      continue;
+    int length = lox_chunk_instruction_length(ir->chunk, instruction(ir, i)->offset);
+    // Variables captured by value are never assigned, by the closure or by
+    // anything else.
+    for (int j = 3; j < length; j += 3) {
+      if (code[j] == LOX_CAPTURE_LOCAL &&
+          read_short(&code[j + 1]) < ir->max_depth)
+        ir->captured[read_short(&code[j + 1])] = true;
+    }
+  }
+}
+
+static void find_constants(lox_ir *ir) {
+  lox_value_array *constants = &ir->chunk->constants;
+  ir->constants = ALLOC_ARRAY(int, constants->size);
+  lox_hash_table first;
+  lox_hash_table_init(&first);
+  for (int i = 0; i < constants->size; i++) {
+    lox_value value = constants->values[i];
+    lox_value index;
+    ir->constants[i] = i;
+    if (!lox_hash_table_get(&first, value, &index)) {
+      lox_hash_table_put(&first, value, lox_value_from_number(i));
+      continue;
+    }
+    // 0 and -0 are equal, but don't behave the same.
+    lox_value other = constants->values[(int)lox_value_as_number(index)];
+    if (!lox_value_is_number(value) ||
+        signbit(lox_value_as_number(value)) ==
+            signbit(lox_value_as_number(other)))
+      ir->constants[i] = lox_value_as_number(index);
+  }
+  lox_hash_table_free(&first);
+}
+
+static void find_lines(lox_ir *ir) {
+  lox_chunk *chunk = ir->chunk;
+  int size = chunk->code.size;
+  ir->lines = ALLOC_ARRAY(int, size);
+  int offset = 0;
+  for (int line = 0; line < chunk->lines.size; line++) {
+    for (int i = 0; i < chunk->lines.values[line] && offset < size; i++) {
+      ir->lines[offset++] = line + 1;
+    }
+  }
+  while (offset < size) {
+    ir->lines[offset++] = chunk->lines.size;
+  }
+}
+
+static void ir_free(lox_ir *ir) {
+  int size = ir->code_size;
+  for (int b = 0; b < ir->block_count; b++) {
+    lox_ir_block *block = &ir->blocks[b];
+    lox_int_array_free(&block->predecessors);
+    if (block->entry.slots != NULL) {
+      state_free(ir, &block->entry);
+      state_free(ir, &block->exit);
+      FREE_ARRAY(bool, block->phis, ir->max_depth);
+    }
+    if (block->live_out != NULL)
+      FREE_ARRAY(bool, block->live_out, ir->max_depth);
+  }
+  for (int i = 0; i < ir->loop_count; i++) {
+    lox_int_array_free(&ir->loops[i].globals);
+    lox_int_array_free(&ir->loops[i].lines);
+  }
+  FREE_ARRAY(lox_ir_loop, ir->loops, ir->loop_count);
+  FREE_ARRAY(lox_ir_block, ir->blocks, ir->block_count);
+  FREE_ARRAY(lox_ir_instruction, ir->instructions, ir->instruction_count);
+  FREE_ARRAY(int, ir->instruction_at, size + 1);
+  FREE_ARRAY(int, ir->order, ir->order_count);
+  if (ir->lines != NULL) {
+    FREE_ARRAY(bool, ir->captured, ir->max_depth);
+    FREE_ARRAY(int, ir->constants, ir->chunk->constants.size);
+    FREE_ARRAY(int, ir->lines, size);
+  }
+  FREE_ARRAY(int, ir->table, ir->table_capacity);
+  lox_ir_value_array_free(&ir->values);
+}
+
+void lox_ir_optimize(lox_chunk *chunk, int arity) {
+  lox_ir ir;
+  memset(&ir, 0, sizeof(ir));
+  ir.chunk = chunk;
+  ir.arity = arity;
+  ir.code_size = chunk->code.size;
+  // Never zero, so that the arrays indexed by global aren't empty.
+  ir.global_count = 1;
+  lox_ir_value_array_initialize(&ir.values);
+  if (chunk->code.size == 0)
+    return;
+
+  if (build_blocks(&ir) && compute_depths(&ir)) {
+    order_blocks(&ir);
+    find_captured(&ir);
+    find_constants(&ir);
+    find_lines(&ir);
+    if (is_reducible(&ir) && analyze(&ir)) {
+      // Everything is decided before the bytecode changes.
+      compute_liveness(&ir);
+      rewrite_blocks(&ir);
+      hoist(&ir);
+      lower(&ir);
+    }
+  }
+  ir_free(&ir);
+}
@@ -0,0 +1,1524 @@
+#ifdef LOX_JIT
+
+#include "jit.h"
+#include "chunk.h"
+#include "memory.h"
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+extern lox_vm vm;
+
+// The general purpose registers, numbered like in the instruction encodings.
+typedef enum {
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+} lox_jit_register;
+
+// The low bytes of the first registers, for setcc.
+#define AL RAX
+#define CL RCX
+#define DL RDX
+
+#define XMM0 0
+#define XMM1 1
+#define XMM2 2
+
+// The condition codes of jcc and setcc.
+typedef enum {
+  CC_ALWAYS = -1,
+  CC_B = 0x2,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_L = 0xC,
+} lox_jit_condition;
+
+// The templates keep a few values in callee-saved registers, so that they
+// survive calls to C helpers. The operand stack itself stays in memory.
+//  - STACK_TOP points to the next free slot of the stack, like
+//    vm.stack.values + vm.stack.size.
+//  - SLOTS points to the first slot of the frame.
+//  - FRAME points to the lox_call_frame being run.
+//  - GLOBALS points to vm.globals.values, which can't move while native code
+//    runs since globals are only added by the compiler.
+#define STACK_TOP RBX
+#define SLOTS R12
+#define FRAME R13
+#define GLOBALS R14
+
+#define VALUE_SIZE ((int32_t)sizeof(lox_value))
+#ifdef LOX_NAN_BOXING
+#define VALUE_SHIFT 3
+#define NUMBER_OFFSET 0
+#else
+#define VALUE_SHIFT 4
+#define TYPE_OFFSET ((int32_t)offsetof(lox_value, type))
+#define NUMBER_OFFSET ((int32_t)offsetof(lox_value, as))
+#endif
+_Static_assert(sizeof(lox_value) == 1 << VALUE_SHIFT,
+               "VALUE_SHIFT doesn't match the size of lox_value");
+
+// The displacement of the n-th value from the top of the stack, starting at 1,
+// relative to STACK_TOP.
+#define TOP(n) (-(n) * VALUE_SIZE)
+
+// The arithmetic and logic instructions that take two registers, by opcode.
+#define ALU_ADD 0x01
+#define ALU_OR 0x09
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+
+// The SSE2 instructions used on numbers, by the opcode that follows 0x0F.
+#define SSE_MOVSD_LOAD 0x10
+#define SSE_MOVSD_STORE 0x11
+#define SSE_UCOMISD 0x2E
+#define SSE_XORPD 0x57
+#define SSE_ADDSD 0x58
+#define SSE_MULSD 0x59
+#define SSE_SUBSD 0x5C
+#define SSE_DIVSD 0x5E
+
+typedef uint8_t *(*lox_jit_entry)(lox_value *stack_top, lox_value *slots,
+                                  lox_call_frame *frame, uint8_t *entry);
+
+// The longest trace that is recorded, in instructions.
+#define LOX_JIT_MAX_TRACE_LENGTH 1024
+
+// What is known about the values of a frame and the globals at some point of a
+// trace, which lets the templates skip their guards.
+typedef struct {
+  // Whether each slot of the frame, locals and temporaries alike, holds a
+  // number.
+  bool *numbers;
+  // Where the value of each slot was copied from, as long as both are equal:
+  // the slot of a local, -2 - index for a global, or -1. Once a copy passes a
+  // guard, so does its source.
+  int *sources;
+  // A mask of GLOBAL_DEFINED and GLOBAL_NUMBER for each global.
+  uint8_t *globals;
+} lox_jit_types;
+
+#define GLOBAL_DEFINED 1
+#define GLOBAL_NUMBER 2
+
+typedef struct {
+  lox_object_function *function;
+  lox_chunk *chunk;
+  lox_byte_array code;
+  // The offset in `code` of the template of each instruction, or -1.
+  int *offsets;
+  // The jumps between templates, as pairs of the offset of their 32 bit
+  // displacement in `code` and the bytecode offset of their destination.
+  lox_int_array jumps;
+  // Same as `jumps`, for the jumps that leave the native code to run the
+  // instruction at the given bytecode offset in the interpreter.
+  lox_int_array exits;
+  // The offset of the code that returns to the interpreter.
+  int exit;
+  // When compiling a trace, what is known about the values before the
+  // instruction being emitted, and the size of the stack of the frame there.
+  // NULL when compiling a whole function.
+  lox_jit_types *types;
+  int depth;
+} lox_jit_assembler;
+
+static void emit_byte(lox_jit_assembler *as, uint8_t byte) {
+  lox_byte_array_push(&as->code, byte);
+}
+
+static void emit_int32(lox_jit_assembler *as, int32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emit_byte(as, (uint32_t)value >> (8 * i));
+  }
+}
+
+static void emit_int64(lox_jit_assembler *as, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    emit_byte(as, value >> (8 * i));
+  }
+}
+
+static void patch_int32(lox_jit_assembler *as, int offset, int32_t value) {
+  for (int i = 0; i < 4; i++) {
+    as->code.values[offset + i] = (uint32_t)value >> (8 * i);
+  }
+}
+
+// The REX prefix, which selects 64 bit operands and the upper 8 registers. It
+// is left out when it isn't needed.
+static void emit_rex(lox_jit_assembler *as, bool wide, int reg, int base) {
+  uint8_t rex = 0x40 | wide << 3 | (reg >> 3) << 2 | base >> 3;
+  if (rex != 0x40)
+    emit_byte(as, rex);
+}
+
+// The operand [base + displacement]. We always use a 32 bit displacement,
+// which keeps the encoding simple at the cost of a few bytes.
+static void emit_memory(lox_jit_assembler *as, int reg, int base,
+                        int32_t displacement) {
+  emit_byte(as, 0x80 | (reg & 7) << 3 | (base & 7));
+  // RSP and R12 can only be used as a base through a SIB byte.
+  if ((base & 7) == RSP)
+    emit_byte(as, 0x24);
+  emit_int32(as, displacement);
+}
+
+static void emit_direct(lox_jit_assembler *as, int reg, int rm) {
+  emit_byte(as, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// mov reg, [base + displacement]
+static void emit_load(lox_jit_assembler *as, int reg, int base,
+                      int32_t displacement) {
+  emit_rex(as, true, reg, base);
+  emit_byte(as, 0x8B);
+  emit_memory(as, reg, base, displacement);
+}
+
+// mov [base + displacement], reg
+static void emit_store(lox_jit_assembler *as, int base, int32_t displacement,
+                       int reg) {
+  emit_rex(as, true, reg, base);
+  emit_byte(as, 0x89);
+  emit_memory(as, reg, base, displacement);
+}
+
+// mov dword [base + displacement], reg
+static void emit_store32(lox_jit_assembler *as, int base, int32_t displacement,
+                         int reg) {
+  emit_rex(as, false, reg, base);
+  emit_byte(as, 0x89);
+  emit_memory(as, reg, base, displacement);
+}
+
+// lea reg, [base + displacement]
+static void emit_lea(lox_jit_assembler *as, int reg, int base,
+                     int32_t displacement) {
+  emit_rex(as, true, reg, base);
+  emit_byte(as, 0x8D);
+  emit_memory(as, reg, base, displacement);
+}
+
+// Adds an immediate to a register. This is done with lea, which unlike add
+// leaves the flags alone, so that the stack can be popped between a comparison
+// and the jump that depends on it.
+static void emit_add_immediate(lox_jit_assembler *as, int reg,
+                               int32_t immediate) {
+  if (immediate != 0)
+    emit_lea(as, reg, reg, immediate);
+}
+
+// mov reg, immediate
+static void emit_mov_immediate(lox_jit_assembler *as, int reg,
+                               uint64_t immediate) {
+  emit_rex(as, true, 0, reg);
+  emit_byte(as, 0xB8 + (reg & 7));
+  emit_int64(as, immediate);
+}
+
+// mov dst, src
+static void emit_mov(lox_jit_assembler *as, int dst, int src) {
+  emit_rex(as, true, src, dst);
+  emit_byte(as, 0x89);
+  emit_direct(as, src, dst);
+}
+
+// <op> dst, src, with one of the ALU_ opcodes.
+static void emit_alu(lox_jit_assembler *as, uint8_t op, int dst, int src) {
+  emit_rex(as, true, src, dst);
+  emit_byte(as, op);
+  emit_direct(as, src, dst);
+}
+
+#ifndef LOX_NAN_BOXING
+// The type tags of tagged unions are compared and stored with these, which
+// NaN-boxed values don't have.
+
+// cmp dword [base + displacement], immediate
+static void emit_cmp_immediate32(lox_jit_assembler *as, int base,
+                                 int32_t displacement, int32_t immediate) {
+  emit_rex(as, false, 0, base);
+  emit_byte(as, 0x81);
+  emit_memory(as, 7, base, displacement);
+  emit_int32(as, immediate);
+}
+
+// mov dword [base + displacement], immediate
+static void emit_store_immediate32(lox_jit_assembler *as, int base,
+                                   int32_t displacement, int32_t immediate) {
+  emit_rex(as, false, 0, base);
+  emit_byte(as, 0xC7);
+  emit_memory(as, 0, base, displacement);
+  emit_int32(as, immediate);
+}
+#endif
+
+// movsd, ucomisd and friends between an xmm register and memory.
+static void emit_sse_memory(lox_jit_assembler *as, uint8_t prefix, uint8_t op,
+                            int xmm, int base, int32_t displacement) {
+  emit_byte(as, prefix);
+  emit_rex(as, false, xmm, base);
+  emit_byte(as, 0x0F);
+  emit_byte(as, op);
+  emit_memory(as, xmm, base, displacement);
+}
+
+// Same as emit_sse_memory, between two xmm registers.
+static void emit_sse(lox_jit_assembler *as, uint8_t prefix, uint8_t op,
+                     int dst, int src) {
+  emit_byte(as, prefix);
+  emit_byte(as, 0x0F);
+  emit_byte(as, op);
+  emit_direct(as, dst, src);
+}
+
+// setcc reg, for AL, CL and DL.
+static void emit_set(lox_jit_assembler *as, lox_jit_condition condition,
+                     int reg) {
+  emit_byte(as, 0x0F);
+  emit_byte(as, 0x90 | condition);
+  emit_direct(as, 0, reg);
+}
+
+// test al, al
+static void emit_test_al(lox_jit_assembler *as) {
+  emit_byte(as, 0x84);
+  emit_direct(as, AL, AL);
+}
+
+// Calls a C function. The arguments are in rdi, rsi and rdx, and the stack is
+// already aligned by the prologue.
+static void emit_call(lox_jit_assembler *as, void *function) {
+  emit_mov_immediate(as, RAX, (uint64_t)(uintptr_t)function);
+  emit_byte(as, 0xFF);
+  emit_direct(as, 2, RAX);
+}
+
+// A jump with a 32 bit displacement, which is recorded into `fixups` along
+// with the bytecode offset it goes to, so that it can be patched once every
+// template has been emitted.
+static void emit_jump(lox_jit_assembler *as, lox_int_array *fixups,
+                      lox_jit_condition condition, int target) {
+  if (condition == CC_ALWAYS) {
+    emit_byte(as, 0xE9);
+  } else {
+    emit_byte(as, 0x0F);
+    emit_byte(as, 0x80 | condition);
+  }
+  lox_int_array_push(fixups, as->code.size);
+  lox_int_array_push(fixups, target);
+  emit_int32(as, 0);
+}
+
+// Jumps to the template of the instruction at `target`.
+static void emit_jump_to(lox_jit_assembler *as, lox_jit_condition condition,
+                         int target) {
+  emit_jump(as, &as->jumps, condition, target);
+}
+
+// Leaves the native code, so that the interpreter runs the instruction at
+// `offset`.
+static void emit_exit(lox_jit_assembler *as, lox_jit_condition condition,
+                      int offset) {
+  emit_jump(as, &as->exits, condition, offset);
+}
+
+static void emit_copy_value(lox_jit_assembler *as, int dst,
+                            int32_t dst_displacement, int src,
+                            int32_t src_displacement) {
+  for (int i = 0; i < VALUE_SIZE; i += 8) {
+    emit_load(as, RAX, src, src_displacement + i);
+    emit_store(as, dst, dst_displacement + i, RAX);
+  }
+}
+
+static void emit_set_value(lox_jit_assembler *as, int base,
+                           int32_t displacement, lox_value value) {
+  uint64_t words[sizeof(lox_value) / 8];
+  memcpy(words, &value, sizeof(lox_value));
+  for (int i = 0; i < VALUE_SIZE / 8; i++) {
+    emit_mov_immediate(as, RAX, words[i]);
+    emit_store(as, base, displacement + 8 * i, RAX);
+  }
+}
+
+// Pushes the value at [base + displacement].
+static void emit_push_value(lox_jit_assembler *as, int base,
+                            int32_t displacement) {
+  emit_copy_value(as, STACK_TOP, 0, base, displacement);
+  emit_add_immediate(as, STACK_TOP, VALUE_SIZE);
+}
+
+// Leaves the native code at `offset` if the value at [base + displacement]
+// isn't a number.
+static void emit_guard_number(lox_jit_assembler *as, int base,
+                              int32_t displacement, int offset) {
+#ifdef LOX_NAN_BOXING
+  emit_load(as, RAX, base, displacement);
+  emit_mov_immediate(as, RCX, LOX_VALUE_QNAN);
+  emit_alu(as, ALU_AND, RAX, RCX);
+  emit_alu(as, ALU_CMP, RAX, RCX);
+  emit_exit(as, CC_E, offset);
+#else
+  emit_cmp_immediate32(as, base, displacement + TYPE_OFFSET, VAL_NUMBER);
+  emit_exit(as, CC_NE, offset);
+#endif
+}
+
+// Same as emit_guard_number, for a value that is VAL_EMPTY.
+static void emit_guard_not_empty(lox_jit_assembler *as, int base,
+                                 int32_t displacement, int offset) {
+#ifdef LOX_NAN_BOXING
+  emit_load(as, RAX, base, displacement);
+  emit_mov_immediate(as, RCX, LOX_VALUE_EMPTY_BITS);
+  emit_alu(as, ALU_CMP, RAX, RCX);
+#else
+  emit_cmp_immediate32(as, base, displacement + TYPE_OFFSET, VAL_EMPTY);
+#endif
+  emit_exit(as, CC_E, offset);
+}
+
+static bool is_known_number(lox_jit_assembler *as, int slot) {
+  return as->types != NULL && as->types->numbers[slot];
+}
+
+static bool is_known_global(lox_jit_assembler *as, int index) {
+  return as->types != NULL && (as->types->globals[index] & GLOBAL_DEFINED);
+}
+
+// Leaves the native code at `offset` unless the n-th value from the top of the
+// stack is a number. In a trace, values that are known to be numbers aren't
+// checked again, and the value is known to be a number from then on.
+static void emit_guard_operand(lox_jit_assembler *as, int n, int offset) {
+  int slot = as->depth - n;
+  if (is_known_number(as, slot))
+    return;
+  emit_guard_number(as, STACK_TOP, TOP(n), offset);
+  if (as->types == NULL)
+    return;
+
+  as->types->numbers[slot] = true;
+  int source = as->types->sources[slot];
+  if (source >= 0) {
+    as->types->numbers[source] = true;
+  } else if (source <= -2) {
+    as->types->globals[-2 - source] |= GLOBAL_NUMBER;
+  }
+}
+
+// Loads the numbers at the top of the stack into xmm0 and xmm1, leaving the
+// native code at `offset` if either of them isn't a number.
+static void emit_load_operands(lox_jit_assembler *as, int offset) {
+  emit_guard_operand(as, 2, offset);
+  emit_guard_operand(as, 1, offset);
+  emit_sse_memory(as, 0xF2, SSE_MOVSD_LOAD, XMM0, STACK_TOP,
+                  TOP(2) + NUMBER_OFFSET);
+  emit_sse_memory(as, 0xF2, SSE_MOVSD_LOAD, XMM1, STACK_TOP,
+                  TOP(1) + NUMBER_OFFSET);
+}
+
+// Replaces the operands of a binary instruction by the number in xmm0. The
+// value the number replaces is already a number.
+static void emit_binary_number_result(lox_jit_assembler *as) {
+  emit_sse_memory(as, 0xF2, SSE_MOVSD_STORE, XMM0, STACK_TOP,
+                  TOP(2) + NUMBER_OFFSET);
+  emit_add_immediate(as, STACK_TOP, -VALUE_SIZE);
+}
+
+// Stores the boolean in al into [base + displacement].
+static void emit_store_bool(lox_jit_assembler *as, int base,
+                            int32_t displacement) {
+  // movzx eax, al
+  emit_byte(as, 0x0F);
+  emit_byte(as, 0xB6);
+  emit_direct(as, RAX, AL);
+#ifdef LOX_NAN_BOXING
+  // true and false only differ by their lowest two bits.
+  emit_alu(as, ALU_ADD, RAX, RAX);
+  emit_mov_immediate(as, RCX, LOX_VALUE_FALSE_BITS);
+  emit_alu(as, ALU_SUB, RCX, RAX);
+  emit_store(as, base, displacement, RCX);
+#else
+  emit_store_immediate32(as, base, displacement + TYPE_OFFSET, VAL_BOOL);
+  emit_store(as, base, displacement + NUMBER_OFFSET, RAX);
+#endif
+}
+
+// Sets al to whether the value at [base + displacement] is falsey.
+static void emit_falsey(lox_jit_assembler *as, int base,
+                        int32_t displacement) {
+#ifdef LOX_NAN_BOXING
+  emit_load(as, RAX, base, displacement);
+  emit_mov_immediate(as, RCX, 1);
+  emit_alu(as, ALU_OR, RAX, RCX);
+  emit_mov_immediate(as, RCX, LOX_VALUE_FALSE_BITS);
+  emit_alu(as, ALU_CMP, RAX, RCX);
+  emit_set(as, CC_E, AL);
+#else
+  emit_cmp_immediate32(as, base, displacement + TYPE_OFFSET, VAL_NIL);
+  emit_set(as, CC_E, CL);
+  emit_cmp_immediate32(as, base, displacement + TYPE_OFFSET, VAL_BOOL);
+  emit_set(as, CC_E, DL);
+  // cmp byte [base + displacement], 0
+  emit_rex(as, false, 0, base);
+  emit_byte(as, 0x80);
+  emit_memory(as, 7, base, displacement + NUMBER_OFFSET);
+  emit_byte(as, 0);
+  emit_set(as, CC_E, AL);
+  // and al, dl; or al, cl
+  emit_byte(as, 0x20);
+  emit_direct(as, DL, AL);
+  emit_byte(as, 0x08);
+  emit_direct(as, CL, AL);
+#endif
+}
+
+// Compares the numbers at the top of the stack. The condition that is true when
+// the comparison holds is returned, and the operands are swapped for < and <=
+// so that comparisons with NaN are false, like in C.
+static lox_jit_condition emit_compare(lox_jit_assembler *as, lox_op_code op,
+                                      int offset) {
+  emit_load_operands(as, offset);
+  switch (op) {
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+  case OP_GREATER_JMP_FALSE:
+    emit_sse(as, 0x66, SSE_UCOMISD, XMM0, XMM1);
+    return CC_A;
+  case OP_GREATEREQ:
+  case OP_GREATEREQ_NUM:
+  case OP_GREATEREQ_JMP_FALSE:
+    emit_sse(as, 0x66, SSE_UCOMISD, XMM0, XMM1);
+    return CC_AE;
+  case OP_LESS:
+  case OP_LESS_NUM:
+  case OP_LESS_JMP_FALSE:
+    emit_sse(as, 0x66, SSE_UCOMISD, XMM1, XMM0);
+    return CC_A;
+  default:
+    emit_sse(as, 0x66, SSE_UCOMISD, XMM1, XMM0);
+    return CC_AE;
+  }
+}
+
+// The C functions called by the templates of instructions that are too complex
+// to be worth generating inline.
+static bool jit_values_equal(lox_value *lhs) {
+  return lox_values_equal(lhs[0], lhs[1]);
+}
+
+static void jit_print(lox_value *value) {
+  lox_print_value(*value);
+  printf("\n");
+}
+
+// Returns the template of the case the switch instruction at `offset` jumps to
+// for `value`.
+static uint8_t *jit_switch(lox_value *value, lox_object_function *function,
+                           int offset) {
+  int target = lox_chunk_switch_target(&function->chunk, offset, *value);
+  return function->jit->entries[target];
+}
+
+// Reads a field of the instance at `src` into `dst`, if the inline cache knows
+// where it is. Anything else, including methods, is left to the interpreter.
+static bool jit_get_field(lox_value *dst, lox_value *src,
+                          lox_inline_cache *cache) {
+  if (!lox_value_is_instance(*src))
+    return false;
+  lox_object_instance *instance =
+      (lox_object_instance *)lox_value_as_object(*src);
+  lox_inline_cache_entry *entry = lox_inline_cache_find(cache, instance);
+  if (entry == NULL || entry->slot == -1)
+    return false;
+  *dst = instance->slots[entry->slot];
+  return true;
+}
+
+// Assigns the value at operands[1] to a field of the instance at operands[0],
+// if the field already exists and the inline cache knows where it is.
+static bool jit_set_field(lox_value *operands, lox_inline_cache *cache) {
+  if (!lox_value_is_instance(operands[0]))
+    return false;
+  lox_object_instance *instance =
+      (lox_object_instance *)lox_value_as_object(operands[0]);
+  lox_inline_cache_entry *entry = lox_inline_cache_find(cache, instance);
+  if (entry == NULL || entry->as.transition != NULL)
+    return false;
+  instance->slots[entry->slot] = operands[1];
+  lox_gc_write_barrier((lox_object *)instance, operands[1]);
+  operands[0] = operands[1];
+  return true;
+}
+
+// The write barrier of OP_SET_UPVALUE, for the value at `value`.
+static void jit_write_barrier(lox_object *upvalue, lox_value *value) {
+  lox_gc_write_barrier(upvalue, *value);
+}
+
+static lox_jit_loop *find_loop(lox_object_function *function, int header);
+
+static uint16_t read_short(lox_chunk *chunk, int offset) {
+  return chunk->code.values[offset] << 8 | chunk->code.values[offset + 1];
+}
+
+static void emit_get_global(lox_jit_assembler *as, int index, int offset) {
+  if (!is_known_global(as, index))
+    emit_guard_not_empty(as, GLOBALS, index * VALUE_SIZE, offset);
+  emit_push_value(as, GLOBALS, index * VALUE_SIZE);
+}
+
+static void emit_set_global(lox_jit_assembler *as, int index, int offset,
+                            bool define) {
+  if (!define && !is_known_global(as, index))
+    emit_guard_not_empty(as, GLOBALS, index * VALUE_SIZE, offset);
+  emit_copy_value(as, GLOBALS, index * VALUE_SIZE, STACK_TOP, TOP(1));
+  if (define)
+    emit_add_immediate(as, STACK_TOP, -VALUE_SIZE);
+}
+
+// Loads the address of the upvalue `index` of the running closure into rdx.
+static void emit_upvalue_location(lox_jit_assembler *as, int index) {
+  emit_load(as, RDX, FRAME, offsetof(lox_call_frame, closure));
+  emit_load(as, RDX, RDX,
+            offsetof(lox_object_closure, upvalues) +
+                index * (int32_t)sizeof(lox_object_upvalue *));
+  emit_load(as, RDX, RDX, offsetof(lox_object_upvalue, location));
+}
+
+static void emit_get_property(lox_jit_assembler *as, int32_t dst, int src,
+                              int32_t src_displacement, int cache,
+                              int offset) {
+  emit_lea(as, RDI, STACK_TOP, dst);
+  emit_lea(as, RSI, src, src_displacement);
+  emit_mov_immediate(as, RDX,
+                     (uint64_t)(uintptr_t)&as->chunk->caches.values[cache]);
+  emit_call(as, (void *)jit_get_field);
+  emit_test_al(as);
+  emit_exit(as, CC_E, offset);
+}
+
+static void emit_pop_branch_operands(lox_jit_assembler *as, int offset) {
+  lox_op_code op = as->chunk->code.values[offset];
+  if (op != OP_JMP_FALSE && op != OP_JMP_TRUE)
+    emit_add_immediate(as, STACK_TOP, -2 * VALUE_SIZE);
+}
+
+// Emits the jump of the conditional branch at `offset`, taken when
+// `condition` holds, and pops what the branch pops. The flags are left alone
+// by the pops, see emit_add_immediate.
+static void emit_branch(lox_jit_assembler *as, int offset, int next,
+                        lox_jit_condition condition) {
+  int target = lox_chunk_jump_target(as->chunk, offset);
+  if (as->types == NULL) {
+    emit_pop_branch_operands(as, offset);
+    emit_jump_to(as, condition, target);
+    return;
+  }
+
+  // The interpreter runs the branch again when it goes the other way, so the
+  // operands must still be on the stack.
+  emit_exit(as, next == target ? condition ^ 1 : condition, offset);
+  emit_pop_branch_operands(as, offset);
+}
+
+// Emits the template of the instruction at `offset`. Instructions without a
+// template leave the native code, so that the interpreter runs them.
+//
+// In a trace, `next` is the offset of the instruction that was recorded after
+// this one. Branches leave the trace when they don't go the same way as when
+// they were recorded, and jumps don't need any code.
+static void emit_instruction(lox_jit_assembler *as, int offset, int next) {
+  lox_chunk *chunk = as->chunk;
+  uint8_t *code = chunk->code.values;
+  lox_op_code op = code[offset];
+  switch (op) {
+  case OP_CONSTANT:
+    emit_set_value(as, STACK_TOP, 0, chunk->constants.values[code[offset + 1]]);
+    emit_add_immediate(as, STACK_TOP, VALUE_SIZE);
+    break;
+  case OP_CONSTANT_LONG:
+    emit_set_value(as, STACK_TOP, 0,
+                   chunk->constants.values[read_short(chunk, offset + 1)]);
+    emit_add_immediate(as, STACK_TOP, VALUE_SIZE);
+    break;
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+    emit_set_value(as, STACK_TOP, 0,
+                   op == OP_NIL ? lox_value_from_nil()
+                                : lox_value_from_bool(op == OP_TRUE));
+    emit_add_immediate(as, STACK_TOP, VALUE_SIZE);
+    break;
+  case OP_POP:
+    emit_add_immediate(as, STACK_TOP, -VALUE_SIZE);
+    break;
+  case OP_POPN:
+    emit_add_immediate(as, STACK_TOP,
+                       -VALUE_SIZE * read_short(chunk, offset + 1));
+    break;
+  case OP_DUP:
+    emit_push_value(as, STACK_TOP, TOP(1));
+    break;
+  case OP_GET_LOCAL:
+    emit_push_value(as, SLOTS, code[offset + 1] * VALUE_SIZE);
+    break;
+  case OP_SET_LOCAL:
+    if (is_known_number(as, code[offset + 1]) &&
+        is_known_number(as, as->depth - 1)) {
+      // The local is already tagged as a number, so only the number itself
+      // has to be copied.
+      emit_load(as, RAX, STACK_TOP, TOP(1) + NUMBER_OFFSET);
+      emit_store(as, SLOTS, code[offset + 1] * VALUE_SIZE + NUMBER_OFFSET, RAX);
+    } else {
+      emit_copy_value(as, SLOTS, code[offset + 1] * VALUE_SIZE, STACK_TOP,
+                      TOP(1));
+    }
+    break;
+  case OP_GET_LOCAL_GET_LOCAL:
+    emit_push_value(as, SLOTS, code[offset + 1] * VALUE_SIZE);
+    emit_push_value(as, SLOTS, code[offset + 2] * VALUE_SIZE);
+    break;
+  case OP_GET_LOCAL_CONSTANT:
+    emit_push_value(as, SLOTS, code[offset + 1] * VALUE_SIZE);
+    emit_set_value(as, STACK_TOP, 0, chunk->constants.values[code[offset + 2]]);
+    emit_add_immediate(as, STACK_TOP, VALUE_SIZE);
+    break;
+  case OP_GET_GLOBAL:
+    emit_get_global(as, code[offset + 1], offset);
+    break;
+  case OP_GET_GLOBAL_LONG:
+    emit_get_global(as, read_short(chunk, offset + 1), offset);
+    break;
+  case OP_SET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+    emit_set_global(as, code[offset + 1], offset, op == OP_DEFINE_GLOBAL);
+    break;
+  case OP_SET_GLOBAL_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+    emit_set_global(as, read_short(chunk, offset + 1), offset,
+                    op == OP_DEFINE_GLOBAL_LONG);
+    break;
+  case OP_GET_UPVALUE:
+    emit_upvalue_location(as, code[offset + 1]);
+    emit_push_value(as, RDX, 0);
+    break;
+  case OP_SET_UPVALUE:
+    emit_upvalue_location(as, code[offset + 1]);
+    emit_copy_value(as, RDX, 0, STACK_TOP, TOP(1));
+    emit_load(as, RDI, FRAME, offsetof(lox_call_frame, closure));
+    emit_load(as, RDI, RDI,
+              offsetof(lox_object_closure, upvalues) +
+                  code[offset + 1] * (int32_t)sizeof(lox_object_upvalue *));
+    emit_lea(as, RSI, STACK_TOP, TOP(1));
+    emit_call(as, (void *)jit_write_barrier);
+    break;
+  case OP_GET_CAPTURE:
+    // The captured values follow the upvalues of the closure, whose number
+    // is known from the function.
+    emit_load(as, RDX, FRAME, offsetof(lox_call_frame, closure));
+    emit_push_value(as, RDX,
+                    offsetof(lox_object_closure, upvalues) +
+                        as->function->upvalue_count *
+                            (int32_t)sizeof(lox_object_upvalue *) +
+                        code[offset + 1] * VALUE_SIZE);
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM: {
+    emit_load_operands(as, offset);
+    uint8_t instruction = op == OP_ADD || op == OP_ADD_NUM ? SSE_ADDSD
+                          : op == OP_SUBTRACT || op == OP_SUBTRACT_NUM
+                              ? SSE_SUBSD
+                              : SSE_MULSD;
+    emit_sse(as, 0xF2, instruction, XMM0, XMM1);
+    emit_binary_number_result(as);
+    break;
+  }
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+    emit_load_operands(as, offset);
+    // The interpreter reports divisions by zero.
+    emit_sse(as, 0x66, SSE_XORPD, XMM2, XMM2);
+    emit_sse(as, 0x66, SSE_UCOMISD, XMM1, XMM2);
+    emit_exit(as, CC_E, offset);
+    emit_sse(as, 0xF2, SSE_DIVSD, XMM0, XMM1);
+    emit_binary_number_result(as);
+    break;
+  case OP_MODULO:
+  case OP_MODULO_NUM:
+    emit_load_operands(as, offset);
+    emit_call(as, (void *)fmod);
+    emit_binary_number_result(as);
+    break;
+  case OP_NEGATE:
+    emit_guard_operand(as, 1, offset);
+    emit_load(as, RAX, STACK_TOP, TOP(1) + NUMBER_OFFSET);
+    emit_mov_immediate(as, RCX, (uint64_t)1 << 63);
+    emit_alu(as, ALU_XOR, RAX, RCX);
+    emit_store(as, STACK_TOP, TOP(1) + NUMBER_OFFSET, RAX);
+    break;
+  case OP_NOT:
+    emit_falsey(as, STACK_TOP, TOP(1));
+    emit_store_bool(as, STACK_TOP, TOP(1));
+    break;
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+  case OP_GREATEREQ:
+  case OP_GREATEREQ_NUM:
+  case OP_LESS:
+  case OP_LESS_NUM:
+  case OP_LESSEQ:
+  case OP_LESSEQ_NUM:
+    emit_set(as, emit_compare(as, op, offset), AL);
+    emit_store_bool(as, STACK_TOP, TOP(2));
+    emit_add_immediate(as, STACK_TOP, -VALUE_SIZE);
+    break;
+  case OP_GREATER_JMP_FALSE:
+  case OP_GREATEREQ_JMP_FALSE:
+  case OP_LESS_JMP_FALSE:
+  case OP_LESSEQ_JMP_FALSE: {
+    lox_jit_condition condition = emit_compare(as, op, offset);
+    // The inverse of a condition code only differs by its lowest bit.
+    emit_branch(as, offset, next, condition ^ 1);
+    break;
+  }
+  case OP_EQ:
+  case OP_NEQ:
+    emit_lea(as, RDI, STACK_TOP, TOP(2));
+    emit_call(as, (void *)jit_values_equal);
+    if (op == OP_NEQ) {
+      // xor al, 1
+      emit_byte(as, 0x34);
+      emit_byte(as, 1);
+    }
+    emit_store_bool(as, STACK_TOP, TOP(2));
+    emit_add_immediate(as, STACK_TOP, -VALUE_SIZE);
+    break;
+  case OP_EQ_JMP_FALSE:
+  case OP_NEQ_JMP_FALSE:
+    emit_lea(as, RDI, STACK_TOP, TOP(2));
+    emit_call(as, (void *)jit_values_equal);
+    emit_test_al(as);
+    emit_branch(as, offset, next, op == OP_EQ_JMP_FALSE ? CC_E : CC_NE);
+    break;
+  case OP_JMP_FALSE:
+  case OP_JMP_TRUE:
+    emit_falsey(as, STACK_TOP, TOP(1));
+    emit_test_al(as);
+    emit_branch(as, offset, next, op == OP_JMP_FALSE ? CC_NE : CC_E);
+    break;
+  case OP_JMP:
+    if (as->types == NULL)
+      emit_jump_to(as, CC_ALWAYS, lox_chunk_jump_target(chunk, offset));
+    break;
+  case OP_JMP_BACK: {
+    // A trace only follows the jumps, like the one from the increment of a for
+    // loop back to its condition.
+    if (as->types != NULL)
+      break;
+    // The back edge counts down the iterations of the loop, and leaves to the
+    // interpreter once the loop is hot, so that it can be traced. See
+    // lox_jit_jump_back.
+    lox_jit_loop *loop =
+        find_loop(as->function, lox_chunk_jump_target(chunk, offset));
+    emit_mov_immediate(as, RAX, (uint64_t)(uintptr_t)&loop->counter);
+    // sub dword [rax], 1
+    emit_byte(as, 0x83);
+    emit_memory(as, 5, RAX, 0);
+    emit_byte(as, 1);
+    emit_exit(as, CC_L, offset);
+    emit_jump_to(as, CC_ALWAYS, loop->header);
+    break;
+  }
+  case OP_PRINT:
+    emit_lea(as, RDI, STACK_TOP, TOP(1));
+    emit_call(as, (void *)jit_print);
+    emit_add_immediate(as, STACK_TOP, -VALUE_SIZE);
+    break;
+  case OP_GET_PROPERTY:
+    emit_get_property(as, TOP(1), STACK_TOP, TOP(1),
+                      read_short(chunk, offset + 3), offset);
+    break;
+  case OP_GET_LOCAL_GET_PROPERTY:
+    emit_get_property(as, 0, SLOTS, code[offset + 1] * VALUE_SIZE,
+                      read_short(chunk, offset + 4), offset);
+    emit_add_immediate(as, STACK_TOP, VALUE_SIZE);
+    break;
+  case OP_SET_PROPERTY:
+    emit_lea(as, RDI, STACK_TOP, TOP(2));
+    emit_mov_immediate(as, RSI,
+                       (uint64_t)(uintptr_t)&chunk->caches
+                           .values[read_short(chunk, offset + 3)]);
+    emit_call(as, (void *)jit_set_field);
+    emit_test_al(as);
+    emit_exit(as, CC_E, offset);
+    emit_add_immediate(as, STACK_TOP, -VALUE_SIZE);
+    break;
+  case OP_SWITCH_TABLE:
+  case OP_SWITCH_HASH:
+    if (as->types != NULL) {
+      emit_exit(as, CC_ALWAYS, offset);
+      break;
+    }
+    // The case is only known once the value is, so we jump to its template
+    // through the entries of the function.
+    emit_lea(as, RDI, STACK_TOP, TOP(1));
+    emit_mov_immediate(as, RSI, (uint64_t)(uintptr_t)as->function);
+    emit_mov_immediate(as, RDX, offset);
+    emit_call(as, (void *)jit_switch);
+    // jmp rax
+    emit_byte(as, 0xFF);
+    emit_direct(as, 4, RAX);
+    break;
+  default:
+    emit_exit(as, CC_ALWAYS, offset);
+    break;
+  }
+}
+
+// Emits the code shared by every template: the entry point, which saves the
+// callee-saved registers and jumps to the template of the first instruction
+// to run, and the exit, which writes the stack size back and returns the
+// address of the instruction the interpreter resumes at, found in rax.
+static void emit_entry_and_exit(lox_jit_assembler *as) {
+  // push rbx; push r12; push r13; push r14; push r15. This also aligns the
+  // stack on 16 bytes.
+  emit_byte(as, 0x53);
+  for (int reg = R12; reg <= R15; reg++) {
+    emit_byte(as, 0x41);
+    emit_byte(as, 0x50 + (reg & 7));
+  }
+  emit_mov(as, STACK_TOP, RDI);
+  emit_mov(as, SLOTS, RSI);
+  emit_mov(as, FRAME, RDX);
+  emit_mov_immediate(as, GLOBALS, (uint64_t)(uintptr_t)&vm.globals.values);
+  emit_load(as, GLOBALS, GLOBALS, 0);
+  // jmp rcx
+  emit_byte(as, 0xFF);
+  emit_direct(as, 4, RCX);
+
+  as->exit = as->code.size;
+  emit_mov_immediate(as, RCX, (uint64_t)(uintptr_t)&vm.stack.values);
+  emit_load(as, RCX, RCX, 0);
+  emit_mov(as, RDX, STACK_TOP);
+  emit_alu(as, ALU_SUB, RDX, RCX);
+  // shr rdx, VALUE_SHIFT
+  emit_rex(as, true, 0, RDX);
+  emit_byte(as, 0xC1);
+  emit_direct(as, 5, RDX);
+  emit_byte(as, VALUE_SHIFT);
+  emit_mov_immediate(as, RCX, (uint64_t)(uintptr_t)&vm.stack.size);
+  emit_store32(as, RCX, 0, RDX);
+  // pop r15; pop r14; pop r13; pop r12; pop rbx; ret
+  for (int reg = R15; reg >= R12; reg--) {
+    emit_byte(as, 0x41);
+    emit_byte(as, 0x58 + (reg & 7));
+  }
+  emit_byte(as, 0x5B);
+  emit_byte(as, 0xC3);
+}
+
+// Patches the jumps between templates, and creates a stub for each instruction
+// that can be run by the interpreter, which passes its address to the exit.
+static bool link_templates(lox_jit_assembler *as) {
+  int size = as->chunk->code.size;
+  for (int i = 0; i < as->jumps.size; i += 2) {
+    int jump = as->jumps.values[i];
+    int target = as->jumps.values[i + 1];
+    if (target < 0 || target >= size || as->offsets[target] == -1)
+      return false;
+    patch_int32(as, jump, as->offsets[target] - (jump + 4));
+  }
+
+  int *stubs = ALLOC_ARRAY(int, size);
+  for (int i = 0; i < size; i++) {
+    stubs[i] = -1;
+  }
+  for (int i = 0; i < as->exits.size; i += 2) {
+    int jump = as->exits.values[i];
+    int offset = as->exits.values[i + 1];
+    if (stubs[offset] == -1) {
+      stubs[offset] = as->code.size;
+      emit_mov_immediate(as, RAX,
+                         (uint64_t)(uintptr_t)&as->chunk->code.values[offset]);
+      emit_byte(as, 0xE9);
+      emit_int32(as, as->exit - (as->code.size + 4));
+    }
+    patch_int32(as, jump, stubs[offset] - (jump + 4));
+  }
+  FREE_ARRAY(int, stubs, size);
+  return true;
+}
+
+static void assembler_init(lox_jit_assembler *as,
+                           lox_object_function *function) {
+  as->function = function;
+  as->chunk = &function->chunk;
+  lox_byte_array_initialize(&as->code);
+  lox_int_array_initialize(&as->jumps);
+  lox_int_array_initialize(&as->exits);
+  as->offsets = ALLOC_ARRAY(int, as->chunk->code.size);
+  for (int i = 0; i < as->chunk->code.size; i++) {
+    as->offsets[i] = -1;
+  }
+  as->exit = -1;
+  as->types = NULL;
+  as->depth = 0;
+}
+
+static void assembler_free(lox_jit_assembler *as) {
+  FREE_ARRAY(int, as->offsets, as->chunk->code.size);
+  lox_int_array_free(&as->exits);
+  lox_int_array_free(&as->jumps);
+  lox_byte_array_free(&as->code);
+}
+
+// Links the code of an assembler and copies it into executable memory, whose
+// size is stored into `size`. Returns NULL on failure.
+static uint8_t *assemble(lox_jit_assembler *as, size_t *size) {
+  if (!link_templates(as))
+    return NULL;
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  *size = (as->code.size + page_size - 1) / page_size * page_size;
+  uint8_t *code = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED)
+    return NULL;
+  memcpy(code, as->code.values, as->code.size);
+  if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, *size);
+    return NULL;
+  }
+  return code;
+}
+
+bool lox_jit_compile(lox_object_function *function) {
+  lox_chunk *chunk = &function->chunk;
+  int size = chunk->code.size;
+  lox_jit_assembler as;
+  assembler_init(&as, function);
+
+  emit_entry_and_exit(&as);
+  for (int offset = 0; offset < size;
+       offset += lox_chunk_instruction_length(chunk, offset)) {
+    as.offsets[offset] = as.code.size;
+    emit_instruction(&as, offset, -1);
+  }
+
+  size_t code_size;
+  uint8_t *code = assemble(&as, &code_size);
+  if (code != NULL) {
+    lox_jit_code *jit = ALLOC_TYPE(lox_jit_code);
+    jit->code = code;
+    jit->size = code_size;
+    jit->entries = ALLOC_ARRAY(uint8_t *, size);
+    jit->entry_count = size;
+    for (int i = 0; i < size; i++) {
+      jit->entries[i] = as.offsets[i] == -1 ? NULL : code + as.offsets[i];
+    }
+    function->jit = jit;
+  }
+
+  assembler_free(&as);
+  return code != NULL;
+}
+
+void lox_jit_free(lox_object_function *function) {
+  lox_jit_code *jit = function->jit;
+  if (jit != NULL) {
+    munmap(jit->code, jit->size);
+    FREE_ARRAY(uint8_t *, jit->entries, jit->entry_count);
+    FREE(lox_jit_code, jit);
+  }
+  for (int i = 0; i < function->loop_count; i++) {
+    if (function->loops[i].trace != NULL)
+      munmap(function->loops[i].trace, function->loops[i].trace_size);
+  }
+  FREE_ARRAY(lox_jit_loop, function->loops, function->loop_count);
+}
+
+uint8_t *lox_jit_run(lox_call_frame *frame, uint8_t *ip) {
+  lox_object_function *function = frame->closure->function;
+  lox_jit_code *jit = function->jit;
+  lox_jit_entry entry = (lox_jit_entry)(void *)jit->code;
+  uint8_t *exit =
+      entry(vm.stack.values + vm.stack.size,
+            vm.stack.values + frame->slots_offset, frame,
+            jit->entries[ip - function->chunk.code.values]);
+  // Once the interpreter has run the instruction, we can go back to native
+  // code.
+  frame->jit_entry =
+      exit + lox_chunk_instruction_length(&function->chunk,
+                                          exit - function->chunk.code.values);
+  return exit;
+}
+
+// Returns the loop of a function whose header is at the given offset. The
+// loops of a function are found the first time one of them is needed, so that
+// their addresses don't change once native code refers to them.
+static lox_jit_loop *find_loop(lox_object_function *function, int header) {
+  lox_chunk *chunk = &function->chunk;
+  if (function->loops == NULL) {
+    lox_int_array headers;
+    lox_int_array_initialize(&headers);
+    for (int offset = 0; offset < chunk->code.size;
+         offset += lox_chunk_instruction_length(chunk, offset)) {
+      if (chunk->code.values[offset] != OP_JMP_BACK)
+        continue;
+      int target = lox_chunk_jump_target(chunk, offset);
+      bool found = false;
+      for (int i = 0; i < headers.size && !found; i++) {
+        found = headers.values[i] == target;
+      }
+      if (!found)
+        lox_int_array_push(&headers, target);
+    }
+
+    function->loops = ALLOC_ARRAY(lox_jit_loop, headers.size);
+    function->loop_count = headers.size;
+    for (int i = 0; i < headers.size; i++) {
+      function->loops[i].header = headers.values[i];
+      function->loops[i].counter = LOX_JIT_LOOP_THRESHOLD;
+      function->loops[i].trace = NULL;
+      function->loops[i].trace_size = 0;
+      function->loops[i].trace_entry = NULL;
+    }
+    lox_int_array_free(&headers);
+  }
+
+  for (int i = 0; i < function->loop_count; i++) {
+    if (function->loops[i].header == header)
+      return &function->loops[i];
+  }
+  return NULL;
+}
+
+// Traces are recorded by the interpreter, one iteration of a loop at a time:
+// lox_jit_record is called before every instruction while recording, and the
+// trace is complete once the loop jumps back to its header.
+bool lox_jit_recording = false;
+
+static struct {
+  lox_object_function *function;
+  lox_jit_loop *loop;
+  // The index of the frame in vm.frames.
+  int frame;
+  // The size of the stack of the frame at the header of the loop.
+  int depth;
+  // The offsets of the instructions of the trace, in the order they ran.
+  lox_int_array offsets;
+} recorder;
+
+static void start_recording(lox_call_frame *frame, lox_jit_loop *loop) {
+  recorder.function = frame->closure->function;
+  recorder.loop = loop;
+  recorder.frame = frame - vm.frames;
+  recorder.depth = vm.stack.size - frame->slots_offset;
+  lox_int_array_initialize(&recorder.offsets);
+  lox_jit_recording = true;
+}
+
+static void stop_recording() {
+  lox_int_array_free(&recorder.offsets);
+  lox_jit_recording = false;
+}
+
+// Gives up on tracing the loop being recorded. The loop won't be recorded
+// again, and its back edge won't leave the native code of its function.
+static void abort_recording() {
+  recorder.loop->counter = INT_MAX;
+  stop_recording();
+}
+
+void lox_jit_reset() {
+  if (lox_jit_recording)
+    abort_recording();
+}
+
+// Whether the instruction at `offset` can be part of a trace, given the values
+// it is about to run with.
+static bool can_trace(lox_chunk *chunk, int offset) {
+  lox_value *top = vm.stack.values + vm.stack.size;
+  switch ((lox_op_code)chunk->code.values[offset]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_POP:
+  case OP_POPN:
+  case OP_DUP:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_LOCAL_GET_LOCAL:
+  case OP_GET_LOCAL_CONSTANT:
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG:
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_CAPTURE:
+  case OP_NOT:
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_EQ_JMP_FALSE:
+  case OP_NEQ_JMP_FALSE:
+  case OP_JMP_FALSE:
+  case OP_JMP_TRUE:
+  case OP_JMP:
+  case OP_JMP_BACK:
+  case OP_PRINT:
+  case OP_GET_PROPERTY:
+  case OP_GET_LOCAL_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+    return true;
+  // Arithmetic on anything else than numbers would leave the trace on every
+  // iteration.
+  case OP_NEGATE:
+    return lox_value_is_number(top[-1]);
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+  case OP_MODULO:
+  case OP_MODULO_NUM:
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+  case OP_GREATEREQ:
+  case OP_GREATEREQ_NUM:
+  case OP_LESS:
+  case OP_LESS_NUM:
+  case OP_LESSEQ:
+  case OP_LESSEQ_NUM:
+  case OP_GREATER_JMP_FALSE:
+  case OP_GREATEREQ_JMP_FALSE:
+  case OP_LESS_JMP_FALSE:
+  case OP_LESSEQ_JMP_FALSE:
+    return lox_value_is_number(top[-1]) && lox_value_is_number(top[-2]);
+  default:
+    return false;
+  }
+}
+
+void lox_jit_record(lox_call_frame *frame, uint8_t *ip) {
+  lox_object_function *function = recorder.function;
+  if (vm.frame_count - 1 != recorder.frame ||
+      frame->closure->function != function ||
+      recorder.offsets.size == LOX_JIT_MAX_TRACE_LENGTH) {
+    abort_recording();
+    return;
+  }
+
+  int offset = ip - function->chunk.code.values;
+  if (!can_trace(&function->chunk, offset)) {
+    abort_recording();
+    return;
+  }
+  // An instruction that runs twice in one iteration belongs to an inner loop,
+  // which is traced on its own.
+  if (function->chunk.code.values[offset] == OP_JMP_BACK) {
+    for (int i = 0; i < recorder.offsets.size; i++) {
+      if (recorder.offsets.values[i] == offset) {
+        abort_recording();
+        return;
+      }
+    }
+  }
+  lox_int_array_push(&recorder.offsets, offset);
+}
+
+static void types_init(lox_jit_types *types, int slot_count,
+                       int global_count) {
+  types->numbers = ALLOC_ARRAY(bool, slot_count);
+  types->sources = ALLOC_ARRAY(int, slot_count);
+  types->globals = ALLOC_ARRAY(uint8_t, global_count);
+  for (int i = 0; i < slot_count; i++) {
+    types->numbers[i] = false;
+    types->sources[i] = -1;
+  }
+  memset(types->globals, 0, global_count);
+}
+
+static void types_free(lox_jit_types *types, int slot_count,
+                       int global_count) {
+  FREE_ARRAY(bool, types->numbers, slot_count);
+  FREE_ARRAY(int, types->sources, slot_count);
+  FREE_ARRAY(uint8_t, types->globals, global_count);
+}
+
+static void types_copy(lox_jit_types *dst, lox_jit_types *src, int slot_count,
+                       int global_count) {
+  memcpy(dst->numbers, src->numbers, sizeof(bool) * slot_count);
+  memcpy(dst->sources, src->sources, sizeof(int) * slot_count);
+  memcpy(dst->globals, src->globals, global_count);
+}
+
+static void set_slot(lox_jit_types *types, int slot, bool number, int source) {
+  types->numbers[slot] = number;
+  types->sources[slot] = source;
+}
+
+// Forgets that slots are copies of `source`, once it is assigned.
+static void forget_copies(lox_jit_types *types, int slot_count, int source) {
+  for (int i = 0; i < slot_count; i++) {
+    if (types->sources[i] == source)
+      types->sources[i] = -1;
+  }
+}
+
+static void set_global(lox_jit_types *types, int slot_count, int index,
+                       bool number) {
+  forget_copies(types, slot_count, -2 - index);
+  types->globals[index] = GLOBAL_DEFINED | (number ? GLOBAL_NUMBER : 0);
+}
+
+// Updates what is known about the values once the instruction at `offset` has
+// run. Nothing but the trace itself can change the locals and globals while it
+// runs, since calls aren't traced.
+static void update_types(lox_jit_assembler *as, int offset) {
+  lox_jit_types *types = as->types;
+  lox_chunk *chunk = as->chunk;
+  uint8_t *code = &chunk->code.values[offset];
+  int slot_count = as->function->max_stack_size;
+  int depth = as->depth;
+  bool *numbers = types->numbers;
+  switch ((lox_op_code)code[0]) {
+  case OP_CONSTANT:
+    set_slot(types, depth,
+             lox_value_is_number(chunk->constants.values[code[1]]), -1);
+    break;
+  case OP_CONSTANT_LONG:
+    set_slot(types, depth,
+             lox_value_is_number(
+                 chunk->constants.values[read_short(chunk, offset + 1)]),
+             -1);
+    break;
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_UPVALUE:
+  case OP_GET_CAPTURE:
+  case OP_GET_LOCAL_GET_PROPERTY:
+    set_slot(types, depth, false, -1);
+    break;
+  case OP_DUP:
+    set_slot(types, depth, numbers[depth - 1], types->sources[depth - 1]);
+    break;
+  case OP_GET_LOCAL:
+    set_slot(types, depth, numbers[code[1]], code[1]);
+    break;
+  case OP_GET_LOCAL_GET_LOCAL:
+    set_slot(types, depth, numbers[code[1]], code[1]);
+    set_slot(types, depth + 1, numbers[code[2]], code[2]);
+    break;
+  case OP_GET_LOCAL_CONSTANT:
+    set_slot(types, depth, numbers[code[1]], code[1]);
+    set_slot(types, depth + 1,
+             lox_value_is_number(chunk->constants.values[code[2]]), -1);
+    break;
+  case OP_SET_LOCAL:
+    forget_copies(types, slot_count, code[1]);
+    set_slot(types, code[1], numbers[depth - 1], -1);
+    break;
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG: {
+    int index =
+        code[0] == OP_GET_GLOBAL ? code[1] : read_short(chunk, offset + 1);
+    set_slot(types, depth, types->globals[index] & GLOBAL_NUMBER, -2 - index);
+    types->globals[index] |= GLOBAL_DEFINED;
+    break;
+  }
+  case OP_SET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+    set_global(types, slot_count, code[1], numbers[depth - 1]);
+    break;
+  case OP_SET_GLOBAL_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+    set_global(types, slot_count, read_short(chunk, offset + 1),
+               numbers[depth - 1]);
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+  case OP_MODULO:
+  case OP_MODULO_NUM:
+    set_slot(types, depth - 2, true, -1);
+    break;
+  case OP_NEGATE:
+    set_slot(types, depth - 1, true, -1);
+    break;
+  case OP_NOT:
+  case OP_GET_PROPERTY:
+    set_slot(types, depth - 1, false, -1);
+    break;
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+  case OP_GREATEREQ:
+  case OP_GREATEREQ_NUM:
+  case OP_LESS:
+  case OP_LESS_NUM:
+  case OP_LESSEQ:
+  case OP_LESSEQ_NUM:
+    set_slot(types, depth - 2, false, -1);
+    break;
+  case OP_SET_PROPERTY:
+    set_slot(types, depth - 2, numbers[depth - 1], -1);
+    break;
+  default:
+    break;
+  }
+}
+
+// Emits one iteration of a trace, starting with the stack of the frame at
+// `depth` values. The OP_JMP_BACK that ends the trace is left to the caller.
+static void emit_trace(lox_jit_assembler *as, lox_int_array *trace,
+                       int depth) {
+  as->depth = depth;
+  for (int i = 0; i < trace->size - 1; i++) {
+    int offset = trace->values[i];
+    emit_instruction(as, offset, trace->values[i + 1]);
+    update_types(as, offset);
+    as->depth += lox_chunk_stack_effect(as->chunk, offset);
+  }
+}
+
+// Compiles a recorded trace. The first iteration of the loop is peeled off,
+// and runs with nothing known about the values. The loop that follows it
+// starts with what is known at the end of every iteration: the temporaries are
+// gone, and a local or global is only known to be a number if it still is
+// after another iteration that starts with that knowledge.
+static bool compile_trace(lox_object_function *function, lox_jit_loop *loop,
+                          lox_int_array *trace, int depth) {
+  int slot_count = function->max_stack_size;
+  int global_count = vm.globals.size;
+  lox_jit_types types, loop_types;
+  types_init(&types, slot_count, global_count);
+  types_init(&loop_types, slot_count, global_count);
+
+  lox_jit_assembler as;
+  assembler_init(&as, function);
+  as.types = &types;
+  emit_trace(&as, trace, depth);
+  types_copy(&loop_types, &types, slot_count, global_count);
+  for (int i = 0; i < slot_count; i++) {
+    set_slot(&loop_types, i, i < depth && loop_types.numbers[i], -1);
+  }
+  for (bool changed = true; changed;) {
+    types_copy(&types, &loop_types, slot_count, global_count);
+    as.code.size = 0;
+    as.exits.size = 0;
+    emit_trace(&as, trace, depth);
+    changed = false;
+    for (int i = 0; i < slot_count; i++) {
+      changed |= loop_types.numbers[i] && !types.numbers[i];
+      loop_types.numbers[i] &= types.numbers[i];
+    }
+    for (int i = 0; i < global_count; i++) {
+      changed |= (loop_types.globals[i] & ~types.globals[i]) != 0;
+      loop_types.globals[i] &= types.globals[i];
+    }
+  }
+  assembler_free(&as);
+
+  assembler_init(&as, function);
+  as.types = &types;
+  emit_entry_and_exit(&as);
+  int entry = as.code.size;
+  types_copy(&types, &loop_types, slot_count, global_count);
+  memset(types.numbers, 0, sizeof(bool) * slot_count);
+  memset(types.globals, 0, global_count);
+  emit_trace(&as, trace, depth);
+  int body = as.code.size;
+  types_copy(&types, &loop_types, slot_count, global_count);
+  emit_trace(&as, trace, depth);
+  emit_byte(&as, 0xE9);
+  emit_int32(&as, body - (as.code.size + 4));
+
+  loop->trace = assemble(&as, &loop->trace_size);
+  if (loop->trace != NULL)
+    loop->trace_entry = loop->trace + entry;
+
+  assembler_free(&as);
+  types_free(&loop_types, slot_count, global_count);
+  types_free(&types, slot_count, global_count);
+  return loop->trace != NULL;
+}
+
+uint8_t *lox_jit_jump_back(lox_call_frame *frame, uint8_t *ip) {
+  lox_object_function *function = frame->closure->function;
+  int header = ip - function->chunk.code.values;
+  lox_jit_loop *loop = find_loop(function, header);
+
+  if (lox_jit_recording && recorder.loop == loop &&
+      vm.frame_count - 1 == recorder.frame) {
+    if (!compile_trace(function, loop, &recorder.offsets, recorder.depth))
+      loop->counter = INT_MAX;
+    stop_recording();
+  }
+
+  // While recording, the instructions have to run in the interpreter.
+  if (!lox_jit_recording) {
+    if (loop->trace != NULL) {
+      // Keep leaving the native code of the function at the back edge, so that
+      // the trace runs instead.
+      loop->counter = 0;
+      lox_jit_entry entry = (lox_jit_entry)(void *)loop->trace;
+      ip = entry(vm.stack.values + vm.stack.size,
+                 vm.stack.values + frame->slots_offset, frame,
+                 loop->trace_entry);
+    } else if (--loop->counter < 0) {
+      start_recording(frame, loop);
+    }
+  }
+
+  // Loops that run long enough are compiled even if their function is only
+  // called once, like the loops of the script.
+  if (function->jit == NULL && function->hotness++ == LOX_JIT_THRESHOLD)
+    lox_jit_compile(function);
+  frame->jit_entry =
+      function->jit != NULL && !lox_jit_recording ? ip : NULL;
+  return ip;
+}
+
+#endif
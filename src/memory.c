@@ -1,8 +1,12 @@
 #include "memory.h"
 #include "common.h"
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "compiler.h"
+#include "debug.h"
+#include "slab.h"
 #include "vm.h"
 
 extern lox_vm vm;
@@ -10,8 +14,35 @@ extern lox_vm vm;
 static void trace_references();
 static void blacken_object(lox_object *obj);
 static void sweep();
+static void sweep_young();
+static void clear_remembered();
+static void gray_object(lox_object *obj);
+static void start_cycle();
+static void finish_marking();
+static void finish_cycle();
+#ifdef LOX_GC_THREAD
+static void *sweep_in_background(void *arg);
+static void join_sweeper();
+
+// Whether this is the thread that sweeps, which only frees memory, and the
+// number of bytes it freed.
+static _Thread_local bool is_sweeper;
+static _Thread_local ssize_t swept_bytes;
+#endif
+static void mark_inline_caches(lox_inline_cache_array *caches);
+static void mark_call_caches(lox_call_cache_array *caches);
 
 void *lox_reallocate(void *ptr, ssize_t old_size, ssize_t new_size) {
+#ifdef LOX_GC_THREAD
+  if (is_sweeper) {
+    swept_bytes += old_size - new_size;
+    if (lox_slab_is_small(old_size))
+      lox_slab_free_deferred(ptr, old_size);
+    else
+      free(ptr);
+    return NULL;
+  }
+#endif
 #ifdef DEBUG_LOG_GC_VERBOSE
   ssize_t prev = vm.bytes_allocated;
 #endif
@@ -25,23 +56,56 @@ void *lox_reallocate(void *ptr, ssize_t old_size, ssize_t new_size) {
 #endif
 
   if (new_size > old_size) {
-#ifdef DEBUG_STRESS_GC
-    jollect_garbage();
-#endif
-
-    if (vm.bytes_allocated > vm.next_gc) {
+    if (LOX_GC_STRESS)
       collect_garbage();
+
+    if (vm.gc_phase != LOX_GC_IDLE) {
+      lox_gc_step();
+    } else if (vm.bytes_allocated > vm.next_gc) {
+      if (LOX_GC_SLICE_BUDGET > 0) {
+        start_cycle();
+      } else {
+        collect_garbage();
+      }
+    } else if (LOX_GC_YOUNG_SIZE > 0 &&
+               vm.bytes_allocated > vm.next_young_gc) {
+      collect_young();
     }
   }
 
-  if (new_size == 0) {
-    free(ptr);
-    return NULL;
+  // Small blocks come from the slabs of their size class, and only large ones
+  // from malloc, so a block can only be resized in place within its class.
+  bool was_small = ptr != NULL && lox_slab_is_small(old_size);
+  if (was_small && lox_slab_is_small(new_size) &&
+      lox_slab_same_class(old_size, new_size))
+    return ptr;
+  if (!was_small && !lox_slab_is_small(new_size)) {
+    if (new_size == 0) {
+      free(ptr);
+      return NULL;
+    }
+    void *result = realloc(ptr, new_size);
+    if (result == NULL)
+      exit(1);
+    return result;
   }
 
-  void *result = realloc(ptr, new_size);
-  if (result == NULL)
-    exit(1);
+  void *result = NULL;
+  if (lox_slab_is_small(new_size)) {
+    result = lox_slab_alloc(new_size);
+  } else if (new_size > 0) {
+    result = malloc(new_size);
+    if (result == NULL)
+      exit(1);
+  }
+  if (ptr != NULL) {
+    if (result != NULL)
+      memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+    if (was_small)
+      lox_slab_free(ptr, old_size);
+    else
+      free(ptr);
+  }
   return result;
 }
 
@@ -56,12 +120,24 @@ void collect_garbage() {
   size_t before = vm.bytes_allocated;
 #endif
 
+  // An incremental collection in progress is finished first, since this one
+  // uses the marks differently.
+  lox_gc_finish();
+
   mark_roots();
   trace_references();
   lox_hash_table_remove_white(&vm.strings);
+  // The remembered objects that are unreachable are about to be freed.
+  clear_remembered();
+#ifdef DEBUG_PRINT_INLINE_CACHES
+  lox_print_function_caches(vm.objects, true);
+  lox_print_function_caches(vm.young_objects, true);
+#endif
   sweep();
+  sweep_young();
 
   vm.next_gc = vm.bytes_allocated * LOX_GC_HEAP_GROW_FACTOR;
+  vm.next_young_gc = vm.bytes_allocated + LOX_GC_YOUNG_SIZE;
   vm.mark_value = !vm.mark_value;
 
 #ifdef DEBUG_LOG_GC
@@ -71,6 +147,231 @@ void collect_garbage() {
 #endif
 }
 
+void collect_young() {
+#ifdef DEBUG_LOG_GC
+  printf("-- MINOR GC BEGIN\n");
+  size_t before = vm.bytes_allocated;
+#endif
+
+  // Old objects are neither marked nor traced, so the young objects they refer
+  // to are only found through the remembered set. Marking the roots can add
+  // objects to it, so it is read afterwards.
+  vm.collecting_young = true;
+  mark_roots();
+  for (int i = 0; i < vm.remembered_size; i++) {
+    blacken_object(vm.remembered[i]);
+  }
+  trace_references();
+  lox_hash_table_remove_white(&vm.strings);
+#ifdef DEBUG_PRINT_INLINE_CACHES
+  lox_print_function_caches(vm.young_objects, true);
+#endif
+  sweep_young();
+  clear_remembered();
+  vm.collecting_young = false;
+
+  // The survivors are unmarked again by sweep_young, so unlike a full
+  // collection this one doesn't flip vm.mark_value.
+  vm.next_young_gc = vm.bytes_allocated + LOX_GC_YOUNG_SIZE;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- MINOR GC END\n");
+  printf("   Collected %zu bytes (from %zu to %zu)\n",
+         before - vm.bytes_allocated, before, vm.bytes_allocated);
+#endif
+}
+
+// An incremental full collection starts by marking the roots, after which each
+// slice blackens objects from the gray stack. A marked object can't be made to
+// refer to an unmarked one, because of the write barriers, except for the
+// roots, which are marked again once the gray stack is empty. The objects
+// allocated in the meantime are unmarked, and kept if they are reachable then.
+// The objects are then swept a slice at a time.
+//
+// Collections of the young generation don't happen during an incremental
+// collection: the young generation is collected when it starts, and every
+// object allocated until it ends is old.
+//
+// Only the sweeping can run on another thread (see LOX_GC_THREAD). Marking
+// stays on the mutator, in slices: tracing reads hash tables, shapes and caches
+// that the mutator changes without locking, and lox_gc_write_barrier_object
+// marks the new references rather than keep a snapshot of the old ones.
+// Marking concurrently would need atomic mark bits, a snapshot-at-the-beginning
+// barrier on every store and a final remark, which aren't implemented.
+static void start_cycle() {
+#ifdef DEBUG_LOG_GC
+  printf("-- INCREMENTAL GC BEGIN\n");
+#endif
+
+  collect_young();
+  vm.gc_phase = LOX_GC_MARKING;
+  mark_roots();
+}
+
+void lox_gc_step() {
+  int budget = LOX_GC_SLICE_BUDGET > 0 ? LOX_GC_SLICE_BUDGET : INT_MAX;
+
+  if (vm.gc_phase == LOX_GC_MARKING) {
+    while (vm.gray_size > 0 && budget > 0) {
+      blacken_object(vm.gray_stack[--vm.gray_size]);
+      budget--;
+    }
+    if (vm.gray_size == 0) {
+      finish_marking();
+    }
+    return;
+  }
+
+#ifdef LOX_GC_THREAD
+  if (vm.sweeper_running) {
+    if (atomic_load(&vm.sweeper_done))
+      join_sweeper();
+    return;
+  }
+#endif
+
+  while (vm.sweeping != NULL && budget > 0) {
+    lox_object *object = vm.sweeping;
+    vm.sweeping = object->next;
+    // The marks were flipped by finish_marking.
+    if (object->is_marked == vm.mark_value) {
+      lox_object_free(object);
+    } else {
+      object->next = vm.objects;
+      vm.objects = object;
+    }
+    budget--;
+  }
+  if (vm.sweeping == NULL) {
+    finish_cycle();
+  }
+}
+
+void lox_gc_finish() {
+  while (vm.gc_phase != LOX_GC_IDLE) {
+#ifdef LOX_GC_THREAD
+    if (vm.sweeper_running) {
+      join_sweeper();
+      continue;
+    }
+#endif
+    lox_gc_step();
+  }
+}
+
+static void finish_cycle() {
+  vm.gc_phase = LOX_GC_IDLE;
+  vm.next_gc = vm.bytes_allocated * LOX_GC_HEAP_GROW_FACTOR;
+  vm.next_young_gc = vm.bytes_allocated + LOX_GC_YOUNG_SIZE;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- INCREMENTAL GC END\n");
+  printf("   %zu bytes allocated, next at %zu\n", vm.bytes_allocated,
+         vm.next_gc);
+#endif
+}
+
+static void finish_marking() {
+  mark_roots();
+  trace_references();
+  lox_hash_table_remove_white(&vm.strings);
+#ifdef DEBUG_PRINT_INLINE_CACHES
+  lox_print_function_caches(vm.objects, true);
+#endif
+
+  // The objects that were marked are unmarked for the next collection, and the
+  // objects allocated from now on are unmarked like them. Every object is old.
+  vm.mark_value = !vm.mark_value;
+  vm.sweeping = vm.objects;
+  vm.objects = NULL;
+  vm.gc_phase = LOX_GC_SWEEPING;
+
+#ifdef LOX_GC_THREAD
+  // The objects left to sweep can't be reached by the program, or are only
+  // looked at by the mutator to be moved back to vm.objects afterwards, so they
+  // can be swept on another thread. If it can't be started, they are swept in
+  // slices instead.
+  atomic_store(&vm.sweeper_done, false);
+  vm.sweeper_running =
+      pthread_create(&vm.sweeper, NULL, sweep_in_background, NULL) == 0;
+#endif
+}
+
+#ifdef LOX_GC_THREAD
+static void *sweep_in_background(void *arg) {
+  (void)arg;
+  is_sweeper = true;
+  swept_bytes = 0;
+
+  lox_object *survivors = NULL;
+  lox_object *last = NULL;
+  lox_object *object = vm.sweeping;
+  while (object != NULL) {
+    lox_object *next = object->next;
+    if (object->is_marked == vm.mark_value) {
+      lox_object_free(object);
+    } else {
+      object->next = survivors;
+      survivors = object;
+      if (last == NULL)
+        last = object;
+    }
+    object = next;
+  }
+
+  vm.sweeping = survivors;
+  vm.swept_last = last;
+  vm.swept_bytes = swept_bytes;
+  atomic_store(&vm.sweeper_done, true);
+  return NULL;
+}
+
+static void join_sweeper() {
+  pthread_join(vm.sweeper, NULL);
+  vm.sweeper_running = false;
+
+  if (vm.swept_last != NULL) {
+    vm.swept_last->next = vm.objects;
+    vm.objects = vm.sweeping;
+  }
+  vm.sweeping = NULL;
+  vm.bytes_allocated -= vm.swept_bytes;
+  lox_slab_flush();
+  finish_cycle();
+}
+#endif
+
+void lox_gc_mark_barrier(lox_object *owner, lox_object *value) {
+  if (vm.gc_phase == LOX_GC_MARKING && owner->is_marked == vm.mark_value) {
+    mark_object(value);
+  }
+}
+
+void lox_gc_remember(lox_object *obj) {
+  if (vm.gc_phase == LOX_GC_MARKING && obj->is_marked == vm.mark_value) {
+    gray_object(obj);
+  }
+  // There are no young objects during an incremental collection.
+  if (vm.gc_phase != LOX_GC_IDLE || !obj->is_old || obj->is_remembered)
+    return;
+  obj->is_remembered = true;
+
+  if (vm.remembered_capacity < vm.remembered_size + 1) {
+    vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+    // Same as the gray stack, this can't trigger a garbage collection.
+    vm.remembered = (lox_object **)realloc(
+        vm.remembered, sizeof(lox_object *) * vm.remembered_capacity);
+
+    if (vm.remembered == NULL) {
+      runtime_error("An error occurred while allocating memory for the garbage "
+                    "collector.");
+      exit(1);
+    }
+  }
+
+  vm.remembered[vm.remembered_size++] = obj;
+}
+
 void mark_roots() {
   for (int i = 0; i < vm.stack.size; i++) {
     mark_value(vm.stack.values[i]);
@@ -87,22 +388,35 @@ void mark_roots() {
 
   mark_table(&vm.global_indices);
   mark_value_array(&vm.globals);
-  mark_value(vm.init_string);
+  mark_table(&vm.selector_indices);
+  mark_value_array(&vm.selectors);
+  mark_object((lox_object *)vm.root_shape);
 
   lox_compiler_mark_roots();
 }
 
 void mark_value(lox_value value) {
-  if (value.type == VAL_OBJECT) {
-    mark_object(value.as.object);
+  if (lox_value_is_object(value)) {
+    mark_object(lox_value_as_object(value));
   }
 }
 
 void mark_object(lox_object *obj) {
   if (obj == NULL || obj->is_marked == vm.mark_value)
     return;
+  if (vm.collecting_young && obj->is_old)
+    return;
   obj->is_marked = vm.mark_value;
+  gray_object(obj);
 
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", obj);
+  lox_print_object(obj);
+  printf("\n");
+#endif
+}
+
+static void gray_object(lox_object *obj) {
   if (vm.gray_capacity < vm.gray_size + 1) {
     vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
     // We use realloc instead of lox_reallocate because we are inside the
@@ -119,18 +433,12 @@ void mark_object(lox_object *obj) {
   }
 
   vm.gray_stack[vm.gray_size++] = obj;
-
-#ifdef DEBUG_LOG_GC
-  printf("%p mark ", obj);
-  lox_print_object(obj);
-  printf("\n");
-#endif
 }
 
 void mark_table(lox_hash_table *table) {
   for (int i = 0; i < table->capacity; i++) {
     lox_hash_table_entry *entry = &table->entries[i];
-    if (entry->key.type != VAL_EMPTY) {
+    if (!lox_value_is_empty(entry->key)) {
       mark_value(entry->key);
       mark_value(entry->value);
     }
@@ -161,6 +469,8 @@ static void blacken_object(lox_object *obj) {
     lox_object_function *fun = (lox_object_function *)obj;
     mark_object((lox_object *)fun->name);
     mark_value_array(&fun->chunk.constants);
+    mark_inline_caches(&fun->chunk.caches);
+    mark_call_caches(&fun->chunk.calls);
     break;
   }
   case OBJ_CLOSURE: {
@@ -169,6 +479,10 @@ static void blacken_object(lox_object *obj) {
     for (int i = 0; i < closure->upvalue_count; i++) {
       mark_object((lox_object *)closure->upvalues[i]);
     }
+    lox_value *captures = lox_object_closure_captures(closure);
+    for (int i = 0; i < closure->capture_count; i++) {
+      mark_value(captures[i]);
+    }
     break;
   }
   case OBJ_UPVALUE:
@@ -177,12 +491,29 @@ static void blacken_object(lox_object *obj) {
   case OBJ_CLASS: {
     lox_object_class *clazz = (lox_object_class *)obj;
     mark_object((lox_object *)clazz->name);
-    mark_table(clazz->methods);
+    for (int i = 0; i < clazz->method_capacity; i++) {
+      mark_object((lox_object *)clazz->methods[i]);
+    }
   } break;
   case OBJ_INSTANCE: {
     lox_object_instance *inst = (lox_object_instance *)obj;
     mark_object((lox_object *)inst->clazz);
-    mark_table(inst->fields);
+    if (inst->shape == NULL) {
+      mark_table(inst->fields);
+      break;
+    }
+    mark_object((lox_object *)inst->shape);
+    for (int i = 0; i < inst->shape->slot_count; i++) {
+      mark_value(inst->slots[i]);
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    lox_object_shape *shape = (lox_object_shape *)obj;
+    mark_object((lox_object *)shape->parent);
+    mark_value(shape->name);
+    mark_table(shape->slots);
+    mark_table(shape->transitions);
     break;
   }
   case OBJ_BOUND_METHOD: {
@@ -196,12 +527,69 @@ static void blacken_object(lox_object *obj) {
 
 void mark_value_array(lox_value_array *array) {
   for (int i = 0; i < array->size; i++) {
-    if (array->values[i].type != VAL_EMPTY) {
+    if (!lox_value_is_empty(array->values[i])) {
       mark_value(array->values[i]);
     }
   }
 }
 
+static void mark_inline_caches(lox_inline_cache_array *caches) {
+  // The entries compare objects by address, so whatever they refer to has to
+  // stay alive, or else a new object allocated at the same address would match
+  // an entry that isn't related to it.
+  for (int i = 0; i < caches->size; i++) {
+    lox_inline_cache *cache = &caches->values[i];
+    for (int j = 0; j < cache->count; j++) {
+      lox_inline_cache_entry *entry = &cache->entries[j];
+      mark_object((lox_object *)entry->clazz);
+      mark_object((lox_object *)entry->shape);
+      // Both members of the union are objects, and marking either one through
+      // `lox_object *` is fine.
+      mark_object((lox_object *)entry->as.method);
+    }
+  }
+}
+
+static void mark_call_caches(lox_call_cache_array *caches) {
+  // As with inline caches, the callee is compared by address. The initializer
+  // of a class is kept alive by the class.
+  for (int i = 0; i < caches->size; i++) {
+    mark_object(caches->values[i].callee);
+  }
+}
+
+// Every young object that survives is promoted, so the young list is always
+// empty after a garbage collection. There is no aging: an object that is still
+// reachable at its first collection is old, even if it dies right after, and
+// is then only freed by a full collection. Keeping it young for a few more
+// collections would need an age in every object, and would have the young
+// collections trace it again each time. The survivors of a full collection are
+// unmarked when vm.mark_value is flipped, and the ones of a collection of the
+// young list are unmarked here.
+static void sweep_young() {
+  lox_object *object = vm.young_objects;
+  while (object != NULL) {
+    lox_object *next = object->next;
+    if (object->is_marked == vm.mark_value) {
+      object->is_marked = vm.collecting_young ? !vm.mark_value : vm.mark_value;
+      object->is_old = true;
+      object->next = vm.objects;
+      vm.objects = object;
+    } else {
+      lox_object_free(object);
+    }
+    object = next;
+  }
+  vm.young_objects = NULL;
+}
+
+static void clear_remembered() {
+  for (int i = 0; i < vm.remembered_size; i++) {
+    vm.remembered[i]->is_remembered = false;
+  }
+  vm.remembered_size = 0;
+}
+
 static void sweep() {
   lox_object *previous = NULL;
   lox_object *object = vm.objects;
@@ -18,9 +18,10 @@ lox_value hasProperty_native(int argc, lox_value *argv) {
       !lox_value_is_string(argv[1]))
     return lox_value_from_bool(false);
 
-  lox_object_instance *inst = (lox_object_instance *)argv[0].as.object;
+  lox_object_instance *inst =
+      (lox_object_instance *)lox_value_as_object(argv[0]);
   lox_value name = argv[1];
-  return lox_value_from_bool(lox_hash_table_has(inst->fields, name));
+  return lox_value_from_bool(lox_object_instance_has_field(inst, name));
 }
 
 lox_value getProperty_native(int argc, lox_value *argv) {
@@ -28,10 +29,11 @@ lox_value getProperty_native(int argc, lox_value *argv) {
       !lox_value_is_string(argv[1]))
     return lox_value_from_nil();
 
-  lox_object_instance *inst = (lox_object_instance *)argv[0].as.object;
+  lox_object_instance *inst =
+      (lox_object_instance *)lox_value_as_object(argv[0]);
   lox_value name = argv[1];
   lox_value val;
-  if (!lox_hash_table_get(inst->fields, name, &val)) {
+  if (!lox_object_instance_get_field(inst, name, &val)) {
     return lox_value_from_nil();
   }
   return val;
@@ -42,10 +44,11 @@ lox_value setProperty_native(int argc, lox_value *argv) {
       !lox_value_is_string(argv[1]))
     return lox_value_from_nil();
 
-  lox_object_instance *inst = (lox_object_instance *)argv[0].as.object;
+  lox_object_instance *inst =
+      (lox_object_instance *)lox_value_as_object(argv[0]);
   lox_value name = argv[1];
   lox_value val = argv[2];
-  lox_hash_table_put(inst->fields, name, val);
+  lox_object_instance_set_field(inst, name, val);
   return argv[2];
 }
 
@@ -54,7 +57,8 @@ lox_value removeProperty_native(int argc, lox_value *argv) {
       !lox_value_is_string(argv[1]))
     return lox_value_from_bool(false);
 
-  lox_object_instance *inst = (lox_object_instance *)argv[0].as.object;
+  lox_object_instance *inst =
+      (lox_object_instance *)lox_value_as_object(argv[0]);
   lox_value name = argv[1];
-  return lox_value_from_bool(lox_hash_table_remove(inst->fields, name));
+  return lox_value_from_bool(lox_object_instance_remove_field(inst, name));
 }
@@ -1,5 +1,7 @@
 #include "object.h"
 #include "chunk.h"
+#include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "value.h"
 #include "vm.h"
@@ -12,6 +14,12 @@ extern lox_vm vm;
 #define OBJ_NEW(struct_type, object_type)                                      \
   ((struct_type *)lox_object_new(sizeof(struct_type), object_type))
 
+static size_t closure_size(int upvalue_count, int capture_count) {
+  return sizeof(lox_object_closure) +
+         sizeof(lox_object_upvalue *) * upvalue_count +
+         sizeof(lox_value) * capture_count;
+}
+
 void lox_print_object(lox_object *obj) {
   switch (obj->type) {
   case OBJ_STRING: {
@@ -40,6 +48,9 @@ void lox_print_object(lox_object *obj) {
   case OBJ_BOUND_METHOD:
     lox_object_bound_method_print((lox_object_bound_method *)obj);
     break;
+  case OBJ_SHAPE:
+    printf("<shape>");
+    break;
   }
 }
 
@@ -47,11 +58,19 @@ lox_object *lox_object_new(size_t size, lox_object_type type) {
   lox_object *obj = ALLOC_SIZE(size);
   obj->type = type;
   obj->is_marked = !vm.mark_value;
+  // There is no young generation during an incremental collection.
+  obj->is_old = vm.gc_phase != LOX_GC_IDLE;
+  obj->is_remembered = false;
 
   // Insert the newly created object into the list of objects stored in the VM
   // for garbage collection
-  obj->next = vm.objects;
-  vm.objects = obj;
+  if (obj->is_old) {
+    obj->next = vm.objects;
+    vm.objects = obj;
+  } else {
+    obj->next = vm.young_objects;
+    vm.young_objects = obj;
+  }
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", obj, size, type);
@@ -90,6 +109,9 @@ void lox_object_free(lox_object *obj) {
   case OBJ_BOUND_METHOD:
     lox_object_bound_method_free((lox_object_bound_method *)obj);
     break;
+  case OBJ_SHAPE:
+    lox_object_shape_free((lox_object_shape *)obj);
+    break;
   }
 }
 
@@ -188,11 +210,22 @@ lox_object_function *lox_object_function_new() {
   obj->name = NULL;
   obj->arity = 0;
   obj->upvalue_count = 0;
+  obj->capture_count = 0;
+  obj->max_stack_size = 0;
+#ifdef LOX_JIT
+  obj->hotness = 0;
+  obj->jit = NULL;
+  obj->loops = NULL;
+  obj->loop_count = 0;
+#endif
   return obj;
 }
 
 void lox_object_function_free(lox_object_function *obj) {
   lox_chunk_free(&obj->chunk);
+#ifdef LOX_JIT
+  lox_jit_free(obj);
+#endif
   FREE(lox_object_function, obj);
 }
 
@@ -218,22 +251,29 @@ lox_object_native *lox_object_native_new(const char *name,
 }
 
 void lox_object_native_free(lox_object_native *obj) {
-  FREE(lox_native_function, obj);
+  FREE(lox_object_native, obj);
 }
 
 lox_object_closure *lox_object_closure_new(lox_object_function *function) {
-  lox_object_closure *obj = OBJ_NEW(lox_object_closure, OBJ_CLOSURE);
+  lox_object_closure *obj = (lox_object_closure *)lox_object_new(
+      closure_size(function->upvalue_count, function->capture_count),
+      OBJ_CLOSURE);
   obj->function = function;
-  obj->upvalues = ALLOC_ARRAY(lox_object_upvalue *, function->upvalue_count);
   obj->upvalue_count = function->upvalue_count;
-  memset(obj->upvalues, '\0',
-         function->upvalue_count * sizeof(lox_object_upvalue *));
+  obj->capture_count = function->capture_count;
+  for (int i = 0; i < function->upvalue_count; i++) {
+    obj->upvalues[i] = NULL;
+  }
+  lox_value *captures = lox_object_closure_captures(obj);
+  for (int i = 0; i < function->capture_count; i++) {
+    captures[i] = lox_value_from_nil();
+  }
   return obj;
 }
 
 void lox_object_closure_free(lox_object_closure *obj) {
-  FREE_ARRAY(lox_object_upvalue *, obj->upvalues, obj->upvalue_count);
-  FREE(lox_object_closure, obj);
+  lox_reallocate(obj, closure_size(obj->upvalue_count, obj->capture_count),
+                 0);
 }
 
 lox_object_upvalue *lox_object_upvalue_new(lox_value *slot) {
@@ -251,8 +291,8 @@ void lox_object_upvalue_free(lox_object_upvalue *obj) {
 lox_object_class *lox_object_class_new(lox_object_string *name) {
   lox_object_class *obj = OBJ_NEW(lox_object_class, OBJ_CLASS);
   obj->name = name;
-  obj->methods = ALLOC_TYPE(lox_hash_table);
-  lox_hash_table_init(obj->methods);
+  obj->methods = NULL;
+  obj->method_capacity = 0;
   return obj;
 }
 
@@ -263,16 +303,108 @@ void lox_object_class_print(lox_object_class *obj) {
 }
 
 void lox_object_class_free(lox_object_class *obj) {
-  lox_hash_table_free(obj->methods);
-  FREE(lox_hash_table, obj->methods);
+  FREE_ARRAY(lox_object_closure *, obj->methods, obj->method_capacity);
   FREE(lox_object_class, obj);
 }
 
+// Makes room in the method table of a class for selectors up to `size` - 1.
+static void class_reserve_methods(lox_object_class *obj, int size) {
+  if (size <= obj->method_capacity)
+    return;
+
+  int capacity = GROW_CAPACITY(obj->method_capacity);
+  if (capacity < size)
+    capacity = size;
+  obj->methods = GROW_ARRAY(lox_object_closure *, obj->methods,
+                            obj->method_capacity, capacity);
+  for (int i = obj->method_capacity; i < capacity; i++) {
+    obj->methods[i] = NULL;
+  }
+  obj->method_capacity = capacity;
+}
+
+void lox_object_class_set_method(lox_object_class *obj, uint16_t selector,
+                                 lox_object_closure *method) {
+  class_reserve_methods(obj, selector + 1);
+  obj->methods[selector] = method;
+  lox_gc_write_barrier_object((lox_object *)obj, (lox_object *)method);
+}
+
+void lox_object_class_inherit(lox_object_class *obj,
+                              lox_object_class *superclass) {
+  class_reserve_methods(obj, superclass->method_capacity);
+  for (int i = 0; i < superclass->method_capacity; i++) {
+    if (superclass->methods[i] != NULL)
+      obj->methods[i] = superclass->methods[i];
+  }
+  lox_gc_remember((lox_object *)obj);
+}
+
+lox_object_shape *lox_object_shape_new(lox_object_shape *parent,
+                                       lox_value name) {
+  lox_hash_table *slots = ALLOC_TYPE(lox_hash_table);
+  lox_hash_table_init(slots);
+  lox_hash_table *transitions = ALLOC_TYPE(lox_hash_table);
+  lox_hash_table_init(transitions);
+  int slot_count = 0;
+  if (parent != NULL) {
+    // A shape knows the slots of all of its ancestors, so that finding a slot
+    // only takes one lookup.
+    lox_hash_table_copy_to(parent->slots, slots);
+    slot_count = parent->slot_count;
+    lox_hash_table_put(slots, name, lox_value_from_number(slot_count++));
+  }
+
+  lox_object_shape *obj = OBJ_NEW(lox_object_shape, OBJ_SHAPE);
+  obj->parent = parent;
+  obj->name = name;
+  obj->slots = slots;
+  obj->transitions = transitions;
+  obj->slot_count = slot_count;
+  return obj;
+}
+
+lox_object_shape *lox_object_shape_transition(lox_object_shape *shape,
+                                              lox_value name) {
+  lox_value next;
+  if (lox_hash_table_get(shape->transitions, name, &next)) {
+    return (lox_object_shape *)lox_value_as_object(next);
+  }
+
+  lox_object_shape *obj = lox_object_shape_new(shape, name);
+  // The new shape is only reachable once it is in the transitions table, so we
+  // have to protect it while the table grows.
+  push(lox_value_from_object((lox_object *)obj));
+  lox_hash_table_put(shape->transitions, name,
+                     lox_value_from_object((lox_object *)obj));
+  lox_gc_write_barrier_object((lox_object *)shape, (lox_object *)obj);
+  pop();
+  return obj;
+}
+
+int lox_object_shape_get_slot(lox_object_shape *shape, lox_value name) {
+  lox_value slot;
+  if (!lox_hash_table_get(shape->slots, name, &slot)) {
+    return -1;
+  }
+  return lox_value_as_number(slot);
+}
+
+void lox_object_shape_free(lox_object_shape *obj) {
+  lox_hash_table_free(obj->slots);
+  FREE(lox_hash_table, obj->slots);
+  lox_hash_table_free(obj->transitions);
+  FREE(lox_hash_table, obj->transitions);
+  FREE(lox_object_shape, obj);
+}
+
 lox_object_instance *lox_object_instance_new(lox_object_class *clazz) {
   lox_object_instance *obj = OBJ_NEW(lox_object_instance, OBJ_INSTANCE);
   obj->clazz = clazz;
-  obj->fields = ALLOC_TYPE(lox_hash_table);
-  lox_hash_table_init(obj->fields);
+  obj->shape = vm.root_shape;
+  obj->slots = NULL;
+  obj->slot_capacity = 0;
+  obj->fields = NULL;
   return obj;
 }
 
@@ -283,11 +415,110 @@ void lox_object_instance_print(lox_object_instance *obj) {
 }
 
 void lox_object_instance_free(lox_object_instance *obj) {
-  lox_hash_table_free(obj->fields);
-  FREE(lox_hash_table, obj->fields);
+  FREE_ARRAY(lox_value, obj->slots, obj->slot_capacity);
+  if (obj->fields != NULL) {
+    lox_hash_table_free(obj->fields);
+    FREE(lox_hash_table, obj->fields);
+  }
   FREE(lox_object_instance, obj);
 }
 
+bool lox_object_instance_get_field(lox_object_instance *obj, lox_value name,
+                                   lox_value *value) {
+  if (obj->shape == NULL) {
+    return lox_hash_table_get(obj->fields, name, value);
+  }
+
+  int slot = lox_object_shape_get_slot(obj->shape, name);
+  if (slot == -1) {
+    return false;
+  }
+  if (value != NULL)
+    *value = obj->slots[slot];
+  return true;
+}
+
+void lox_object_instance_set_field(lox_object_instance *obj, lox_value name,
+                                   lox_value value) {
+  if (obj->shape == NULL) {
+    lox_hash_table_put(obj->fields, name, value);
+    lox_gc_write_barrier((lox_object *)obj, name);
+    lox_gc_write_barrier((lox_object *)obj, value);
+    return;
+  }
+
+  int slot = lox_object_shape_get_slot(obj->shape, name);
+  if (slot != -1) {
+    obj->slots[slot] = value;
+    lox_gc_write_barrier((lox_object *)obj, value);
+    return;
+  }
+
+  if (obj->shape->slot_count >= LOX_MAX_SHAPE_SLOTS) {
+    lox_object_instance_make_dictionary(obj);
+    lox_hash_table_put(obj->fields, name, value);
+    lox_gc_write_barrier((lox_object *)obj, value);
+    return;
+  }
+
+  lox_object_instance_transition(
+      obj, lox_object_shape_transition(obj->shape, name), value);
+}
+
+void lox_object_instance_transition(lox_object_instance *obj,
+                                    lox_object_shape *shape, lox_value value) {
+  if (shape->slot_count > obj->slot_capacity) {
+    int capacity = GROW_CAPACITY(obj->slot_capacity);
+    obj->slots =
+        GROW_ARRAY(lox_value, obj->slots, obj->slot_capacity, capacity);
+    obj->slot_capacity = capacity;
+  }
+  obj->slots[shape->slot_count - 1] = value;
+  obj->shape = shape;
+  lox_gc_write_barrier((lox_object *)obj, value);
+  lox_gc_write_barrier_object((lox_object *)obj, (lox_object *)shape);
+}
+
+bool lox_object_instance_remove_field(lox_object_instance *obj,
+                                      lox_value name) {
+  if (obj->shape != NULL) {
+    if (lox_object_shape_get_slot(obj->shape, name) == -1) {
+      return false;
+    }
+    // Shapes can only describe fields being added, so an instance that loses a
+    // field can't share its layout anymore.
+    lox_object_instance_make_dictionary(obj);
+  }
+  return lox_hash_table_remove(obj->fields, name);
+}
+
+bool lox_object_instance_has_field(lox_object_instance *obj, lox_value name) {
+  return lox_object_instance_get_field(obj, name, NULL);
+}
+
+void lox_object_instance_make_dictionary(lox_object_instance *obj) {
+  if (obj->shape == NULL)
+    return;
+
+  lox_hash_table *fields = ALLOC_TYPE(lox_hash_table);
+  lox_hash_table_init(fields);
+  // We walk up the shape tree, which gives us the name of every slot. The
+  // instance keeps its shape until we're done, so the garbage collector still
+  // sees the slots if the table has to grow.
+  for (lox_object_shape *shape = obj->shape; shape->parent != NULL;
+       shape = shape->parent) {
+    lox_hash_table_put(fields, shape->name, obj->slots[shape->slot_count - 1]);
+  }
+
+  FREE_ARRAY(lox_value, obj->slots, obj->slot_capacity);
+  obj->slots = NULL;
+  obj->slot_capacity = 0;
+  obj->shape = NULL;
+  obj->fields = fields;
+  // The names of the fields are now keys of the table.
+  lox_gc_remember((lox_object *)obj);
+}
+
 lox_object_bound_method *
 lox_object_bound_method_new(lox_value receiver, lox_object_closure *method) {
   lox_object_bound_method *obj =
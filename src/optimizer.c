@@ -0,0 +1,476 @@
+#include "optimizer.h"
+#include "memory.h"
+#include "superinstructions.h"
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct {
+  lox_op_code fused;
+  lox_op_code first;
+  lox_op_code second;
+} lox_superinstruction;
+
+// The superinstructions enabled in superinstructions.h, terminated by an entry
+// whose opcodes are all OP_INVALID.
+static const lox_superinstruction superinstructions[] = {
+#define SUPERINSTRUCTION(fused, first, second) {fused, first, second},
+    LOX_SUPERINSTRUCTIONS(SUPERINSTRUCTION)
+#undef SUPERINSTRUCTION
+        {OP_INVALID, OP_INVALID, OP_INVALID},
+};
+
+// How many jumps a jump is threaded through at most, which also stops jumps
+// that go around in circles.
+#define LOX_MAX_THREADED_JUMPS 16
+// How many times the peephole optimizer goes over a chunk at most. Each pass
+// can expose new opportunities for the next one.
+#define LOX_MAX_PEEPHOLE_PASSES 4
+
+static bool is_compare_jump(lox_op_code op);
+static int fuse(lox_chunk *chunk, int offset, bool *targets,
+                const lox_superinstruction **fused);
+static int *get_lines(lox_chunk *chunk);
+static void mark_switch_targets(lox_chunk *chunk, int offset, bool *targets);
+static void move_switch_targets(lox_chunk *chunk, int *new_offsets);
+static bool peephole_pass(lox_chunk *chunk);
+
+int lox_optimize_peephole(lox_chunk *chunk) {
+  int size = chunk->code.size;
+  for (int i = 0; i < LOX_MAX_PEEPHOLE_PASSES && peephole_pass(chunk); i++)
+    ;
+  return size - chunk->code.size;
+}
+
+void lox_optimize_chunk(lox_chunk *chunk) {
+  int size = chunk->code.size;
+  int *lines = get_lines(chunk);
+  int *new_offsets = ALLOC_ARRAY(int, size + 1);
+  bool *targets = ALLOC_ARRAY(bool, size + 1);
+
+  // Instructions that are the destination of a jump can't be fused with the
+  // instruction before them.
+  for (int i = 0; i <= size; i++) {
+    targets[i] = false;
+  }
+  for (int i = 0; i < size; i += lox_chunk_instruction_length(chunk, i)) {
+    int target = lox_chunk_jump_target(chunk, i);
+    if (target == -1)
+      continue;
+    targets[target] = true;
+    // A fused compare-and-branch lands right after the OP_POP its OP_JMP_FALSE
+    // would have jumped to.
+    if (chunk->code.values[i] == OP_JMP_FALSE && target < size &&
+        chunk->code.values[target] == OP_POP) {
+      targets[target + 1] = true;
+    }
+  }
+  for (int i = 0; i < size; i += lox_chunk_instruction_length(chunk, i)) {
+    mark_switch_targets(chunk, i, targets);
+  }
+
+  lox_chunk optimized;
+  lox_chunk_initialize(&optimized);
+  // The jumps of the optimized chunk, as pairs of their offset in the optimized
+  // chunk and the offset of their destination in the original chunk.
+  lox_int_array jumps;
+  lox_int_array_initialize(&jumps);
+
+  for (int i = 0; i < size;) {
+    new_offsets[i] = optimized.code.size;
+    int length = lox_chunk_instruction_length(chunk, i);
+    const lox_superinstruction *fused;
+    int fused_length = fuse(chunk, i, targets, &fused);
+
+    if (fused_length == 0) {
+      int target = lox_chunk_jump_target(chunk, i);
+      if (target != -1) {
+        lox_int_array_push(&jumps, optimized.code.size);
+        lox_int_array_push(&jumps, target);
+      }
+      lox_chunk_write_array(&optimized, &chunk->code.values[i], length,
+                            lines[i]);
+      i += length;
+      continue;
+    }
+
+    int second = i + length;
+    int second_length = lox_chunk_instruction_length(chunk, second);
+    if (is_compare_jump(fused->fused)) {
+      lox_int_array_push(&jumps, optimized.code.size);
+      lox_int_array_push(&jumps, lox_chunk_jump_target(chunk, second) + 1);
+      uint8_t bytes[] = {fused->fused, 0, 0};
+      lox_chunk_write_array(&optimized, bytes, 3, lines[i]);
+    } else {
+      // The superinstruction takes the parameters of both instructions.
+      lox_chunk_write(&optimized, fused->fused, lines[i]);
+      lox_chunk_write_array(&optimized, &chunk->code.values[i + 1],
+                            length - 1, lines[i]);
+      lox_chunk_write_array(&optimized, &chunk->code.values[second + 1],
+                            second_length - 1, lines[i]);
+    }
+    for (int j = i + 1; j < i + fused_length; j++) {
+      new_offsets[j] = optimized.code.size;
+    }
+    i += fused_length;
+  }
+  new_offsets[size] = optimized.code.size;
+
+  for (int i = 0; i < jumps.size; i += 2) {
+    int jump = jumps.values[i];
+    int target = new_offsets[jumps.values[i + 1]];
+    int distance = optimized.code.values[jump] == OP_JMP_BACK
+                       ? jump + 3 - target
+                       : target - (jump + 3);
+    optimized.code.values[jump + 1] = (distance >> 8) & 0xff;
+    optimized.code.values[jump + 2] = distance & 0xff;
+  }
+
+  lox_byte_array_free(&chunk->code);
+  lox_int_array_free(&chunk->lines);
+  chunk->code = optimized.code;
+  chunk->lines = optimized.lines;
+  chunk->last_line = optimized.last_line;
+  move_switch_targets(chunk, new_offsets);
+
+  lox_int_array_free(&jumps);
+  FREE_ARRAY(bool, targets, size + 1);
+  FREE_ARRAY(int, new_offsets, size + 1);
+  FREE_ARRAY(int, lines, size);
+}
+
+// Marks the cases of the switch instruction at the given offset, if it is one,
+// as targets.
+static void mark_switch_targets(lox_chunk *chunk, int offset, bool *targets) {
+  lox_switch_table *table = lox_chunk_switch_table(chunk, offset);
+  for (int i = 0; table != NULL && i < table->targets.size; i++) {
+    targets[table->targets.values[i]] = true;
+  }
+}
+
+// Updates the cases of the switch tables of a chunk once its instructions have
+// moved, given the new offset of each old one.
+static void move_switch_targets(lox_chunk *chunk, int *new_offsets) {
+  for (int i = 0; i < chunk->switches.size; i++) {
+    lox_int_array *targets = &chunk->switches.values[i].targets;
+    for (int j = 0; j < targets->size; j++) {
+      targets->values[j] = new_offsets[targets->values[j]];
+    }
+  }
+}
+
+// Returns the line of each byte of the chunk, which has to be freed with a size
+// of chunk->code.size.
+static int *get_lines(lox_chunk *chunk) {
+  int size = chunk->code.size;
+  int *lines = ALLOC_ARRAY(int, size);
+  int offset = 0;
+  for (int line = 0; line < chunk->lines.size; line++) {
+    for (int i = 0; i < chunk->lines.values[line] && offset < size; i++) {
+      lines[offset++] = line + 1;
+    }
+  }
+  return lines;
+}
+
+static bool is_conditional_jump(lox_op_code op) {
+  return op == OP_JMP_FALSE || op == OP_JMP_TRUE;
+}
+
+static bool is_jump(lox_op_code op) {
+  return op == OP_JMP || op == OP_JMP_BACK || is_conditional_jump(op);
+}
+
+// Instructions that push a value without any other effect, and can't fail.
+static bool is_pure_push(lox_op_code op) {
+  return op == OP_CONSTANT || op == OP_CONSTANT_LONG || op == OP_NIL ||
+         op == OP_TRUE || op == OP_FALSE || op == OP_GET_LOCAL ||
+         op == OP_GET_UPVALUE || op == OP_GET_CAPTURE || op == OP_DUP;
+}
+
+// Returns the instruction that loads what the given instruction stores, or
+// OP_INVALID.
+static lox_op_code get_of_set(lox_op_code op) {
+  switch (op) {
+  case OP_SET_LOCAL:
+    return OP_GET_LOCAL;
+  case OP_SET_UPVALUE:
+    return OP_GET_UPVALUE;
+  case OP_SET_GLOBAL:
+    return OP_GET_GLOBAL;
+  case OP_SET_GLOBAL_LONG:
+    return OP_GET_GLOBAL_LONG;
+  default:
+    return OP_INVALID;
+  }
+}
+
+static int pop_count(uint8_t *code) {
+  if (code[0] == OP_POP)
+    return 1;
+  if (code[0] == OP_POPN)
+    return code[1] << 8 | code[2];
+  return 0;
+}
+
+// Returns where the jump at the given offset ends up, once it has gone through
+// the jumps it lands on. Unconditional jumps are followed. A conditional jump
+// that lands on another one tests the same value, so it knows whether that
+// one jumps too. Conditional jumps can only go forward, and no jump can go
+// further than its operand allows.
+static int thread_jump(lox_chunk *chunk, int offset) {
+  uint8_t *code = chunk->code.values;
+  lox_op_code op = code[offset];
+  int target = lox_chunk_jump_target(chunk, offset);
+  int destination = target;
+
+  for (int i = 0; i < LOX_MAX_THREADED_JUMPS && target < chunk->code.size;
+       i++) {
+    lox_op_code next = code[target];
+    if (next == OP_JMP || next == OP_JMP_BACK ||
+        (is_conditional_jump(op) && next == op)) {
+      target = lox_chunk_jump_target(chunk, target);
+    } else if (is_conditional_jump(op) && is_conditional_jump(next)) {
+      target += 3;
+    } else {
+      break;
+    }
+
+    int distance = target - (offset + 3);
+    if (distance > UINT16_MAX || -distance > UINT16_MAX)
+      break;
+    if (!is_conditional_jump(op) || target > offset)
+      destination = target;
+  }
+  return destination;
+}
+
+// Goes over the chunk once, threading jumps and removing the instructions that
+// can't run or have no effect. Returns whether the chunk changed.
+static bool peephole_pass(lox_chunk *chunk) {
+  uint8_t *code = chunk->code.values;
+  int size = chunk->code.size;
+  // The destination of each jump, indexed by the offset of the jump.
+  int *destinations = ALLOC_ARRAY(int, size);
+  // Whether each instruction can run, and then whether it is removed.
+  bool *reachable = ALLOC_ARRAY(bool, size);
+  bool *removed = ALLOC_ARRAY(bool, size);
+  bool *targets = ALLOC_ARRAY(bool, size + 1);
+  // The opcode that replaces each instruction, or OP_INVALID to keep it.
+  uint8_t *replacements = ALLOC_ARRAY(uint8_t, size);
+  // The number of values the POPN that replaces a sequence of pops pops.
+  int *pops = ALLOC_ARRAY(int, size);
+  // The OP_POPs an OP_JMP_FALSE lands on. They aren't merged with the pops
+  // after them, so that lox_optimize_chunk can fuse the branch with the
+  // comparison before it.
+  bool *branch_pops = ALLOC_ARRAY(bool, size);
+  for (int i = 0; i < size; i++) {
+    reachable[i] = false;
+    removed[i] = false;
+    targets[i] = false;
+    replacements[i] = OP_INVALID;
+    pops[i] = 0;
+    branch_pops[i] = false;
+  }
+  targets[size] = false;
+
+  bool changed = false;
+  for (int i = 0; i < size; i += lox_chunk_instruction_length(chunk, i)) {
+    if (is_jump(code[i])) {
+      destinations[i] = thread_jump(chunk, i);
+      changed |= destinations[i] != lox_chunk_jump_target(chunk, i);
+    }
+  }
+
+  // Code that can't be reached from the start of the chunk is removed.
+  lox_int_array pending;
+  lox_int_array_initialize(&pending);
+  lox_int_array_push(&pending, 0);
+  reachable[0] = true;
+  while (pending.size > 0) {
+    int i = lox_int_array_pop(&pending);
+    int successors[] = {i + lox_chunk_instruction_length(chunk, i),
+                        is_jump(code[i]) ? destinations[i] : -1};
+    if (code[i] == OP_JMP || code[i] == OP_JMP_BACK || code[i] == OP_RETURN)
+      successors[0] = -1;
+    // A switch only goes to its cases.
+    lox_switch_table *table = lox_chunk_switch_table(chunk, i);
+    int successor_count = table != NULL ? table->targets.size : 2;
+    for (int j = 0; j < successor_count; j++) {
+      int successor =
+          table != NULL ? table->targets.values[j] : successors[j];
+      if (successor == -1 || successor >= size || reachable[successor])
+        continue;
+      reachable[successor] = true;
+      lox_int_array_push(&pending, successor);
+    }
+  }
+  lox_int_array_free(&pending);
+  for (int i = 0; i < size; i += lox_chunk_instruction_length(chunk, i)) {
+    removed[i] = !reachable[i];
+    changed |= removed[i];
+    if (reachable[i] && is_jump(code[i]))
+      targets[destinations[i]] = true;
+    if (reachable[i] && code[i] == OP_JMP_FALSE && destinations[i] < size &&
+        code[destinations[i]] == OP_POP)
+      branch_pops[destinations[i]] = true;
+    if (reachable[i])
+      mark_switch_targets(chunk, i, targets);
+  }
+
+  for (int i = 0; i < size; i += lox_chunk_instruction_length(chunk, i)) {
+    if (removed[i])
+      continue;
+    int next = i + lox_chunk_instruction_length(chunk, i);
+    bool has_next = next < size && !removed[next] && !targets[next];
+    int after =
+        has_next ? next + lox_chunk_instruction_length(chunk, next) : size;
+
+    if (is_jump(code[i]) && destinations[i] == next) {
+      // A jump to the next instruction.
+      removed[i] = changed = true;
+    } else if (is_pure_push(code[i]) && has_next && code[next] == OP_POP) {
+      // A value that is discarded right away.
+      removed[i] = removed[next] = changed = true;
+    } else if (get_of_set(code[i]) != OP_INVALID && has_next &&
+               code[next] == OP_POP && after < size && !targets[after] &&
+               code[after] == get_of_set(code[i]) &&
+               memcmp(&code[i + 1], &code[after + 1], next - i - 1) == 0) {
+      // Loading a variable right after storing it, and discarding what was
+      // stored: the stored value is still on the stack.
+      removed[next] = removed[after] = changed = true;
+    } else if (code[i] == OP_NOT && has_next &&
+               is_conditional_jump(code[next]) && after < size &&
+               code[after] == OP_POP && destinations[next] < size &&
+               code[destinations[next]] == OP_POP) {
+      // Branching on the negation of a value that both paths pop.
+      removed[i] = changed = true;
+      replacements[next] =
+          code[next] == OP_JMP_FALSE ? OP_JMP_TRUE : OP_JMP_FALSE;
+    } else if (pop_count(&code[i]) > 0 && !branch_pops[i]) {
+      // A sequence of pops becomes a single one, when it doesn't get longer.
+      int count = pop_count(&code[i]);
+      int end = next;
+      while (end < size && !removed[end] && !targets[end] &&
+             pop_count(&code[end]) > 0 &&
+             count + pop_count(&code[end]) <= UINT16_MAX) {
+        count += pop_count(&code[end]);
+        end += lox_chunk_instruction_length(chunk, end);
+      }
+      if (end != next && end - i >= 3) {
+        pops[i] = count;
+        changed = true;
+        for (int j = next; j < end; j += lox_chunk_instruction_length(chunk, j))
+          removed[j] = true;
+      }
+    }
+  }
+
+  if (!changed) {
+    FREE_ARRAY(int, destinations, size);
+    FREE_ARRAY(bool, reachable, size);
+    FREE_ARRAY(bool, removed, size);
+    FREE_ARRAY(bool, targets, size + 1);
+    FREE_ARRAY(uint8_t, replacements, size);
+    FREE_ARRAY(int, pops, size);
+    FREE_ARRAY(bool, branch_pops, size);
+    return false;
+  }
+
+  int *lines = get_lines(chunk);
+  int *new_offsets = ALLOC_ARRAY(int, size + 1);
+  lox_chunk optimized;
+  lox_chunk_initialize(&optimized);
+  // See lox_optimize_chunk.
+  lox_int_array jumps;
+  lox_int_array_initialize(&jumps);
+
+  for (int i = 0; i < size; i += lox_chunk_instruction_length(chunk, i)) {
+    new_offsets[i] = optimized.code.size;
+    if (removed[i])
+      continue;
+
+    int length = lox_chunk_instruction_length(chunk, i);
+    if (pops[i] > 0) {
+      uint8_t bytes[] = {OP_POPN, (pops[i] >> 8) & 0xff, pops[i] & 0xff};
+      lox_chunk_write_array(&optimized, bytes, 3, lines[i]);
+    } else if (is_jump(code[i])) {
+      uint8_t op = replacements[i] != OP_INVALID ? replacements[i] : code[i];
+      if (!is_conditional_jump(op))
+        op = destinations[i] > i ? OP_JMP : OP_JMP_BACK;
+      lox_int_array_push(&jumps, optimized.code.size);
+      lox_int_array_push(&jumps, destinations[i]);
+      uint8_t bytes[] = {op, 0, 0};
+      lox_chunk_write_array(&optimized, bytes, 3, lines[i]);
+    } else {
+      lox_chunk_write_array(&optimized, &code[i], length, lines[i]);
+    }
+  }
+  new_offsets[size] = optimized.code.size;
+
+  for (int i = 0; i < jumps.size; i += 2) {
+    int jump = jumps.values[i];
+    int target = new_offsets[jumps.values[i + 1]];
+    int distance = optimized.code.values[jump] == OP_JMP_BACK
+                       ? jump + 3 - target
+                       : target - (jump + 3);
+    optimized.code.values[jump + 1] = (distance >> 8) & 0xff;
+    optimized.code.values[jump + 2] = distance & 0xff;
+  }
+
+  lox_byte_array_free(&chunk->code);
+  lox_int_array_free(&chunk->lines);
+  chunk->code = optimized.code;
+  chunk->lines = optimized.lines;
+  chunk->last_line = optimized.last_line;
+  move_switch_targets(chunk, new_offsets);
+
+  lox_int_array_free(&jumps);
+  FREE_ARRAY(int, new_offsets, size + 1);
+  FREE_ARRAY(int, lines, size);
+  FREE_ARRAY(int, destinations, size);
+  FREE_ARRAY(bool, reachable, size);
+  FREE_ARRAY(bool, removed, size);
+  FREE_ARRAY(bool, targets, size + 1);
+  FREE_ARRAY(uint8_t, replacements, size);
+  FREE_ARRAY(int, pops, size);
+  FREE_ARRAY(bool, branch_pops, size);
+  return true;
+}
+
+static bool is_compare_jump(lox_op_code op) {
+  return op >= OP_EQ_JMP_FALSE && op <= OP_LESSEQ_JMP_FALSE;
+}
+
+// Checks whether the instructions at the given offset can be replaced by a
+// superinstruction. If they can, `fused` is set to the superinstruction, and
+// the number of bytes it replaces is returned. Otherwise, this returns 0.
+static int fuse(lox_chunk *chunk, int offset, bool *targets,
+                const lox_superinstruction **fused) {
+  uint8_t *code = chunk->code.values;
+  int size = chunk->code.size;
+  int second = offset + lox_chunk_instruction_length(chunk, offset);
+  if (second >= size || targets[second])
+    return 0;
+
+  for (const lox_superinstruction *s = superinstructions;
+       s->fused != OP_INVALID; s++) {
+    if (code[offset] != s->first || code[second] != s->second)
+      continue;
+
+    int end = second + lox_chunk_instruction_length(chunk, second);
+    if (is_compare_jump(s->fused)) {
+      // The condition has to be popped on both paths, so that the fused
+      // instruction can skip pushing it altogether.
+      int target = lox_chunk_jump_target(chunk, second);
+      if (end >= size || code[end] != OP_POP || targets[end] ||
+          target >= size || code[target] != OP_POP)
+        continue;
+      end++;
+    }
+
+    *fused = s;
+    return end - offset;
+  }
+
+  return 0;
+}
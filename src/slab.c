@@ -0,0 +1,212 @@
+#include "slab.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POISON(ptr, size) ASAN_POISON_MEMORY_REGION(ptr, size)
+#define UNPOISON(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+#define POISON(ptr, size) ((void)(ptr), (void)(size))
+#define UNPOISON(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+// A free block, which is linked to the next free block of its slab.
+typedef struct lox_slab_block {
+  struct lox_slab_block *next;
+} lox_slab_block;
+
+// The header at the start of every slab. Since slabs are aligned to their
+// size, the slab of a block is found by clearing the low bits of its address.
+typedef struct lox_slab {
+  struct lox_slab *prev;
+  struct lox_slab *next;
+  // The blocks that were freed, and the offset of the first block that was
+  // never allocated.
+  lox_slab_block *free;
+  int bump;
+  int block_size;
+  int used;
+  int size_class;
+  bool is_full;
+
+  // The blocks freed by the thread that sweeps, and the next slab that has
+  // some, which are only touched by that thread until lox_slab_flush.
+  lox_slab_block *pending;
+  lox_slab_block *pending_last;
+  int pending_count;
+  struct lox_slab *next_pending;
+} lox_slab;
+
+#define FIRST_BLOCK                                                            \
+  ((int)((sizeof(lox_slab) + LOX_SLAB_GRANULE - 1) & ~(LOX_SLAB_GRANULE - 1)))
+
+// The slabs of a size class, which are either partial, that is they have a
+// block left, or full. A slab is released once all of its blocks are free,
+// unless it is the last partial one.
+typedef struct lox_slab_class {
+  lox_slab *partial;
+  lox_slab *full;
+} lox_slab_class;
+
+static lox_slab_class classes[LOX_SLAB_CLASS_COUNT];
+static lox_slab *pending_slabs;
+
+static inline int class_of(size_t size) {
+  return (size - 1) / LOX_SLAB_GRANULE;
+}
+
+static inline lox_slab *slab_of(void *ptr) {
+  return (lox_slab *)((uintptr_t)ptr & ~(uintptr_t)(LOX_SLAB_SIZE - 1));
+}
+
+static void unlink_slab(lox_slab **list, lox_slab *slab) {
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+}
+
+static void link_slab(lox_slab **list, lox_slab *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list != NULL)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+static lox_slab *new_slab(int size_class) {
+  lox_slab *slab = aligned_alloc(LOX_SLAB_SIZE, LOX_SLAB_SIZE);
+  if (slab == NULL)
+    exit(1);
+  slab->free = NULL;
+  slab->bump = FIRST_BLOCK;
+  slab->block_size = (size_class + 1) * LOX_SLAB_GRANULE;
+  slab->used = 0;
+  slab->size_class = size_class;
+  slab->is_full = false;
+  slab->pending = NULL;
+  slab->pending_last = NULL;
+  slab->pending_count = 0;
+  slab->next_pending = NULL;
+  POISON((char *)slab + FIRST_BLOCK, LOX_SLAB_SIZE - FIRST_BLOCK);
+  link_slab(&classes[size_class].partial, slab);
+  return slab;
+}
+
+static void release_slab(lox_slab *slab) {
+  unlink_slab(&classes[slab->size_class].partial, slab);
+  UNPOISON((char *)slab + FIRST_BLOCK, LOX_SLAB_SIZE - FIRST_BLOCK);
+  free(slab);
+}
+
+// Called once blocks were given back to a slab, which can make it partial or
+// empty.
+static void slab_freed(lox_slab *slab) {
+  lox_slab_class *class = &classes[slab->size_class];
+  if (slab->is_full) {
+    slab->is_full = false;
+    unlink_slab(&class->full, slab);
+    link_slab(&class->partial, slab);
+  }
+  // An empty slab is kept if it's the only partial one, so that a class which
+  // is used for a single object at a time doesn't allocate a slab each time.
+  if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL))
+    release_slab(slab);
+}
+
+void *lox_slab_alloc(size_t size) {
+  int size_class = class_of(size);
+  lox_slab_class *class = &classes[size_class];
+  lox_slab *slab = class->partial;
+  if (slab == NULL)
+    slab = new_slab(size_class);
+
+  void *block;
+  if (slab->free != NULL) {
+    UNPOISON(slab->free, slab->block_size);
+    block = slab->free;
+    slab->free = slab->free->next;
+  } else {
+    block = (char *)slab + slab->bump;
+    UNPOISON(block, slab->block_size);
+    slab->bump += slab->block_size;
+  }
+  slab->used++;
+
+  if (slab->free == NULL && slab->bump + slab->block_size > LOX_SLAB_SIZE) {
+    slab->is_full = true;
+    unlink_slab(&class->partial, slab);
+    link_slab(&class->full, slab);
+  }
+  return block;
+}
+
+void lox_slab_free(void *ptr, size_t size) {
+  lox_slab *slab = slab_of(ptr);
+  assert(slab->size_class == class_of(size));
+  (void)size;
+
+  lox_slab_block *block = ptr;
+  block->next = slab->free;
+  slab->free = block;
+  POISON(block, slab->block_size);
+  slab->used--;
+  slab_freed(slab);
+}
+
+void lox_slab_free_deferred(void *ptr, size_t size) {
+  lox_slab *slab = slab_of(ptr);
+  assert(slab->size_class == class_of(size));
+  (void)size;
+
+  lox_slab_block *block = ptr;
+  block->next = slab->pending;
+  if (slab->pending == NULL) {
+    slab->pending_last = block;
+    slab->next_pending = pending_slabs;
+    pending_slabs = slab;
+  }
+  slab->pending = block;
+  slab->pending_count++;
+  POISON(block, slab->block_size);
+}
+
+void lox_slab_flush() {
+  while (pending_slabs != NULL) {
+    lox_slab *slab = pending_slabs;
+    pending_slabs = slab->next_pending;
+
+    UNPOISON(slab->pending_last, sizeof(lox_slab_block));
+    slab->pending_last->next = slab->free;
+    POISON(slab->pending_last, slab->block_size);
+    slab->free = slab->pending;
+    slab->used -= slab->pending_count;
+    slab->pending = NULL;
+    slab->pending_last = NULL;
+    slab->pending_count = 0;
+    slab->next_pending = NULL;
+    slab_freed(slab);
+  }
+}
+
+void lox_slab_free_all() {
+  for (int i = 0; i < LOX_SLAB_CLASS_COUNT; i++) {
+    lox_slab *lists[] = {classes[i].partial, classes[i].full};
+    for (int j = 0; j < 2; j++) {
+      lox_slab *slab = lists[j];
+      while (slab != NULL) {
+        lox_slab *next = slab->next;
+        UNPOISON((char *)slab + FIRST_BLOCK, LOX_SLAB_SIZE - FIRST_BLOCK);
+        free(slab);
+        slab = next;
+      }
+    }
+    classes[i].partial = NULL;
+    classes[i].full = NULL;
+  }
+  pending_slabs = NULL;
+}
@@ -20,7 +20,7 @@ void lox_hash_table_free(lox_hash_table *table) {
 void lox_hash_table_copy_to(lox_hash_table *from, lox_hash_table *to) {
   for (int i = 0; i < from->capacity; i++) {
     lox_hash_table_entry entry = from->entries[i];
-    if (entry.key.type != VAL_EMPTY) {
+    if (!lox_value_is_empty(entry.key)) {
       lox_hash_table_put(to, entry.key, entry.value);
     }
   }
@@ -33,10 +33,10 @@ bool lox_hash_table_put(lox_hash_table *table, lox_value key, lox_value value) {
   }
 
   lox_hash_table_entry *entry = lox_hash_table_find_entry(table->entries, table->capacity, key);
-  bool is_new_key = entry->key.type == VAL_EMPTY;
+  bool is_new_key = lox_value_is_empty(entry->key);
   // Only increment the count if the entry is not a tombstone entry, because
   // removing entries does not decrease the count
-  if (is_new_key && entry->value.type == VAL_NIL)
+  if (is_new_key && lox_value_is_nil(entry->value))
     table->count++;
 
   entry->key = key;
@@ -50,7 +50,7 @@ bool lox_hash_table_remove(lox_hash_table *table, lox_value key) {
     return false;
 
   lox_hash_table_entry *entry = lox_hash_table_find_entry(table->entries, table->capacity, key);
-  if (entry->key.type == VAL_EMPTY)
+  if (lox_value_is_empty(entry->key))
     return false;
 
   entry->key = lox_value_from_empty();
@@ -65,7 +65,7 @@ bool lox_hash_table_get(lox_hash_table *table, lox_value key, lox_value *value)
     return false;
 
   lox_hash_table_entry *entry = lox_hash_table_find_entry(table->entries, table->capacity, key);
-  if (entry->key.type == VAL_EMPTY)
+  if (lox_value_is_empty(entry->key))
     return false;
 
   if (value != NULL)
@@ -82,7 +82,7 @@ lox_hash_table_entry *lox_hash_table_find_entry(lox_hash_table_entry *entries, i
   if (capacity == 0)
     return NULL;
 
-  assert(key.type != VAL_EMPTY);
+  assert(!lox_value_is_empty(key));
 
   // This only works instead of the modulo operator because we know that capacity is a power of 2
   int index = lox_value_hash(key) & (capacity - 1);
@@ -90,10 +90,10 @@ lox_hash_table_entry *lox_hash_table_find_entry(lox_hash_table_entry *entries, i
 
   while (true) {
     lox_hash_table_entry *entry = &entries[index];
-    if (entry->key.type == VAL_EMPTY) {
-      if (entry->value.type == VAL_NIL) {
+    if (lox_value_is_empty(entry->key)) {
+      if (lox_value_is_nil(entry->value)) {
         return tombstone == NULL ? entry : tombstone;
-      } else if (entry->value.type == VAL_BOOL && entry->value.as.boolean == true &&
+      } else if (lox_value_is_bool(entry->value) && lox_value_as_bool(entry->value) == true &&
                  tombstone == NULL) {
         tombstone = entry;
       }
@@ -116,14 +116,14 @@ lox_object_string *lox_hash_table_find_string(lox_hash_table *table, const char
 
   while (true) {
     lox_hash_table_entry *entry = &table->entries[index];
-    if (entry->key.type == VAL_EMPTY) {
+    if (lox_value_is_empty(entry->key)) {
       // If the entry is not a tombstone and is empty, that means we haven't
       // found anything.
-      if (entry->value.type == VAL_NIL) {
+      if (lox_value_is_nil(entry->value)) {
         return NULL;
       }
     } else if (lox_value_is_string(entry->key)) {
-      lox_object_string *str = (lox_object_string *)entry->key.as.object;
+      lox_object_string *str = (lox_object_string *)lox_value_as_object(entry->key);
       if (str->length == length && str->hash == hash && memcmp(str->chars, chars, length) == 0) {
         return str;
       }
@@ -143,7 +143,7 @@ void lox_hash_table_resize(lox_hash_table *table, int new_capacity) {
   table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
     lox_hash_table_entry entry = table->entries[i];
-    if (entry.key.type == VAL_EMPTY)
+    if (lox_value_is_empty(entry.key))
       continue;
 
     lox_hash_table_entry *new_entry = lox_hash_table_find_entry(entries, new_capacity, entry.key);
@@ -160,7 +160,13 @@ void lox_hash_table_resize(lox_hash_table *table, int new_capacity) {
 void lox_hash_table_remove_white(lox_hash_table *table) {
   for (int i = 0; i < table->capacity; i++) {
     lox_hash_table_entry entry = table->entries[i];
-    if (entry.key.type != VAL_EMPTY && entry.key.as.object->is_marked != vm.mark_value) {
+    if (lox_value_is_empty(entry.key))
+      continue;
+    lox_object *key = lox_value_as_object(entry.key);
+    // A collection of the young generation doesn't mark old strings.
+    if (vm.collecting_young && key->is_old)
+      continue;
+    if (key->is_marked != vm.mark_value) {
       lox_hash_table_remove(table, entry.key);
     }
   }
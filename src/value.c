@@ -9,17 +9,14 @@
 DEFINE_LOX_ARRAY(lox_value, value_array);
 
 void lox_print_value(lox_value value) {
-  switch (value.type) {
-  case VAL_BOOL:
-    printf("%s", value.as.boolean ? "true" : "false");
-    break;
-  case VAL_NIL:
+  if (lox_value_is_bool(value)) {
+    printf("%s", lox_value_as_bool(value) ? "true" : "false");
+  } else if (lox_value_is_nil(value)) {
     printf("nil");
-    break;
-  case VAL_NUMBER: {
+  } else if (lox_value_is_number(value)) {
     char *buf;
     int len;
-    if ((len = asprintf(&buf, "%f", value.as.number)) == -1) {
+    if ((len = asprintf(&buf, "%f", lox_value_as_number(value))) == -1) {
       runtime_error(
           "An internal error occurred while trying to print a number.");
     }
@@ -39,46 +36,21 @@ void lox_print_value(lox_value value) {
       len = previous_digit_index + 1;
     printf("%.*s", len, buf);
     free(buf);
-    break;
-  }
-  case VAL_OBJECT:
-    lox_print_object(value.as.object);
-    break;
-  case VAL_EMPTY:
+  } else if (lox_value_is_object(value)) {
+    lox_print_object(lox_value_as_object(value));
+  } else if (lox_value_is_empty(value)) {
     printf("EMPTY");
-    break;
   }
 }
 
-inline lox_value lox_value_from_bool(bool val) {
-  return (lox_value){VAL_BOOL, {.boolean = val}};
-}
-
-inline lox_value lox_value_from_nil() {
-  return (lox_value){VAL_NIL, {.number = 0}};
-}
-
-inline lox_value lox_value_from_number(double val) {
-  return (lox_value){VAL_NUMBER, {.number = val}};
-}
-
-inline lox_value lox_value_from_object(lox_object *object) {
-  return (lox_value){VAL_OBJECT, {.object = object}};
-}
-
-inline lox_value lox_value_from_empty() {
-  return (lox_value){VAL_EMPTY, {.number = 0}};
-}
-
 uint32_t lox_value_hash(lox_value value) {
-  switch (value.type) {
-  case VAL_BOOL:
-    return value.as.boolean;
-  case VAL_NIL:
+  if (lox_value_is_bool(value)) {
+    return lox_value_as_bool(value);
+  } else if (lox_value_is_nil(value)) {
     return 3;
-  case VAL_NUMBER:
-    return lox_value_hash_number(value.as.number);
-  case VAL_OBJECT:
+  } else if (lox_value_is_number(value)) {
+    return lox_value_hash_number(lox_value_as_number(value));
+  } else if (lox_value_is_object(value)) {
     // If this is a string, we can use the cached hash. If we don't have any
     // hash function provided, we just pass the pointer to the object. This can
     // result in getting the same hash for different objects, since uint32_t is
@@ -87,16 +59,14 @@ uint32_t lox_value_hash(lox_value value) {
     // generalized to every object, given that a lox_object does not contain
     // much information.
     if (lox_value_is_string(value))
-      return ((lox_object_string *)value.as.object)->hash;
+      return ((lox_object_string *)lox_value_as_object(value))->hash;
     else
       // We cast to intptr_t first so that clangd doesn't complain about
       // uint32_t being smaller than the pointer address. I don't know if this
       // actually makes a difference.
-      return (uint32_t)(intptr_t)value.as.object;
-  case VAL_EMPTY:
-  default:
-    return 0;
+      return (uint32_t)(intptr_t)lox_value_as_object(value);
   }
+  return 0;
 }
 
 uint32_t lox_value_hash_number(double number) {
@@ -109,35 +79,3 @@ uint32_t lox_value_hash_number(double number) {
   cast.value = (number) + 1.0;
   return cast.ints[0] + cast.ints[1];
 }
-
-inline bool lox_value_is_object(lox_value value) {
-  return value.type == VAL_OBJECT;
-}
-
-inline bool lox_value_is_string(lox_value value) {
-  return lox_value_is_object(value) && value.as.object->type == OBJ_STRING;
-}
-
-inline bool lox_value_is_function(lox_value value) {
-  return lox_value_is_object(value) && value.as.object->type == OBJ_FUNCTION;
-}
-
-inline bool lox_value_is_native(lox_value value) {
-  return lox_value_is_object(value) && value.as.object->type == OBJ_NATIVE;
-}
-
-inline bool lox_value_is_closure(lox_value value) {
-  return lox_value_is_object(value) && value.as.object->type == OBJ_CLOSURE;
-}
-
-inline bool lox_value_is_upvalue(lox_value value) {
-  return lox_value_is_object(value) && value.as.object->type == OBJ_UPVALUE;
-}
-
-inline bool lox_value_is_class(lox_value value) {
-  return lox_value_is_object(value) && value.as.object->type == OBJ_CLASS;
-}
-
-inline bool lox_value_is_instance(lox_value value) {
-  return lox_value_is_object(value) && value.as.object->type == OBJ_INSTANCE;
-}
@@ -1,8 +1,10 @@
 #include "vm.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "native/native.h"
 #include "object.h"
+#include "slab.h"
 #include "value.h"
 #include "chunk.h"
 #include "compiler.h"
@@ -13,20 +15,40 @@
 #include <stdlib.h>
 #include <string.h>
 
-static void free_objects();
+static void free_objects(lox_object *objects);
 
 static void reset_stack();
+static void reserve_stack(int size);
 static lox_value *peek(int n);
 static bool call_value(lox_value value, int arg_count);
+static bool call_cached(lox_value value, int arg_count, lox_call_cache *cache);
 static bool call_closure(lox_object_closure *closure, int arg_count);
+static bool push_frame(lox_object_closure *closure, int arg_count);
+static void replace_caller_frame(int frame_count);
 static lox_object_upvalue *capture_upvalue(lox_value *local);
 static void close_upvalues(lox_value *last);
-static void define_method(lox_value name);
-static bool invoke(lox_value name, int argc);
-static bool invoke_from_class(lox_object_class *clazz, lox_value name,
+static void define_method(uint16_t selector);
+static bool invoke(uint16_t selector, int argc, lox_inline_cache *cache);
+static bool invoke_from_class(lox_object_class *clazz, uint16_t selector,
                               int argc);
-static bool bind_method(lox_object_class *clazz, lox_value name);
+static bool bind_method(lox_object_class *clazz, uint16_t selector);
+static void bind_closure(lox_object_closure *method);
+static bool get_property(lox_object_instance *inst, uint16_t selector,
+                         lox_inline_cache *cache);
+static void set_property(lox_object_instance *inst, uint16_t selector,
+                         lox_value value, lox_inline_cache *cache);
+static const char *selector_name(uint16_t selector);
+static lox_inline_cache_entry *inline_cache_add(lox_inline_cache *cache,
+                                                lox_object_class *clazz,
+                                                lox_object_shape *shape);
 static void print_settings();
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_instruction(lox_call_frame *frame, uint8_t *ip);
+#endif
+#ifdef LOX_PROFILE_OPCODE_PAIRS
+static void profile_instruction(uint8_t instruction);
+static void dump_opcode_pairs();
+#endif
 
 lox_vm vm;
 
@@ -37,44 +59,73 @@ void init_vm() {
 
   vm.bytes_allocated = 0;
   vm.next_gc = 1024 * 1024;
+  vm.next_young_gc = LOX_GC_YOUNG_SIZE;
   lox_value_array_initialize(&vm.stack);
   lox_value_array_resize(&vm.stack, LOX_INITIAL_STACK_SIZE);
+  vm.frames = ALLOC_ARRAY(lox_call_frame, LOX_INITIAL_CALL_FRAMES);
+  vm.frame_capacity = LOX_INITIAL_CALL_FRAMES;
   lox_hash_table_init(&vm.strings);
   lox_hash_table_init(&vm.global_indices);
   lox_value_array_initialize(&vm.globals);
+  lox_hash_table_init(&vm.selector_indices);
+  lox_value_array_initialize(&vm.selectors);
 #ifndef NDEBUG
   lox_hash_table_init(&vm.global_names);
   lox_hash_table_init(&vm.local_names);
 #endif
   vm.objects = NULL;
+  vm.young_objects = NULL;
   vm.open_upvalues = NULL;
   vm.gray_capacity = 0;
   vm.gray_size = 0;
   vm.gray_stack = NULL;
+  vm.remembered_capacity = 0;
+  vm.remembered_size = 0;
+  vm.remembered = NULL;
+  vm.collecting_young = false;
+  vm.gc_phase = LOX_GC_IDLE;
+  vm.sweeping = NULL;
+#ifdef LOX_GC_THREAD
+  vm.sweeper_running = false;
+#endif
   vm.frame_count = 0;
   vm.mark_value = true;
-  vm.init_string = lox_value_from_object(
-      (lox_object *)lox_object_string_new_copy("init", 4));
+  vm.root_shape = NULL;
+  vm.init_selector = lox_intern_selector(lox_value_from_object(
+      (lox_object *)lox_object_string_new_copy("init", 4)));
+  vm.root_shape = lox_object_shape_new(NULL, lox_value_from_empty());
   reset_stack();
 
   define_natives(&vm);
 }
 
 void free_vm() {
+  lox_gc_finish();
   lox_value_array_free(&vm.stack);
+  FREE_ARRAY(lox_call_frame, vm.frames, vm.frame_capacity);
   lox_hash_table_free(&vm.strings);
   lox_hash_table_free(&vm.global_indices);
   lox_value_array_free(&vm.globals);
+  lox_hash_table_free(&vm.selector_indices);
+  lox_value_array_free(&vm.selectors);
 #ifndef NDEBUG
   lox_hash_table_free(&vm.global_names);
   lox_hash_table_free(&vm.local_names);
 #endif
-  free_objects();
+#ifdef DEBUG_PRINT_INLINE_CACHES
+  lox_print_function_caches(vm.objects, false);
+  lox_print_function_caches(vm.young_objects, false);
+#endif
+  free_objects(vm.objects);
+  free_objects(vm.young_objects);
+  free_objects(vm.sweeping);
   free(vm.gray_stack);
+  free(vm.remembered);
+  lox_slab_free_all();
 }
 
-static void free_objects() {
-  lox_object *curr = vm.objects;
+static void free_objects(lox_object *objects) {
+  lox_object *curr = objects;
   while (curr != NULL) {
     lox_object *tmp = curr->next;
     lox_object_free(curr);
@@ -85,9 +136,30 @@ static void free_objects() {
 static void reset_stack() {
   vm.stack.size = 0;
   vm.frame_count = 0;
+#ifdef LOX_JIT
+  lox_jit_reset();
+#endif
+}
+
+// Makes room for at least `size` values on the stack. Open upvalues point into
+// the stack, so they have to be moved along with it when it is reallocated.
+static void reserve_stack(int size) {
+  if (size <= vm.stack.capacity)
+    return;
+
+  lox_value *previous = vm.stack.values;
+  lox_value_array_grow_to(&vm.stack, size, 0);
+  for (lox_object_upvalue *upvalue = vm.open_upvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = vm.stack.values + (upvalue->location - previous);
+  }
 }
 
-inline void push(lox_value value) { lox_value_array_push(&vm.stack, value); }
+inline void push(lox_value value) {
+  if (vm.stack.size >= vm.stack.capacity)
+    reserve_stack(vm.stack.size + 1);
+  vm.stack.values[vm.stack.size++] = value;
+}
 
 inline lox_value pop() { return lox_value_array_pop(&vm.stack); }
 
@@ -101,15 +173,15 @@ static inline lox_value peekv(int n) {
 
 static bool call_value(lox_value value, int arg_count) {
   if (lox_value_is_object(value)) {
-    switch (value.as.object->type) {
+    switch (lox_value_as_object(value)->type) {
     case OBJ_CLASS: {
-      lox_object_class *clazz = (lox_object_class *)value.as.object;
+      lox_object_class *clazz = (lox_object_class *)lox_value_as_object(value);
       vm.stack.values[vm.stack.size - arg_count - 1] =
           lox_value_from_object((lox_object *)lox_object_instance_new(clazz));
-      lox_value initializer;
-      if (lox_hash_table_get(clazz->methods, vm.init_string, &initializer)) {
-        return call_closure((lox_object_closure *)initializer.as.object,
-                            arg_count);
+      lox_object_closure *initializer =
+          lox_object_class_get_method(clazz, vm.init_selector);
+      if (initializer != NULL) {
+        return call_closure(initializer, arg_count);
       } else if (arg_count != 0) {
         runtime_error(
             "Expected 0 arguments to class initializer, found %i instead.",
@@ -119,10 +191,12 @@ static bool call_value(lox_value value, int arg_count) {
       return true;
     }
     case OBJ_CLOSURE: {
-      return call_closure((lox_object_closure *)value.as.object, arg_count);
+      return call_closure((lox_object_closure *)lox_value_as_object(value),
+                          arg_count);
     }
     case OBJ_NATIVE: {
-      lox_object_native *native = ((lox_object_native *)value.as.object);
+      lox_object_native *native =
+          ((lox_object_native *)lox_value_as_object(value));
       if (arg_count != native->arity) {
         runtime_error(
             "Native function '%s' expected %i arguments, found %i instead.",
@@ -136,7 +210,7 @@ static bool call_value(lox_value value, int arg_count) {
     }
     case OBJ_BOUND_METHOD: {
       lox_object_bound_method *bound =
-          (lox_object_bound_method *)value.as.object;
+          (lox_object_bound_method *)lox_value_as_object(value);
       vm.stack.values[vm.stack.size - arg_count - 1] = bound->receiver;
       return call_closure(bound->method, arg_count);
     }
@@ -149,6 +223,63 @@ static bool call_value(lox_value value, int arg_count) {
   return false;
 }
 
+// Calls a value through the cache of its call site. A hit goes straight to
+// what the callee resolved to the last time, and a miss makes a regular call,
+// after which the cache is refilled if the call succeeded.
+static bool call_cached(lox_value value, int arg_count, lox_call_cache *cache) {
+  if (lox_value_is_object(value) &&
+      lox_value_as_object(value) == cache->callee) {
+    cache->hits++;
+    switch (cache->callee->type) {
+    case OBJ_CLOSURE:
+      return push_frame(cache->as.closure, arg_count);
+    case OBJ_CLASS: {
+      lox_object_class *clazz = (lox_object_class *)cache->callee;
+      vm.stack.values[vm.stack.size - arg_count - 1] =
+          lox_value_from_object((lox_object *)lox_object_instance_new(clazz));
+      return cache->as.closure == NULL ||
+             push_frame(cache->as.closure, arg_count);
+    }
+    default: {
+      lox_value ret = cache->as.native(arg_count, peek(arg_count - 1));
+      vm.stack.size -= (arg_count + 1);
+      push(ret);
+      return true;
+    }
+    }
+  }
+
+  cache->misses++;
+  // The cache belongs to the function that is running, which has to be
+  // remembered before the call pushes another frame.
+  lox_gc_remember(
+      (lox_object *)vm.frames[vm.frame_count - 1].closure->function);
+  if (!call_value(value, arg_count))
+    return false;
+  if (!lox_value_is_object(value))
+    return true;
+  lox_object *callee = lox_value_as_object(value);
+  switch (callee->type) {
+  case OBJ_CLOSURE:
+    cache->callee = callee;
+    cache->as.closure = (lox_object_closure *)callee;
+    break;
+  case OBJ_CLASS:
+    cache->callee = callee;
+    cache->as.closure =
+        lox_object_class_get_method((lox_object_class *)callee,
+                                    vm.init_selector);
+    break;
+  case OBJ_NATIVE:
+    cache->callee = callee;
+    cache->as.native = ((lox_object_native *)callee)->function;
+    break;
+  default:
+    break;
+  }
+  return true;
+}
+
 static bool call_closure(lox_object_closure *closure, int arg_count) {
   lox_object_function *fun = closure->function;
   if (arg_count != fun->arity) {
@@ -156,20 +287,71 @@ static bool call_closure(lox_object_closure *closure, int arg_count) {
                   fun->name->chars, fun->arity, arg_count);
     return false;
   }
+  return push_frame(closure, arg_count);
+}
 
+// Pushes a frame for a call whose arity has already been checked.
+static bool push_frame(lox_object_closure *closure, int arg_count) {
+  lox_object_function *fun = closure->function;
   if (vm.frame_count >= LOX_MAX_CALL_FRAMES) {
     runtime_error("Stack overflow. Cannot have more than %i call frames.",
                   LOX_MAX_CALL_FRAMES);
     return false;
   }
 
+  int slots_offset = vm.stack.size - arg_count - 1;
+  if (slots_offset + fun->max_stack_size > LOX_MAX_STACK_SIZE) {
+    runtime_error("Stack overflow. Cannot have more than %i values on the "
+                  "stack.",
+                  LOX_MAX_STACK_SIZE);
+    return false;
+  }
+
+  if (vm.frame_count == vm.frame_capacity) {
+    int capacity = GROW_CAPACITY(vm.frame_capacity);
+    if (capacity > LOX_MAX_CALL_FRAMES)
+      capacity = LOX_MAX_CALL_FRAMES;
+    vm.frames = GROW_ARRAY(lox_call_frame, vm.frames, vm.frame_capacity,
+                           capacity);
+    vm.frame_capacity = capacity;
+  }
+
   lox_call_frame *frame = &vm.frames[vm.frame_count++];
   frame->closure = closure;
   frame->ip = fun->chunk.code.values;
-  frame->slots_offset = vm.stack.size - arg_count - 1;
+  frame->slots_offset = slots_offset;
+#ifdef LOX_JIT
+  if (fun->jit == NULL && fun->hotness++ == LOX_JIT_THRESHOLD)
+    lox_jit_compile(fun);
+  frame->jit_entry = fun->jit != NULL ? frame->ip : NULL;
+#endif
+  // This is the only place where the stack grows while running lox code, which
+  // is what allows instructions to push values without checking for room.
+  reserve_stack(slots_offset + fun->max_stack_size);
   return true;
 }
 
+// Called after a call in tail position. If it pushed a frame, that frame takes
+// the place of the frame that made the call, so that the callee returns
+// straight to our caller. Otherwise the call is already done, and its result
+// is returned by the OP_RETURN that follows it.
+static void replace_caller_frame(int frame_count) {
+  if (vm.frame_count == frame_count)
+    return;
+
+  lox_call_frame *caller = &vm.frames[vm.frame_count - 2];
+  lox_call_frame *callee = &vm.frames[vm.frame_count - 1];
+  lox_value *slots = vm.stack.values + caller->slots_offset;
+  int size = vm.stack.size - callee->slots_offset;
+  close_upvalues(slots);
+  memmove(slots, vm.stack.values + callee->slots_offset,
+          sizeof(lox_value) * size);
+  vm.stack.size = caller->slots_offset + size;
+  callee->slots_offset = caller->slots_offset;
+  *caller = *callee;
+  vm.frame_count--;
+}
+
 static lox_object_upvalue *capture_upvalue(lox_value *local) {
   lox_object_upvalue *previous_upvalue = NULL;
   lox_object_upvalue *val = vm.open_upvalues;
@@ -196,33 +378,11 @@ static void close_upvalues(lox_value *last) {
     lox_object_upvalue *upvalue = vm.open_upvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    lox_gc_write_barrier((lox_object *)upvalue, upvalue->closed);
     vm.open_upvalues = upvalue->next;
   }
 }
 
-bool lox_is_falsey(lox_value value) {
-  return value.type == VAL_NIL ||
-         (value.type == VAL_BOOL && value.as.boolean == false);
-}
-
-bool lox_values_equal(lox_value lhs, lox_value rhs) {
-  if (lhs.type != rhs.type)
-    return false;
-  switch (lhs.type) {
-  case VAL_BOOL:
-    return lhs.as.boolean == rhs.as.boolean;
-  case VAL_NIL:
-    return true;
-  case VAL_NUMBER:
-    return lhs.as.number == rhs.as.number;
-  case VAL_OBJECT: {
-    return lhs.as.object == rhs.as.object;
-  }
-  default:
-    return false;
-  }
-}
-
 interpret_result interpret(const char *source) {
   lox_object_function *function = lox_compiler_compile(source);
   if (function == NULL)
@@ -234,24 +394,62 @@ interpret_result interpret(const char *source) {
   push(lox_value_from_object((lox_object *)closure));
   call_closure(closure, 0);
 
+#ifdef LOX_PROFILE_OPCODE_PAIRS
+  interpret_result result = run();
+  dump_opcode_pairs();
+  return result;
+#else
   return run();
+#endif
 }
 
 interpret_result run() {
   lox_call_frame *frame = &vm.frames[vm.frame_count - 1];
-  // We store this in a register because this variable is used very frequently
-  // from many instructions. Since we're caching the value, we have to update it
-  // every time the frame changes, that is, every time we push or pop a frame,
-  // which usually means every time we call a function or method, or return from
-  // one.
+  // We store these in registers because they are used very frequently from
+  // many instructions. Since we're caching them, we have to update them every
+  // time the frame changes, that is, every time we push or pop a frame, which
+  // usually means every time we call a function or method, or return from one.
   register uint8_t *ip = frame->ip;
+  // The top of the stack, which is the source of truth for the size of the
+  // stack while instructions run: vm.stack.size is only up to date once
+  // STORE_STACK has been called. This has to happen before anything that reads
+  // the stack from outside of run, like calls, allocations, which can collect
+  // garbage, and errors, and the stack has to be loaded back with LOAD_STACK
+  // after anything that can push, pop or move it.
+  register lox_value *sp = vm.stack.values + vm.stack.size;
+  // The first slot of the frame, and the constants of its function.
+  lox_value *slots = vm.stack.values + frame->slots_offset;
+  lox_value *constants = frame->closure->function->chunk.constants.values;
 
+#define STORE_STACK() (vm.stack.size = sp - vm.stack.values)
+#define LOAD_STACK()                                                           \
+  do {                                                                         \
+    sp = vm.stack.values + vm.stack.size;                                      \
+    slots = vm.stack.values + frame->slots_offset;                             \
+  } while (false)
+// Picks up the frame on top of the call stack, once it has changed.
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frame_count - 1];                                    \
+    ip = frame->ip;                                                            \
+    constants = frame->closure->function->chunk.constants.values;              \
+    LOAD_STACK();                                                              \
+  } while (false)
 #define READ_BYTE() (*ip++)
+// The stack has room for every value pushed by the current function, since it
+// was reserved by call_closure.
+#define PUSH(value)                                                            \
+  do {                                                                         \
+    lox_value pushed = (value);                                                \
+    *sp++ = pushed;                                                            \
+  } while (false)
+#define PEEK(n) (sp[-1 - (n)])
 #define READ_SHORT() (ip += 2, (uint16_t)(ip[-2] << 8 | ip[-1]))
-#define READ_CONST()                                                           \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_CONST_LONG()                                                      \
-  (frame->closure->function->chunk.constants.values[READ_SHORT()])
+#define READ_CONST() (constants[READ_BYTE()])
+#define READ_CONST_LONG() (constants[READ_SHORT()])
+#define READ_SELECTOR() READ_SHORT()
+#define READ_CACHE()                                                           \
+  (&frame->closure->function->chunk.caches.values[READ_SHORT()])
 #define RUNTIME_ERROR(fmt)                                                     \
   do {                                                                         \
     frame->ip = ip;                                                            \
@@ -265,416 +463,904 @@ interpret_result run() {
     return INTERPRET_RUNTIME_ERROR;                                            \
   } while (0)
 
-#define BINARY_OP(make_value, op)                                              \
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()                                                    \
   do {                                                                         \
-    lox_value rhs = peekv(0);                                                  \
-    lox_value lhs = peekv(1);                                                  \
-    if (lhs.type == VAL_NUMBER && rhs.type == VAL_NUMBER) {                    \
-      vm.stack.values[vm.stack.size - 2] =                                     \
-          make_value(lhs.as.number op rhs.as.number);                          \
-      vm.stack.size--;                                                         \
+    STORE_STACK();                                                             \
+    trace_instruction(frame, ip);                                              \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+  } while (false)
+#endif
+
+#ifdef LOX_PROFILE_OPCODE_PAIRS
+#define PROFILE_INSTRUCTION() profile_instruction(*ip)
+#else
+#define PROFILE_INSTRUCTION()                                                  \
+  do {                                                                         \
+  } while (false)
+#endif
+
+// Hands the frame over to the native code of its function when the interpreter
+// reaches the instruction the native code expects to resume at, see
+// lox_jit_run, and records the instructions of the loop being traced.
+#ifdef LOX_JIT
+#define ENTER_JIT()                                                            \
+  do {                                                                         \
+    if (ip == frame->jit_entry) {                                              \
+      STORE_STACK();                                                           \
+      ip = lox_jit_run(frame, ip);                                             \
+      LOAD_STACK();                                                            \
+    }                                                                          \
+    if (lox_jit_recording) {                                                   \
+      STORE_STACK();                                                           \
+      lox_jit_record(frame, ip);                                               \
+    }                                                                          \
+  } while (false)
+#else
+#define ENTER_JIT()                                                            \
+  do {                                                                         \
+  } while (false)
+#endif
+
+#define COMPARE_JMP_FALSE(op)                                                  \
+  do {                                                                         \
+    uint16_t offset = READ_SHORT();                                            \
+    lox_value rhs = PEEK(0);                                                   \
+    lox_value lhs = PEEK(1);                                                   \
+    if (!lox_value_is_number(lhs) || !lox_value_is_number(rhs)) {              \
+      RUNTIME_ERROR("Operands must be numbers for '" #op "'.");                \
+    }                                                                          \
+    sp -= 2;                                                                   \
+    if (!(lox_value_as_number(lhs) op lox_value_as_number(rhs)))               \
+      ip += offset;                                                            \
+  } while (false)
+
+// Rewrites the instruction being executed, which must not have any operands,
+// into another one that behaves the same. See OP_ADD_NUM.
+#define QUICKEN(op) (ip[-1] = (op))
+// Rewrites the instruction being executed back into its generic version, and
+// executes it again.
+#define DEQUICKEN(op)                                                          \
+  do {                                                                         \
+    ip[-1] = (op);                                                             \
+    ip--;                                                                      \
+  } while (false)
+
+#define BINARY_OP(make_value, op, quickened)                                   \
+  do {                                                                         \
+    lox_value rhs = PEEK(0);                                                   \
+    lox_value lhs = PEEK(1);                                                   \
+    if (lox_value_is_number(lhs) && lox_value_is_number(rhs)) {                \
+      sp[-2] =                                                                 \
+          make_value(lox_value_as_number(lhs) op lox_value_as_number(rhs));    \
+      sp--;                                                                    \
+      QUICKEN(quickened);                                                      \
     } else {                                                                   \
       RUNTIME_ERROR("Operands must be numbers for '" #op "'.");                \
     }                                                                          \
   } while (false)
+#define BINARY_OP_NUM(make_value, op, generic)                                 \
+  do {                                                                         \
+    lox_value rhs = PEEK(0);                                                   \
+    lox_value lhs = PEEK(1);                                                   \
+    if (lox_value_is_number(lhs) && lox_value_is_number(rhs)) {                \
+      sp[-2] =                                                                 \
+          make_value(lox_value_as_number(lhs) op lox_value_as_number(rhs));    \
+      sp--;                                                                    \
+    } else {                                                                   \
+      DEQUICKEN(generic);                                                      \
+    }                                                                          \
+  } while (false)
 
-  for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("%-10s", "STACK");
-    for (int i = 0; i < vm.stack.size; i++) {
-      printf("[ ");
-      lox_print_value(vm.stack.values[i]);
-      printf(" ]");
-    }
-    printf("\n");
-    lox_disassemble_instruction(
-        &frame->closure->function->chunk,
-        ip - frame->closure->function->chunk.code.values);
-#endif
+  // With LOX_COMPUTED_GOTO, every handler ends by jumping straight to the
+  // handler of the next instruction through `dispatch_table`, which gives each
+  // opcode its own indirect branch instead of funneling every instruction
+  // through the single, hard to predict, branch of the switch. Otherwise, we
+  // fall back to a portable switch inside of an infinite loop.
+  uint8_t instruction;
+#ifdef LOX_COMPUTED_GOTO
+  static void *dispatch_table[256] = {
+      [0 ... 255] = &&op_unknown,
+#define DISPATCH_ENTRY(op) [op] = &&op_##op
+      DISPATCH_ENTRY(OP_CONSTANT),
+      DISPATCH_ENTRY(OP_CONSTANT_LONG),
+      DISPATCH_ENTRY(OP_NIL),
+      DISPATCH_ENTRY(OP_TRUE),
+      DISPATCH_ENTRY(OP_FALSE),
+      DISPATCH_ENTRY(OP_EQ),
+      DISPATCH_ENTRY(OP_NEQ),
+      DISPATCH_ENTRY(OP_GREATER),
+      DISPATCH_ENTRY(OP_GREATEREQ),
+      DISPATCH_ENTRY(OP_LESS),
+      DISPATCH_ENTRY(OP_LESSEQ),
+      DISPATCH_ENTRY(OP_NEGATE),
+      DISPATCH_ENTRY(OP_NOT),
+      DISPATCH_ENTRY(OP_ADD),
+      DISPATCH_ENTRY(OP_SUBTRACT),
+      DISPATCH_ENTRY(OP_MULTIPLY),
+      DISPATCH_ENTRY(OP_DIVIDE),
+      DISPATCH_ENTRY(OP_MODULO),
+      DISPATCH_ENTRY(OP_ADD_NUM),
+      DISPATCH_ENTRY(OP_SUBTRACT_NUM),
+      DISPATCH_ENTRY(OP_MULTIPLY_NUM),
+      DISPATCH_ENTRY(OP_DIVIDE_NUM),
+      DISPATCH_ENTRY(OP_MODULO_NUM),
+      DISPATCH_ENTRY(OP_GREATER_NUM),
+      DISPATCH_ENTRY(OP_GREATEREQ_NUM),
+      DISPATCH_ENTRY(OP_LESS_NUM),
+      DISPATCH_ENTRY(OP_LESSEQ_NUM),
+      DISPATCH_ENTRY(OP_PRINT),
+      DISPATCH_ENTRY(OP_POP),
+      DISPATCH_ENTRY(OP_POPN),
+      DISPATCH_ENTRY(OP_DEFINE_GLOBAL),
+      DISPATCH_ENTRY(OP_DEFINE_GLOBAL_LONG),
+      DISPATCH_ENTRY(OP_GET_GLOBAL),
+      DISPATCH_ENTRY(OP_GET_GLOBAL_LONG),
+      DISPATCH_ENTRY(OP_SET_GLOBAL),
+      DISPATCH_ENTRY(OP_SET_GLOBAL_LONG),
+      DISPATCH_ENTRY(OP_GET_LOCAL),
+      DISPATCH_ENTRY(OP_SET_LOCAL),
+      DISPATCH_ENTRY(OP_GET_UPVALUE),
+      DISPATCH_ENTRY(OP_SET_UPVALUE),
+      DISPATCH_ENTRY(OP_GET_CAPTURE),
+      DISPATCH_ENTRY(OP_CLOSE_UPVALUE),
+      DISPATCH_ENTRY(OP_JMP_TRUE),
+      DISPATCH_ENTRY(OP_JMP_FALSE),
+      DISPATCH_ENTRY(OP_JMP),
+      DISPATCH_ENTRY(OP_JMP_BACK),
+      DISPATCH_ENTRY(OP_SWITCH_TABLE),
+      DISPATCH_ENTRY(OP_SWITCH_HASH),
+      DISPATCH_ENTRY(OP_DUP),
+      DISPATCH_ENTRY(OP_CALL),
+      DISPATCH_ENTRY(OP_TAIL_CALL),
+      DISPATCH_ENTRY(OP_CLOSURE),
+      DISPATCH_ENTRY(OP_CLASS),
+      DISPATCH_ENTRY(OP_SET_PROPERTY),
+      DISPATCH_ENTRY(OP_GET_PROPERTY),
+      DISPATCH_ENTRY(OP_METHOD),
+      DISPATCH_ENTRY(OP_INVOKE),
+      DISPATCH_ENTRY(OP_TAIL_INVOKE),
+      DISPATCH_ENTRY(OP_INHERIT),
+      DISPATCH_ENTRY(OP_GET_SUPER),
+      DISPATCH_ENTRY(OP_SUPER_INVOKE),
+      DISPATCH_ENTRY(OP_TAIL_SUPER_INVOKE),
+      DISPATCH_ENTRY(OP_RETURN),
+      DISPATCH_ENTRY(OP_GET_LOCAL_GET_LOCAL),
+      DISPATCH_ENTRY(OP_GET_LOCAL_CONSTANT),
+      DISPATCH_ENTRY(OP_GET_LOCAL_GET_PROPERTY),
+      DISPATCH_ENTRY(OP_EQ_JMP_FALSE),
+      DISPATCH_ENTRY(OP_NEQ_JMP_FALSE),
+      DISPATCH_ENTRY(OP_GREATER_JMP_FALSE),
+      DISPATCH_ENTRY(OP_GREATEREQ_JMP_FALSE),
+      DISPATCH_ENTRY(OP_LESS_JMP_FALSE),
+      DISPATCH_ENTRY(OP_LESSEQ_JMP_FALSE),
+#undef DISPATCH_ENTRY
+  };
 
-    uint8_t instruction;
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    ENTER_JIT();                                                               \
+    TRACE_INSTRUCTION();                                                       \
+    PROFILE_INSTRUCTION();                                                     \
+    goto *dispatch_table[instruction = READ_BYTE()];                           \
+  } while (false)
+#define CASE(op) op_##op
+#define DEFAULT op_unknown
+#define NEXT DISPATCH()
+
+  DISPATCH();
+  // These blocks stand in for the loop and the switch of the portable version,
+  // so that both versions share the same handlers.
+  {
+    {
+#else
+#define CASE(op) case op
+#define DEFAULT default
+#define NEXT break
+
+  for (;;) {
+    ENTER_JIT();
+    TRACE_INSTRUCTION();
+    PROFILE_INSTRUCTION();
     switch (instruction = READ_BYTE()) {
-    case OP_RETURN: {
-      close_upvalues(vm.stack.values + frame->slots_offset);
+#endif
+    CASE(OP_RETURN): {
+      close_upvalues(slots);
       vm.frame_count--;
       // This indicates the end of the program
       if (vm.frame_count == 0) {
-        pop();
+        vm.stack.size = sp - vm.stack.values - 1;
         return INTERPRET_OK;
       }
-      vm.stack.values[frame->slots_offset] = vm.stack.values[vm.stack.size - 1];
-      vm.stack.size = frame->slots_offset + 1;
-      frame = &vm.frames[vm.frame_count - 1];
-      ip = frame->ip;
-      break;
+      slots[0] = sp[-1];
+      vm.stack.size = slots - vm.stack.values + 1;
+      LOAD_FRAME();
+      NEXT;
     }
-    case OP_NIL:
-      push(lox_value_from_nil());
-      break;
-    case OP_TRUE:
-      push(lox_value_from_bool(true));
-      break;
-    case OP_FALSE:
-      push(lox_value_from_bool(false));
-      break;
-    case OP_EQ: {
-      lox_value rhs = peekv(0);
-      lox_value lhs = peekv(1);
-      vm.stack.values[vm.stack.size - 2] =
+    CASE(OP_NIL):
+      PUSH(lox_value_from_nil());
+      NEXT;
+    CASE(OP_TRUE):
+      PUSH(lox_value_from_bool(true));
+      NEXT;
+    CASE(OP_FALSE):
+      PUSH(lox_value_from_bool(false));
+      NEXT;
+    CASE(OP_EQ): {
+      lox_value rhs = PEEK(0);
+      lox_value lhs = PEEK(1);
+      sp[-2] =
           lox_value_from_bool(lox_values_equal(rhs, lhs));
-      vm.stack.size--;
-      break;
+      sp--;
+      NEXT;
     }
-    case OP_NEQ: {
-      lox_value rhs = peekv(0);
-      lox_value lhs = peekv(1);
-      vm.stack.values[vm.stack.size - 2] =
+    CASE(OP_NEQ): {
+      lox_value rhs = PEEK(0);
+      lox_value lhs = PEEK(1);
+      sp[-2] =
           lox_value_from_bool(!lox_values_equal(rhs, lhs));
-      vm.stack.size--;
-      break;
+      sp--;
+      NEXT;
     }
-    case OP_GREATER:
-      BINARY_OP(lox_value_from_bool, >);
-      break;
-    case OP_GREATEREQ:
-      BINARY_OP(lox_value_from_bool, >=);
-      break;
-    case OP_LESS:
-      BINARY_OP(lox_value_from_bool, <);
-      break;
-    case OP_LESSEQ:
-      BINARY_OP(lox_value_from_bool, <=);
-      break;
-    case OP_NEGATE: {
-      lox_value value = peekv(0);
-      if (value.type == VAL_NUMBER) {
-        vm.stack.values[vm.stack.size - 1] =
-            lox_value_from_number(-value.as.number);
+    CASE(OP_GREATER):
+      BINARY_OP(lox_value_from_bool, >, OP_GREATER_NUM);
+      NEXT;
+    CASE(OP_GREATEREQ):
+      BINARY_OP(lox_value_from_bool, >=, OP_GREATEREQ_NUM);
+      NEXT;
+    CASE(OP_LESS):
+      BINARY_OP(lox_value_from_bool, <, OP_LESS_NUM);
+      NEXT;
+    CASE(OP_LESSEQ):
+      BINARY_OP(lox_value_from_bool, <=, OP_LESSEQ_NUM);
+      NEXT;
+    CASE(OP_NEGATE): {
+      lox_value value = PEEK(0);
+      if (lox_value_is_number(value)) {
+        sp[-1] =
+            lox_value_from_number(-lox_value_as_number(value));
       } else {
         RUNTIME_ERROR("Operand must be a number.");
       }
-      break;
+      NEXT;
     }
-    case OP_NOT: {
-      lox_value value = peekv(0);
+    CASE(OP_NOT): {
+      lox_value value = PEEK(0);
       bool f = lox_is_falsey(value);
-      vm.stack.values[vm.stack.size - 1] = lox_value_from_bool(f);
-      break;
+      sp[-1] = lox_value_from_bool(f);
+      NEXT;
     }
-    case OP_ADD: {
-      lox_value rhs = peekv(0);
-      lox_value lhs = peekv(1);
+    CASE(OP_ADD): {
+      lox_value rhs = PEEK(0);
+      lox_value lhs = PEEK(1);
       if (lox_value_is_string(lhs) && lox_value_is_string(rhs)) {
-        lox_object_string *rstr = (lox_object_string *)(rhs.as.object);
-        lox_object_string *lstr = (lox_object_string *)(lhs.as.object);
+        lox_object_string *rstr = (lox_object_string *)lox_value_as_object(rhs);
+        lox_object_string *lstr = (lox_object_string *)lox_value_as_object(lhs);
         int length = lstr->length + rstr->length;
+        // The operands stay on the stack while the result is allocated.
+        STORE_STACK();
         char *chars = ALLOC_ARRAY(char, length + 1);
         memcpy(chars, lstr->chars, lstr->length);
         memcpy(chars + lstr->length, rstr->chars, rstr->length);
         chars[length] = '\0';
-        vm.stack.values[vm.stack.size - 2] = lox_value_from_object(
+        sp[-2] = lox_value_from_object(
             (lox_object *)lox_object_string_new_consume(chars, length, false));
-        vm.stack.size--;
-      } else if (lhs.type == VAL_NUMBER && rhs.type == VAL_NUMBER) {
-        vm.stack.values[vm.stack.size - 2] =
-            lox_value_from_number(lhs.as.number + rhs.as.number);
-        vm.stack.size--;
+        sp--;
+      } else if (lox_value_is_number(lhs) && lox_value_is_number(rhs)) {
+        sp[-2] =
+            lox_value_from_number(lox_value_as_number(lhs) +
+                                  lox_value_as_number(rhs));
+        sp--;
+        QUICKEN(OP_ADD_NUM);
       } else {
         RUNTIME_ERROR("Operands must be numbers or strings.");
       }
-      break;
+      NEXT;
     }
-    case OP_SUBTRACT:
-      BINARY_OP(lox_value_from_number, -);
-      break;
-    case OP_MULTIPLY:
-      BINARY_OP(lox_value_from_number, *);
-      break;
-    case OP_DIVIDE:
+    CASE(OP_SUBTRACT):
+      BINARY_OP(lox_value_from_number, -, OP_SUBTRACT_NUM);
+      NEXT;
+    CASE(OP_MULTIPLY):
+      BINARY_OP(lox_value_from_number, *, OP_MULTIPLY_NUM);
+      NEXT;
+    CASE(OP_DIVIDE):
       do {
-        lox_value rhs = peekv(0);
-        lox_value lhs = peekv(1);
-        if (lhs.type == VAL_NUMBER && rhs.type == VAL_NUMBER) {
-          if (rhs.as.number == 0) {
+        lox_value rhs = PEEK(0);
+        lox_value lhs = PEEK(1);
+        if (lox_value_is_number(lhs) && lox_value_is_number(rhs)) {
+          if (lox_value_as_number(rhs) == 0) {
             RUNTIME_ERROR("Cannot divide by zero.");
           }
-          vm.stack.values[vm.stack.size - 2] =
-              lox_value_from_number(lhs.as.number / rhs.as.number);
-          vm.stack.size--;
+          sp[-2] =
+              lox_value_from_number(lox_value_as_number(lhs) /
+                                    lox_value_as_number(rhs));
+          sp--;
+          QUICKEN(OP_DIVIDE_NUM);
         } else {
           RUNTIME_ERROR("Operands must be numbers.");
         }
       } while (0);
-      break;
-    case OP_MODULO:
+      NEXT;
+    CASE(OP_MODULO):
       do {
-        lox_value rhs = peekv(0);
-        lox_value lhs = peekv(1);
-        if (lhs.type == VAL_NUMBER && rhs.type == VAL_NUMBER) {
-          vm.stack.values[vm.stack.size - 2] =
-              lox_value_from_number(fmod(lhs.as.number, rhs.as.number));
-          vm.stack.size--;
+        lox_value rhs = PEEK(0);
+        lox_value lhs = PEEK(1);
+        if (lox_value_is_number(lhs) && lox_value_is_number(rhs)) {
+          sp[-2] =
+              lox_value_from_number(
+                  fmod(lox_value_as_number(lhs), lox_value_as_number(rhs)));
+          sp--;
+          QUICKEN(OP_MODULO_NUM);
         } else {
           RUNTIME_ERROR("Operands must be numbers.");
         }
       } while (0);
-      break;
-    case OP_PRINT:
-      lox_print_value(pop());
+      NEXT;
+    CASE(OP_ADD_NUM):
+      BINARY_OP_NUM(lox_value_from_number, +, OP_ADD);
+      NEXT;
+    CASE(OP_SUBTRACT_NUM):
+      BINARY_OP_NUM(lox_value_from_number, -, OP_SUBTRACT);
+      NEXT;
+    CASE(OP_MULTIPLY_NUM):
+      BINARY_OP_NUM(lox_value_from_number, *, OP_MULTIPLY);
+      NEXT;
+    CASE(OP_DIVIDE_NUM): {
+      lox_value rhs = PEEK(0);
+      lox_value lhs = PEEK(1);
+      // The generic version reports divisions by zero.
+      if (lox_value_is_number(lhs) && lox_value_is_number(rhs) &&
+          lox_value_as_number(rhs) != 0) {
+        sp[-2] = lox_value_from_number(
+            lox_value_as_number(lhs) / lox_value_as_number(rhs));
+        sp--;
+      } else {
+        DEQUICKEN(OP_DIVIDE);
+      }
+      NEXT;
+    }
+    CASE(OP_MODULO_NUM): {
+      lox_value rhs = PEEK(0);
+      lox_value lhs = PEEK(1);
+      if (lox_value_is_number(lhs) && lox_value_is_number(rhs)) {
+        sp[-2] = lox_value_from_number(
+            fmod(lox_value_as_number(lhs), lox_value_as_number(rhs)));
+        sp--;
+      } else {
+        DEQUICKEN(OP_MODULO);
+      }
+      NEXT;
+    }
+    CASE(OP_GREATER_NUM):
+      BINARY_OP_NUM(lox_value_from_bool, >, OP_GREATER);
+      NEXT;
+    CASE(OP_GREATEREQ_NUM):
+      BINARY_OP_NUM(lox_value_from_bool, >=, OP_GREATEREQ);
+      NEXT;
+    CASE(OP_LESS_NUM):
+      BINARY_OP_NUM(lox_value_from_bool, <, OP_LESS);
+      NEXT;
+    CASE(OP_LESSEQ_NUM):
+      BINARY_OP_NUM(lox_value_from_bool, <=, OP_LESSEQ);
+      NEXT;
+    CASE(OP_PRINT):
+      lox_print_value(*--sp);
       printf("\n");
-      break;
-    case OP_POP:
-      vm.stack.size--;
-      break;
-    case OP_POPN:
-      vm.stack.size -= READ_SHORT();
-      break;
-    case OP_CONSTANT: {
-      push(READ_CONST());
-      break;
+      NEXT;
+    CASE(OP_POP):
+      sp--;
+      NEXT;
+    CASE(OP_POPN):
+      sp -= READ_SHORT();
+      NEXT;
+    CASE(OP_CONSTANT): {
+      PUSH(READ_CONST());
+      NEXT;
     }
-    case OP_CONSTANT_LONG: {
-      push(READ_CONST_LONG());
-      break;
+    CASE(OP_CONSTANT_LONG): {
+      PUSH(READ_CONST_LONG());
+      NEXT;
     }
-    case OP_GET_GLOBAL_LONG:
-    case OP_GET_GLOBAL: {
+    CASE(OP_GET_GLOBAL_LONG):
+    CASE(OP_GET_GLOBAL): {
       int index = instruction == OP_GET_GLOBAL ? READ_BYTE() : READ_SHORT();
       assert(index < vm.globals.size);
 
       lox_value value = vm.globals.values[index];
-      if (value.type == VAL_EMPTY) {
+      if (lox_value_is_empty(value)) {
         RUNTIME_ERROR_ARGS(
             "Undefined variable '%s'.",
-            ((lox_object_string *)lox_get_global_name(index).as.object)->chars);
+            ((lox_object_string *)lox_value_as_object(
+                 lox_get_global_name(index)))
+                ->chars);
       }
 
-      push(value);
-      break;
+      PUSH(value);
+      NEXT;
     }
-    case OP_DEFINE_GLOBAL_LONG:
-    case OP_DEFINE_GLOBAL: {
+    CASE(OP_DEFINE_GLOBAL_LONG):
+    CASE(OP_DEFINE_GLOBAL): {
       vm.globals.values[instruction == OP_DEFINE_GLOBAL ? READ_BYTE()
-                                                        : READ_SHORT()] = pop();
-      break;
+                                                        : READ_SHORT()] = *--sp;
+      NEXT;
     }
-    case OP_SET_GLOBAL_LONG:
-    case OP_SET_GLOBAL: {
+    CASE(OP_SET_GLOBAL_LONG):
+    CASE(OP_SET_GLOBAL): {
       int index = instruction == OP_SET_GLOBAL ? READ_BYTE() : READ_SHORT();
       assert(index < vm.globals.size);
 
       lox_value value = vm.globals.values[index];
-      if (value.type == VAL_EMPTY) {
+      if (lox_value_is_empty(value)) {
         RUNTIME_ERROR_ARGS(
             "Undefined variable '%s'.",
-            ((lox_object_string *)lox_get_global_name(index).as.object)->chars);
+            ((lox_object_string *)lox_value_as_object(
+                 lox_get_global_name(index)))
+                ->chars);
       }
 
       // We don't pop the value because this is an expression, so it must return
       // a value, which is in this case the value we give to the global, so we
       // might aswell not touch the stack.
-      vm.globals.values[index] = *peek(0);
-      break;
+      vm.globals.values[index] = PEEK(0);
+      NEXT;
     }
-    case OP_GET_LOCAL: {
+    CASE(OP_GET_LOCAL): {
       uint8_t slot = READ_BYTE();
-      push(vm.stack.values[slot + frame->slots_offset]);
-      break;
+      PUSH(slots[slot]);
+      NEXT;
     }
-    case OP_SET_LOCAL: {
+    CASE(OP_SET_LOCAL): {
       uint8_t slot = READ_BYTE();
-      vm.stack.values[slot + frame->slots_offset] = *peek(0);
-      break;
+      slots[slot] = PEEK(0);
+      NEXT;
     }
-    case OP_GET_UPVALUE: {
+    CASE(OP_GET_UPVALUE): {
       uint8_t slot = READ_BYTE();
-      push(*frame->closure->upvalues[slot]->location);
-      break;
+      PUSH(*frame->closure->upvalues[slot]->location);
+      NEXT;
+    }
+    CASE(OP_GET_CAPTURE): {
+      uint8_t slot = READ_BYTE();
+      PUSH(lox_object_closure_captures(frame->closure)[slot]);
+      NEXT;
     }
-    case OP_SET_UPVALUE: {
+    CASE(OP_SET_UPVALUE): {
       uint8_t slot = READ_BYTE();
       // We don't want to change the pointer held by the current closure, since
       // that will disallow sharing the upvalue between closures. Instead, we
       // modify the value the pointer points to
-      *frame->closure->upvalues[slot]->location = peekv(0);
-      break;
+      lox_object_upvalue *upvalue = frame->closure->upvalues[slot];
+      *upvalue->location = PEEK(0);
+      lox_gc_write_barrier((lox_object *)upvalue, PEEK(0));
+      NEXT;
     }
-    case OP_CLOSE_UPVALUE: {
-      close_upvalues(vm.stack.values + vm.stack.size - 1);
-      vm.stack.size--;
-      break;
+    CASE(OP_CLOSE_UPVALUE): {
+      close_upvalues(sp - 1);
+      sp--;
+      NEXT;
     }
-    case OP_JMP_TRUE: {
+    CASE(OP_JMP_TRUE): {
       uint16_t offset = READ_SHORT();
-      if (!lox_is_falsey(peekv(0)))
+      if (!lox_is_falsey(PEEK(0)))
         ip += offset;
-      break;
+      NEXT;
     }
-    case OP_JMP_FALSE: {
+    CASE(OP_JMP_FALSE): {
       uint16_t offset = READ_SHORT();
-      if (lox_is_falsey(peekv(0)))
+      if (lox_is_falsey(PEEK(0)))
         ip += offset;
-      break;
+      NEXT;
     }
-    case OP_JMP: {
+    CASE(OP_JMP): {
       uint16_t offset = READ_SHORT();
       ip += offset;
-      break;
+      NEXT;
     }
-    case OP_JMP_BACK: {
+    CASE(OP_JMP_BACK): {
       uint16_t offset = READ_SHORT();
       ip -= offset;
-      break;
+#ifdef LOX_JIT
+      STORE_STACK();
+      ip = lox_jit_jump_back(frame, ip);
+      LOAD_STACK();
+#endif
+      NEXT;
     }
-    case OP_DUP:
-      push(peekv(0));
-      break;
-    case OP_CALL: {
+    CASE(OP_SWITCH_TABLE):
+    CASE(OP_SWITCH_HASH): {
+      lox_chunk *chunk = &frame->closure->function->chunk;
+      int offset = ip - 1 - chunk->code.values;
+      ip = chunk->code.values +
+           lox_chunk_switch_target(chunk, offset, PEEK(0));
+      NEXT;
+    }
+    CASE(OP_DUP):
+      PUSH(PEEK(0));
+      NEXT;
+    CASE(OP_CALL): {
       int arg_count = READ_BYTE();
+      lox_call_cache *cache =
+          &frame->closure->function->chunk.calls.values[READ_SHORT()];
       frame->ip = ip;
-      lox_value value = *peek(arg_count);
-      if (!call_value(value, arg_count)) {
+      STORE_STACK();
+      lox_value value = PEEK(arg_count);
+      if (!call_cached(value, arg_count, cache)) {
         return INTERPRET_RUNTIME_ERROR;
       }
       // If the function call was successful, update the call frame we read
       // from.
-      frame = &vm.frames[vm.frame_count - 1];
-      ip = frame->ip;
-      break;
+      LOAD_FRAME();
+      NEXT;
+    }
+    CASE(OP_TAIL_CALL): {
+      int arg_count = READ_BYTE();
+      lox_call_cache *cache =
+          &frame->closure->function->chunk.calls.values[READ_SHORT()];
+      frame->ip = ip;
+      lox_value value = PEEK(arg_count);
+      lox_object_closure *closure = NULL;
+      if (lox_value_is_closure(value)) {
+        closure = (lox_object_closure *)lox_value_as_object(value);
+      } else if (lox_value_is_bound_method(value)) {
+        lox_object_bound_method *bound =
+            (lox_object_bound_method *)lox_value_as_object(value);
+        PEEK(arg_count) = bound->receiver;
+        closure = bound->method;
+      }
+      STORE_STACK();
+
+      // Other callees, and calls that will fail, are made like a regular
+      // call, followed by the OP_RETURN after this instruction.
+      if (closure == NULL || closure->function->arity != arg_count) {
+        if (!call_cached(value, arg_count, cache)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        NEXT;
+      }
+
+      // Replace the current frame: the callee and its arguments take the place
+      // of the current function and its locals.
+      close_upvalues(slots);
+      memmove(slots, sp - arg_count - 1, sizeof(lox_value) * (arg_count + 1));
+      vm.stack.size = slots - vm.stack.values + arg_count + 1;
+      vm.frame_count--;
+      if (!push_frame(closure, arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      NEXT;
     }
-    case OP_CLOSURE: {
+    CASE(OP_CLOSURE): {
       lox_object_function *fun =
-          (lox_object_function *)(READ_CONST_LONG().as.object);
+          (lox_object_function *)(lox_value_as_object(READ_CONST_LONG()));
+      STORE_STACK();
       lox_object_closure *closure = lox_object_closure_new(fun);
-      for (int i = 0; i < closure->upvalue_count; i++) {
-        uint8_t is_local = READ_BYTE();
+      // Capturing an upvalue allocates, so the closure has to be reachable
+      // before that.
+      PUSH(lox_value_from_object((lox_object *)closure));
+      STORE_STACK();
+      lox_value *captures = lox_object_closure_captures(closure);
+      lox_value *enclosing_captures =
+          lox_object_closure_captures(frame->closure);
+      int upvalue = 0;
+      int capture = 0;
+      for (int i = 0; i < fun->upvalue_count + fun->capture_count; i++) {
+        uint8_t flags = READ_BYTE();
         uint16_t index = READ_SHORT();
-        if (is_local) {
-          closure->upvalues[i] =
-              capture_upvalue(vm.stack.values + frame->slots_offset + index);
-        } else {
-          closure->upvalues[i] = frame->closure->upvalues[index];
+        switch (flags) {
+        case LOX_CAPTURE_LOCAL:
+          closure->upvalues[upvalue++] = capture_upvalue(slots + index);
+          break;
+        case 0:
+          closure->upvalues[upvalue++] = frame->closure->upvalues[index];
+          break;
+        case LOX_CAPTURE_LOCAL | LOX_CAPTURE_VALUE:
+          captures[capture++] = slots[index];
+          break;
+        default:
+          captures[capture++] = enclosing_captures[index];
+          break;
         }
       }
-      push(lox_value_from_object((lox_object *)closure));
-      break;
+      // Capturing an upvalue can also promote the closure.
+      lox_gc_remember((lox_object *)closure);
+      NEXT;
     }
-    case OP_CLASS: {
+    CASE(OP_CLASS): {
       // NOTE: By doing this, we consider that classes are always globals, even
       // though they can be defined as locals (inside of a class or inside of a
       // function).
-      lox_object_string *name = (lox_object_string *)READ_CONST().as.object;
+      lox_object_string *name =
+          (lox_object_string *)lox_value_as_object(READ_CONST());
+      STORE_STACK();
       lox_object_class *clazz = lox_object_class_new(name);
-      push(lox_value_from_object((lox_object *)clazz));
-      break;
+      PUSH(lox_value_from_object((lox_object *)clazz));
+      NEXT;
     }
-    case OP_SET_PROPERTY: {
-      lox_value top = peekv(1);
+    CASE(OP_SET_PROPERTY): {
+      lox_value top = PEEK(1);
       if (!lox_value_is_instance(top)) {
         RUNTIME_ERROR("Cannot set property on object that isn't an instance.");
       }
 
-      lox_object_instance *instance = (lox_object_instance *)top.as.object;
-      lox_value name = READ_CONST();
-      lox_value val = peekv(0);
-      lox_hash_table_put(instance->fields, name, val);
+      lox_object_instance *instance =
+          (lox_object_instance *)lox_value_as_object(top);
+      uint16_t selector = READ_SELECTOR();
+      lox_inline_cache *cache = READ_CACHE();
+      lox_value val = PEEK(0);
+      lox_inline_cache_entry *entry = lox_inline_cache_find(cache, instance);
+      if (entry == NULL) {
+        STORE_STACK();
+        set_property(instance, selector, val, cache);
+      } else if (entry->as.transition != NULL) {
+        STORE_STACK();
+        lox_object_instance_transition(instance, entry->as.transition, val);
+      } else {
+        instance->slots[entry->slot] = val;
+        lox_gc_write_barrier((lox_object *)instance, val);
+      }
       // Pop the value, then the instance, and then push the value
-      vm.stack.size--;
-      vm.stack.values[vm.stack.size - 1] = val;
-      break;
+      sp--;
+      sp[-1] = val;
+      NEXT;
     }
-    case OP_GET_PROPERTY: {
-      lox_value top = peekv(0);
+    CASE(OP_GET_PROPERTY):
+    get_property: {
+      lox_value top = PEEK(0);
       if (!lox_value_is_instance(top)) {
         RUNTIME_ERROR("Cannot get property on object that isn't an instance.");
       }
 
-      lox_object_instance *instance = (lox_object_instance *)top.as.object;
-      lox_value name = READ_CONST();
-      lox_value val;
-
-      // First we check if a field with the name exists, then if nothing was
-      // found we look for a method.
-      if (lox_hash_table_get(instance->fields, name, &val)) {
-        // Pop the instance, and push the value
-        vm.stack.values[vm.stack.size - 1] = val;
-      } else {
-        if (!bind_method(instance->clazz, name)) {
+      lox_object_instance *instance =
+          (lox_object_instance *)lox_value_as_object(top);
+      uint16_t selector = READ_SELECTOR();
+      lox_inline_cache *cache = READ_CACHE();
+      lox_inline_cache_entry *entry = lox_inline_cache_find(cache, instance);
+      if (entry == NULL) {
+        frame->ip = ip;
+        STORE_STACK();
+        if (!get_property(instance, selector, cache)) {
           return INTERPRET_RUNTIME_ERROR;
         }
+      } else if (entry->slot != -1) {
+        // Pop the instance, and push the value
+        sp[-1] = instance->slots[entry->slot];
+      } else {
+        STORE_STACK();
+        bind_closure(entry->as.method);
       }
 
-      break;
+      NEXT;
     }
-    case OP_METHOD:
-      define_method(READ_CONST());
-      break;
-    case OP_INVOKE: {
-      lox_value name = READ_CONST();
+    CASE(OP_METHOD):
+      STORE_STACK();
+      define_method(READ_SELECTOR());
+      sp--;
+      NEXT;
+    CASE(OP_INVOKE):
+    CASE(OP_TAIL_INVOKE): {
+      bool is_tail = ip[-1] == OP_TAIL_INVOKE;
+      int frame_count = vm.frame_count;
+      uint16_t selector = READ_SELECTOR();
       uint8_t argc = READ_BYTE();
+      lox_inline_cache *cache = READ_CACHE();
       frame->ip = ip;
-      if (!invoke(name, argc)) {
+      STORE_STACK();
+
+      lox_value receiver = PEEK(argc);
+      lox_inline_cache_entry *entry = NULL;
+      if (lox_value_is_instance(receiver)) {
+        entry = lox_inline_cache_find(
+            cache, (lox_object_instance *)lox_value_as_object(receiver));
+      }
+
+      bool success;
+      if (entry == NULL) {
+        success = invoke(selector, argc, cache);
+      } else if (entry->slot == -1) {
+        success = call_closure(entry->as.method, argc);
+      } else {
+        // The field is called like a function, in place of the receiver.
+        lox_value value = ((lox_object_instance *)lox_value_as_object(receiver))
+                              ->slots[entry->slot];
+        PEEK(argc) = value;
+        success = call_value(value, argc);
+      }
+      if (!success) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frame_count - 1];
-      ip = frame->ip;
-      break;
+      if (is_tail)
+        replace_caller_frame(frame_count);
+      LOAD_FRAME();
+      NEXT;
     }
-    case OP_INHERIT: {
-      lox_value super = peekv(1);
+    CASE(OP_INHERIT): {
+      lox_value super = PEEK(1);
       if (!lox_value_is_class(super)) {
         RUNTIME_ERROR("Cannot inherit from object that is not a class.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      lox_object_class *superclass = (lox_object_class *)super.as.object;
-      lox_object_class *child = (lox_object_class *)peekv(0).as.object;
-      lox_hash_table_copy_to(superclass->methods, child->methods);
-      vm.stack.size--;
-      break;
+      lox_object_class *superclass =
+          (lox_object_class *)lox_value_as_object(super);
+      lox_object_class *child =
+          (lox_object_class *)lox_value_as_object(PEEK(0));
+      STORE_STACK();
+      lox_object_class_inherit(child, superclass);
+      sp--;
+      NEXT;
     }
-    case OP_GET_SUPER: {
-      lox_object_instance *inst_this =
-          (lox_object_instance *)peekv(1).as.object;
-      lox_object_class *class_super = (lox_object_class *)peekv(0).as.object;
-      lox_value name = READ_CONST();
-      lox_value val;
+    CASE(OP_GET_SUPER): {
+      // Pop the superclass, so that the method is bound to the instance below
+      // it.
+      lox_object_class *class_super = (lox_object_class *)lox_value_as_object(
+          *--sp);
+      uint16_t selector = READ_SELECTOR();
 
-      if (!bind_method(class_super, name)) {
+      frame->ip = ip;
+      STORE_STACK();
+      if (!bind_method(class_super, selector)) {
         return INTERPRET_RUNTIME_ERROR;
       }
 
-      break;
+      NEXT;
     }
-    case OP_SUPER_INVOKE: {
-      lox_value name = READ_CONST();
+    CASE(OP_SUPER_INVOKE):
+    CASE(OP_TAIL_SUPER_INVOKE): {
+      bool is_tail = ip[-1] == OP_TAIL_SUPER_INVOKE;
+      int frame_count = vm.frame_count;
+      uint16_t selector = READ_SELECTOR();
       uint8_t argc = READ_BYTE();
-      lox_object_class *class_super =
-          (lox_object_class *)vm.stack.values[--vm.stack.size].as.object;
+      lox_object_class *class_super = (lox_object_class *)lox_value_as_object(
+          *--sp);
 
       frame->ip = ip;
-      if (!invoke_from_class(class_super, name, argc)) {
+      STORE_STACK();
+      if (!invoke_from_class(class_super, selector, argc)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frame_count - 1];
-      ip = frame->ip;
-      break;
+      if (is_tail)
+        replace_caller_frame(frame_count);
+      LOAD_FRAME();
+      NEXT;
     }
-    default:
+    CASE(OP_GET_LOCAL_GET_LOCAL): {
+      uint8_t first = READ_BYTE();
+      uint8_t second = READ_BYTE();
+      PUSH(slots[first]);
+      PUSH(slots[second]);
+      NEXT;
+    }
+    CASE(OP_GET_LOCAL_CONSTANT): {
+      uint8_t slot = READ_BYTE();
+      PUSH(slots[slot]);
+      PUSH(READ_CONST());
+      NEXT;
+    }
+    CASE(OP_GET_LOCAL_GET_PROPERTY): {
+      uint8_t slot = READ_BYTE();
+      PUSH(slots[slot]);
+      // The remaining parameters are those of OP_GET_PROPERTY.
+      goto get_property;
+    }
+    CASE(OP_EQ_JMP_FALSE): {
+      uint16_t offset = READ_SHORT();
+      bool equal = lox_values_equal(PEEK(1), PEEK(0));
+      sp -= 2;
+      if (!equal)
+        ip += offset;
+      NEXT;
+    }
+    CASE(OP_NEQ_JMP_FALSE): {
+      uint16_t offset = READ_SHORT();
+      bool equal = lox_values_equal(PEEK(1), PEEK(0));
+      sp -= 2;
+      if (equal)
+        ip += offset;
+      NEXT;
+    }
+    CASE(OP_GREATER_JMP_FALSE):
+      COMPARE_JMP_FALSE(>);
+      NEXT;
+    CASE(OP_GREATEREQ_JMP_FALSE):
+      COMPARE_JMP_FALSE(>=);
+      NEXT;
+    CASE(OP_LESS_JMP_FALSE):
+      COMPARE_JMP_FALSE(<);
+      NEXT;
+    CASE(OP_LESSEQ_JMP_FALSE):
+      COMPARE_JMP_FALSE(<=);
+      NEXT;
+    DEFAULT:
       printf("Unknown instruction %i\n", instruction);
       return INTERPRET_RUNTIME_ERROR;
     }
   }
 
+#undef NEXT
+#undef DEFAULT
+#undef CASE
+#ifdef LOX_COMPUTED_GOTO
+#undef DISPATCH
+#endif
+#undef TRACE_INSTRUCTION
 #undef RUNTIME_ERROR_ARGS
 #undef RUNTIME_ERROR
 #undef READ_CONST_LONG
+#undef READ_SELECTOR
+#undef READ_CACHE
 #undef READ_CONST
 #undef READ_SHORT
 #undef READ_BYTE
+#undef PUSH
+#undef PEEK
+#undef STORE_STACK
+#undef LOAD_STACK
+#undef LOAD_FRAME
 #undef BINARY_OP
+#undef BINARY_OP_NUM
+#undef COMPARE_JMP_FALSE
+#undef PROFILE_INSTRUCTION
+#undef ENTER_JIT
+#undef QUICKEN
+#undef DEQUICKEN
 #undef CONST_OP
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_instruction(lox_call_frame *frame, uint8_t *ip) {
+  printf("%-10s", "STACK");
+  for (int i = 0; i < vm.stack.size; i++) {
+    printf("[ ");
+    lox_print_value(vm.stack.values[i]);
+    printf(" ]");
+  }
+  printf("\n");
+  lox_disassemble_instruction(&frame->closure->function->chunk,
+                              ip - frame->closure->function->chunk.code.values);
+}
+#endif
+
+#ifdef LOX_PROFILE_OPCODE_PAIRS
+// How many times each opcode was executed right after another one, indexed by
+// the first and then the second opcode.
+static uint64_t opcode_pairs[UINT8_MAX + 1][UINT8_MAX + 1];
+static int previous_opcode = -1;
+
+static void profile_instruction(uint8_t instruction) {
+  if (previous_opcode != -1)
+    opcode_pairs[previous_opcode][instruction]++;
+  previous_opcode = instruction;
+}
+
+// Appends the counts of the opcode pairs executed by the last script to the
+// file named by LOX_OPCODE_PAIRS_FILE, one "first second count" line per pair.
+// This is read by tools/superinstructions.py.
+static void dump_opcode_pairs() {
+  const char *path = getenv("LOX_OPCODE_PAIRS_FILE");
+  FILE *file = fopen(path != NULL ? path : "opcode-pairs.txt", "a");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open the opcode pairs file.\n");
+    return;
+  }
+
+  for (int first = 0; first <= UINT8_MAX; first++) {
+    for (int second = 0; second <= UINT8_MAX; second++) {
+      if (opcode_pairs[first][second] == 0)
+        continue;
+      fprintf(file, "%d %d %llu\n", first, second,
+              (unsigned long long)opcode_pairs[first][second]);
+      opcode_pairs[first][second] = 0;
+    }
+  }
+  previous_opcode = -1;
+  fclose(file);
+}
+#endif
+
 void runtime_error(const char *format, ...) {
   fprintf(stderr, "Runtime Error: ");
   va_list args;
@@ -722,66 +1408,195 @@ void define_native(lox_vm *vm, const char *name, lox_native_function function,
   pop();
 }
 
-static void define_method(lox_value name) {
-  lox_value method = peekv(0);
-  lox_object_class *clazz = (lox_object_class *)peekv(1).as.object;
-  lox_hash_table_put(clazz->methods, name, method);
+int lox_intern_selector(lox_value name) {
+  lox_value selector;
+  if (lox_hash_table_get(&vm.selector_indices, name, &selector)) {
+    return lox_value_as_number(selector);
+  }
+  if (vm.selectors.size > UINT16_MAX) {
+    return -1;
+  }
+
+  // The name might not be referenced anywhere else yet.
+  push(name);
+  lox_value_array_push(&vm.selectors, name);
+  lox_hash_table_put(&vm.selector_indices, name,
+                     lox_value_from_number(vm.selectors.size - 1));
+  pop();
+  return vm.selectors.size - 1;
+}
+
+static void define_method(uint16_t selector) {
+  lox_object_closure *method =
+      (lox_object_closure *)lox_value_as_object(peekv(0));
+  lox_object_class *clazz = (lox_object_class *)lox_value_as_object(peekv(1));
+  lox_object_class_set_method(clazz, selector, method);
   // Pop the method off the stack
   vm.stack.size--;
 }
 
-static bool invoke(lox_value name, int argc) {
+static bool invoke(uint16_t selector, int argc, lox_inline_cache *cache) {
   lox_value receiver = peekv(argc);
   if (!lox_value_is_instance(receiver)) {
     runtime_error("Cannot invoke method on object that isn't an instance.");
     return false;
   }
 
-  lox_object_instance *inst = (lox_object_instance *)receiver.as.object;
+  lox_object_instance *inst =
+      (lox_object_instance *)lox_value_as_object(receiver);
+  lox_value name = vm.selectors.values[selector];
   lox_value value;
-  if (lox_hash_table_get(inst->fields, name, &value)) {
+  if (inst->shape == NULL) {
+    if (lox_object_instance_get_field(inst, name, &value)) {
+      vm.stack.values[vm.stack.size - argc - 1] = value;
+      return call_value(value, argc);
+    }
+    return invoke_from_class(inst->clazz, selector, argc);
+  }
+
+  lox_inline_cache_entry *entry;
+  int slot = lox_object_shape_get_slot(inst->shape, name);
+  if (slot != -1) {
+    entry = inline_cache_add(cache, inst->clazz, inst->shape);
+    if (entry != NULL)
+      entry->slot = slot;
+    value = inst->slots[slot];
     vm.stack.values[vm.stack.size - argc - 1] = value;
-    call_value(value, argc);
+    return call_value(value, argc);
   }
 
-  return invoke_from_class(inst->clazz, name, argc);
+  lox_object_closure *method =
+      lox_object_class_get_method(inst->clazz, selector);
+  if (method == NULL) {
+    // This reports the error.
+    return invoke_from_class(inst->clazz, selector, argc);
+  }
+  entry = inline_cache_add(cache, inst->clazz, inst->shape);
+  if (entry != NULL) {
+    entry->slot = -1;
+    entry->as.method = method;
+  }
+  return call_closure(method, argc);
 }
 
-static bool invoke_from_class(lox_object_class *clazz, lox_value name,
+static bool invoke_from_class(lox_object_class *clazz, uint16_t selector,
                               int argc) {
-  lox_value method;
-  if (!lox_hash_table_get(clazz->methods, name, &method)) {
+  lox_object_closure *method = lox_object_class_get_method(clazz, selector);
+  if (method == NULL) {
     runtime_error("Undefined property '%s' in instance of '%s'.",
-                  ((lox_object_string *)name.as.object)->chars,
-                  clazz->name->chars);
+                  selector_name(selector), clazz->name->chars);
     return false;
   }
 
-  return call_closure((lox_object_closure *)method.as.object, argc);
+  return call_closure(method, argc);
 }
 
-static bool bind_method(lox_object_class *clazz, lox_value name) {
-  lox_value method;
-  if (!lox_hash_table_get(clazz->methods, name, &method)) {
+static bool bind_method(lox_object_class *clazz, uint16_t selector) {
+  lox_object_closure *method = lox_object_class_get_method(clazz, selector);
+  if (method == NULL) {
     // This function expects an instance to be sitting on top of the stack, so
     // we can say instance in the error messages aswell despite methods being
     // defined in classes.
     runtime_error("Undefined property '%s' in instance of '%s'.",
-                  ((lox_object_string *)name.as.object)->chars,
-                  clazz->name->chars);
+                  selector_name(selector), clazz->name->chars);
     return false;
   }
 
-  lox_object_bound_method *bound = lox_object_bound_method_new(
-      peekv(0), (lox_object_closure *)method.as.object);
+  bind_closure(method);
+  return true;
+}
+
+static void bind_closure(lox_object_closure *method) {
+  lox_object_bound_method *bound =
+      lox_object_bound_method_new(peekv(0), method);
   // Pop the instance off the top of the stack and replace it with the bound
   // method
   vm.stack.values[vm.stack.size - 1] =
       lox_value_from_object((lox_object *)bound);
+}
+
+static bool get_property(lox_object_instance *inst, uint16_t selector,
+                         lox_inline_cache *cache) {
+  lox_value name = vm.selectors.values[selector];
+  // First we check if a field with the name exists, then if nothing was found
+  // we look for a method.
+  if (inst->shape == NULL) {
+    lox_value value;
+    if (lox_object_instance_get_field(inst, name, &value)) {
+      vm.stack.values[vm.stack.size - 1] = value;
+      return true;
+    }
+    return bind_method(inst->clazz, selector);
+  }
+
+  lox_inline_cache_entry *entry;
+  int slot = lox_object_shape_get_slot(inst->shape, name);
+  if (slot != -1) {
+    entry = inline_cache_add(cache, inst->clazz, inst->shape);
+    if (entry != NULL)
+      entry->slot = slot;
+    vm.stack.values[vm.stack.size - 1] = inst->slots[slot];
+    return true;
+  }
 
+  lox_object_closure *method =
+      lox_object_class_get_method(inst->clazz, selector);
+  if (method == NULL) {
+    // This reports the error.
+    return bind_method(inst->clazz, selector);
+  }
+  entry = inline_cache_add(cache, inst->clazz, inst->shape);
+  if (entry != NULL) {
+    entry->slot = -1;
+    entry->as.method = method;
+  }
+  bind_closure(method);
   return true;
 }
 
+static void set_property(lox_object_instance *inst, uint16_t selector,
+                         lox_value value, lox_inline_cache *cache) {
+  lox_value name = vm.selectors.values[selector];
+  lox_object_shape *shape = inst->shape;
+  lox_object_instance_set_field(inst, name, value);
+  if (shape == NULL || inst->shape == NULL) {
+    return;
+  }
+
+  // The entry is keyed by the shape the instance had before the assignment, so
+  // that the next instance built the same way can take the same transition.
+  lox_inline_cache_entry *entry = inline_cache_add(cache, inst->clazz, shape);
+  if (entry != NULL) {
+    entry->slot = lox_object_shape_get_slot(inst->shape, name);
+    entry->as.transition = inst->shape == shape ? NULL : inst->shape;
+  }
+}
+
+static const char *selector_name(uint16_t selector) {
+  return ((lox_object_string *)lox_value_as_object(
+              vm.selectors.values[selector]))
+      ->chars;
+}
+
+static lox_inline_cache_entry *inline_cache_add(lox_inline_cache *cache,
+                                                lox_object_class *clazz,
+                                                lox_object_shape *shape) {
+  // Instances in dictionary mode don't have a fixed layout, so they can't be
+  // cached.
+  if (shape == NULL || cache->count == LOX_INLINE_CACHE_SIZE) {
+    return NULL;
+  }
+
+  lox_inline_cache_entry *entry = &cache->entries[cache->count++];
+  entry->clazz = clazz;
+  entry->shape = shape;
+  // The cache belongs to the function that is running. The caller fills in the
+  // rest of the entry, so the function is remembered whatever it refers to.
+  lox_gc_remember(
+      (lox_object *)vm.frames[vm.frame_count - 1].closure->function);
+  return entry;
+}
+
 static void print_settings() {
 #define SETI(name) printf("  " #name "=%i\n", lox_settings.name)
 #define SETF(name) printf("  " #name "=%f\n", lox_settings.name)
@@ -790,9 +1605,19 @@ static void print_settings() {
   SETI(array_minimum_capacity);
   SETI(array_scale_factor);
   SETI(gc_heap_grow_factor);
+  SETI(gc_young_size);
+  SETI(gc_slice_budget);
+  SETI(gc_stress);
   SETF(hash_table_load_factor);
   SETI(initial_stack_size);
+  SETI(max_stack_size);
+  SETI(initial_call_frames);
+  SETI(max_call_frames);
   SETI(max_local_count);
+  SETI(jit_threshold);
+  SETI(jit_loop_threshold);
+  SETI(optimization_level);
+  SETI(print_code);
 
 #undef SETF
 #undef SETI
@@ -44,6 +44,7 @@ class Test(NamedTuple):
     input: str | None
     output: str | None
     error: str | None
+    args: list[str]
     source_file: str
 
 
@@ -54,6 +55,7 @@ def make_test(dir: str, files: list[str]) -> Test | None:
     output = None
     source_file = None
     error = None
+    args = []
     for file in files:
         path = os.path.join(dir, file)
         if file == "out" or file == "output":
@@ -63,6 +65,8 @@ def make_test(dir: str, files: list[str]) -> Test | None:
             input = open(path).read()
         if file == "error":
             error = open(path).read()
+        if file == "args":
+            args = open(path).read().split()
         if os.path.splitext(file)[1] == ".lox":
             if source_file is not None:
                 print(
@@ -85,7 +89,7 @@ def make_test(dir: str, files: list[str]) -> Test | None:
         )
         return None
 
-    return Test(dir, input, output, error, source_file)
+    return Test(dir, input, output, error, args, source_file)
 
 
 def find_tests() -> tuple[dict[str, list[Test]], int]:
@@ -113,7 +117,7 @@ def find_tests() -> tuple[dict[str, list[Test]], int]:
 
 def run_test(clox_executable: str, test: Test) -> tuple[bool, str, str]:
     proc = subprocess.Popen(
-        [clox_executable, f"{test.source_file}"],
+        [clox_executable, *test.args, f"{test.source_file}"],
         stdin=PIPE,
         stdout=PIPE,
         stderr=PIPE,
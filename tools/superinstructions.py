@@ -0,0 +1,129 @@
+"""Chooses the superinstructions of the optimizer.
+
+Runs an interpreter built with LOX_PROFILE_OPCODE_PAIRS on every lox program of
+a corpus, adds up how often each pair of opcodes was executed, and writes the
+pairs that can be fused into private/superinstructions.h, most frequent first.
+
+Only pairs are fused. The longer sequences that run often, like two loads and
+an addition, end in an arithmetic or comparison instruction, which is quickened
+once its operands are known to be numbers, and fusing it would keep it from
+being quickened. Loads followed by a comparison and a jump are already covered
+by two superinstructions, such as OP_GET_LOCAL_CONSTANT and OP_LESS_JMP_FALSE.
+
+Usage: superinstructions.py <clox-profile> <corpus> <chunk.h> <output>
+"""
+
+import os
+import pathlib
+import re
+import subprocess
+import tempfile
+from collections import Counter
+from sys import argv
+
+# Every superinstruction the VM implements, keyed by the pair it replaces.
+CATALOG = {
+    ("OP_GET_LOCAL", "OP_GET_LOCAL"): "OP_GET_LOCAL_GET_LOCAL",
+    ("OP_GET_LOCAL", "OP_CONSTANT"): "OP_GET_LOCAL_CONSTANT",
+    ("OP_GET_LOCAL", "OP_GET_PROPERTY"): "OP_GET_LOCAL_GET_PROPERTY",
+    ("OP_EQ", "OP_JMP_FALSE"): "OP_EQ_JMP_FALSE",
+    ("OP_NEQ", "OP_JMP_FALSE"): "OP_NEQ_JMP_FALSE",
+    ("OP_GREATER", "OP_JMP_FALSE"): "OP_GREATER_JMP_FALSE",
+    ("OP_GREATEREQ", "OP_JMP_FALSE"): "OP_GREATEREQ_JMP_FALSE",
+    ("OP_LESS", "OP_JMP_FALSE"): "OP_LESS_JMP_FALSE",
+    ("OP_LESSEQ", "OP_JMP_FALSE"): "OP_LESSEQ_JMP_FALSE",
+}
+# Pairs executed less often than this share of all pairs are not worth an
+# entry.
+MIN_SHARE = 0.001
+TIMEOUT = 60
+
+
+def read_opcodes(chunk_h: str) -> list[str]:
+    source = pathlib.Path(chunk_h).read_text()
+    body = re.search(r"typedef enum[^{]*{(.*?)}\s*lox_op_code;", source, re.S)
+    body = re.sub(r"//[^\n]*", "", body.group(1))
+    return re.findall(r"\b(OP_\w+)\s*,", body)
+
+
+def base_opcode(name: str) -> str:
+    # Quickened instructions are only created at runtime, from the instruction
+    # the compiler emitted.
+    return name.removesuffix("_NUM")
+
+
+def profile(clox: str, corpus: str, opcodes: list[str]) -> Counter:
+    pairs = Counter()
+    with tempfile.TemporaryDirectory() as directory:
+        output = os.path.join(directory, "opcode-pairs.txt")
+        env = dict(os.environ, LOX_OPCODE_PAIRS_FILE=output)
+        for program in sorted(pathlib.Path(corpus).rglob("*.lox")):
+            try:
+                subprocess.run(
+                    [clox, str(program)],
+                    env=env,
+                    stdin=subprocess.DEVNULL,
+                    stdout=subprocess.DEVNULL,
+                    stderr=subprocess.DEVNULL,
+                    timeout=TIMEOUT,
+                )
+            except subprocess.TimeoutExpired:
+                print(f"Skipping {program}: timed out")
+        if not os.path.exists(output):
+            return pairs
+        with open(output) as file:
+            for line in file:
+                first, second, count = map(int, line.split())
+                if first >= len(opcodes) or second >= len(opcodes):
+                    continue
+                key = (base_opcode(opcodes[first]), base_opcode(opcodes[second]))
+                pairs[key] += count
+    return pairs
+
+
+def write_header(path: str, pairs: Counter):
+    total = sum(pairs.values())
+    chosen = [
+        (count, pair)
+        for pair, count in pairs.most_common()
+        if pair in CATALOG and total > 0 and count / total >= MIN_SHARE
+    ]
+
+    lines = [
+        "#pragma once",
+        "",
+        "// This file is generated by tools/superinstructions.py. To regenerate it from",
+        "// the opcode pairs executed on a corpus of programs, run:",
+        "//   cmake --build <build directory> --target superinstructions",
+        "//",
+        "// Each entry enables the fusion of two instructions into a superinstruction.",
+        "// Longer sequences aren't fused, see tools/superinstructions.py.",
+        "// Entries are sorted by how often the pair of instructions was executed, which",
+        "// is also the order in which the optimizer tries them.",
+        "// X(superinstruction, first instruction, second instruction)",
+    ]
+    for count, (first, second) in chosen:
+        lines.append(f"// {CATALOG[(first, second)]}: {count} of {total} pairs")
+    entries = [
+        f"  X({CATALOG[pair]}, {pair[0]}, {pair[1]})" for _, pair in chosen
+    ]
+    lines.append("#define LOX_SUPERINSTRUCTIONS(X)")
+    lines += entries
+    # Align the line continuations like clang-format does.
+    for i in range(len(lines) - len(entries) - 1, len(lines) - 1):
+        lines[i] = f"{lines[i]:<79}\\"
+    pathlib.Path(path).write_text("\n".join(lines) + "\n")
+
+
+def main():
+    if len(argv) != 5:
+        print(__doc__)
+        exit(1)
+    clox, corpus, chunk_h, output = argv[1:]
+    pairs = profile(clox, corpus, read_opcodes(chunk_h))
+    write_header(output, pairs)
+    print(f"Wrote {output}")
+
+
+if __name__ == "__main__":
+    main()